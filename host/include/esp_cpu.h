@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+/* Host stand-in: nanoseconds scaled to a nominal 240 MHz core clock */
+uint32_t esp_cpu_get_cycle_count(void);
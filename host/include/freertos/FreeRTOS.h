@@ -0,0 +1,37 @@
+#pragma once
+/*
+ * Host stand-in for the subset of FreeRTOS used by the firmware. Tasks are
+ * POSIX threads, queues/semaphores/event groups are mutex + condvar based and
+ * one tick is one millisecond (CONFIG_FREERTOS_HZ=1000 as on the device).
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define errQUEUE_FULL 0
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS (1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * CONFIG_FREERTOS_HZ) / 1000))
+#define pdTICKS_TO_MS(t) ((uint32_t)(((uint64_t)(t) * 1000) / CONFIG_FREERTOS_HZ))
+#define configMAX_PRIORITIES 25
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 4
+#define tskNO_AFFINITY 0x7fffffff
+#define tskIDLE_PRIORITY 0
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+typedef int portMUX_TYPE;
+#define portENTER_CRITICAL(mux) ((void)(mux), host_critical_enter())
+#define portEXIT_CRITICAL(mux) ((void)(mux), host_critical_exit())
+
+void host_critical_enter(void);
+void host_critical_exit(void);
@@ -0,0 +1,43 @@
+#pragma once
+
+typedef enum {
+	LEDC_LOW_SPEED_MODE,
+	LEDC_SPEED_MODE_MAX
+} ledc_mode_t;
+
+typedef enum {
+	LEDC_TIMER_0,
+	LEDC_TIMER_1,
+	LEDC_TIMER_2,
+	LEDC_TIMER_3,
+	LEDC_TIMER_MAX
+} ledc_timer_t;
+
+typedef enum {
+	LEDC_CHANNEL_0,
+	LEDC_CHANNEL_1,
+	LEDC_CHANNEL_2,
+	LEDC_CHANNEL_3,
+	LEDC_CHANNEL_4,
+	LEDC_CHANNEL_5,
+	LEDC_CHANNEL_6,
+	LEDC_CHANNEL_7,
+	LEDC_CHANNEL_MAX
+} ledc_channel_t;
+
+typedef enum {
+	LEDC_TIMER_1_BIT = 1,
+	LEDC_TIMER_8_BIT = 8,
+	LEDC_TIMER_10_BIT = 10,
+	LEDC_TIMER_13_BIT = 13,
+	LEDC_TIMER_14_BIT = 14,
+	LEDC_TIMER_BIT_MAX
+} ledc_timer_bit_t;
+
+typedef enum {
+	LEDC_AUTO_CLK = 0
+} ledc_clk_cfg_t;
+
+typedef enum {
+	LEDC_INTR_DISABLE = 0
+} ledc_intr_type_t;
@@ -0,0 +1,7 @@
+#pragma once
+/*
+ * Force-included into every firmware translation unit of the host build.
+ * lwIP's socket headers pull in close()/read() on the device, glibc needs
+ * <unistd.h> for that.
+ */
+#include <unistd.h>
@@ -0,0 +1,81 @@
+#pragma once
+/*
+ * Host stand-in for esp-mqtt. The "broker" is a local line protocol: the client
+ * reads "<topic> <payload>" lines from a TCP socket (or stdin when no port is
+ * configured) and writes every publish back as "<topic> <payload>". See
+ * host/src/mqtt_client.c.
+ */
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_event.h"
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum {
+	MQTT_EVENT_ANY = -1,
+	MQTT_EVENT_ERROR = 0,
+	MQTT_EVENT_CONNECTED,
+	MQTT_EVENT_DISCONNECTED,
+	MQTT_EVENT_SUBSCRIBED,
+	MQTT_EVENT_UNSUBSCRIBED,
+	MQTT_EVENT_PUBLISHED,
+	MQTT_EVENT_DATA,
+	MQTT_EVENT_BEFORE_CONNECT,
+	MQTT_EVENT_DELETED,
+} esp_mqtt_event_id_t;
+
+typedef struct {
+	int error_type;
+} esp_mqtt_error_codes_t;
+
+typedef struct {
+	esp_mqtt_event_id_t event_id;
+	esp_mqtt_client_handle_t client;
+	char *data;
+	int data_len;
+	int total_data_len;
+	int current_data_offset;
+	char *topic;
+	int topic_len;
+	int msg_id;
+	int qos;
+	int retain;
+	esp_mqtt_error_codes_t *error_handle;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef struct {
+	struct {
+		struct {
+			const char *uri;
+		} address;
+	} broker;
+	struct {
+		const char *client_id;
+	} credentials;
+	struct {
+		struct {
+			const char *topic;
+			const char *msg;
+			int msg_len;
+			int qos;
+			int retain;
+		} last_will;
+	} session;
+	struct {
+		int size;
+		int out_size;
+	} buffer;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+					esp_mqtt_event_id_t event,
+					esp_event_handler_t event_handler,
+					void *event_handler_arg);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos);
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
+			const char *data, int len, int qos, int retain);
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client);
@@ -0,0 +1,7 @@
+#pragma once
+/* Host stand-in for the generated sdkconfig.h */
+
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_CAMERA_CORE0 1
+#define CONFIG_FREERTOS_USE_TRACE_FACILITY 1
+#define CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS 1
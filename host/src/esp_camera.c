@@ -0,0 +1,296 @@
+/*
+ * File-backed esp32-camera stand-in.
+ *
+ * With HOST_CAMERA_FRAMES pointing to a directory, frames are replayed from raw
+ * big-endian RGB565 files (240x240, as configured in camera_lib.c). Files named
+ * "<angle>.rgb565" are picked by the angle the servo is currently commanded to,
+ * any other *.rgb565 files are replayed in name order. Without recordings a
+ * synthetic scene is rendered: an asymmetric bright shape rotated by the servo
+ * angle, which is enough to exercise `fetch` end to end.
+ */
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_camera.h"
+#include "esp_log.h"
+#include "host_stubs.h"
+
+#define WIDTH 240
+#define HEIGHT 240
+#define MAX_FRAMES 256
+#define MAX_FB 4
+
+
+static const char *TAG = "host_camera";
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static camera_fb_t g_fbs[MAX_FB];
+static bool g_fb_taken[MAX_FB];
+static size_t g_fb_count = 2;
+static char *g_frame_files[MAX_FRAMES];
+static int g_frame_angles[MAX_FRAMES];
+static size_t g_frame_num = 0;
+static size_t g_next_frame = 0;
+static bool g_by_angle = false;
+
+static int dummy_setter(sensor_t *sensor, int level)
+{
+	return 0;
+}
+
+static int dummy_framesize(sensor_t *sensor, framesize_t framesize)
+{
+	return 0;
+}
+
+static sensor_t g_sensor = {
+	.set_brightness = dummy_setter,
+	.set_contrast = dummy_setter,
+	.set_saturation = dummy_setter,
+	.set_framesize = dummy_framesize
+};
+
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void scan_frames(const char *dir_path)
+{
+	DIR *dir = opendir(dir_path);
+	struct dirent *entry;
+
+	if (!dir) {
+		ESP_LOGW(TAG, "Cannot open %s, using synthetic frames", dir_path);
+		return;
+	}
+
+	while ((entry = readdir(dir)) && g_frame_num < MAX_FRAMES) {
+		const char *ext = strrchr(entry->d_name, '.');
+		if (!ext || strcmp(ext, ".rgb565")) {
+			continue;
+		}
+
+		size_t len = strlen(dir_path) + strlen(entry->d_name) + 2;
+		g_frame_files[g_frame_num] = malloc(len);
+		snprintf(g_frame_files[g_frame_num], len, "%s/%s", dir_path, entry->d_name);
+		++g_frame_num;
+	}
+	closedir(dir);
+
+	qsort(g_frame_files, g_frame_num, sizeof(char *), cmp_str);
+
+	g_by_angle = g_frame_num > 0;
+	for (size_t i = 0; i < g_frame_num; ++i) {
+		const char *name = strrchr(g_frame_files[i], '/') + 1;
+		char *end;
+
+		g_frame_angles[i] = (int)strtol(name, &end, 10);
+		if (end == name || strcmp(end, ".rgb565")) {
+			g_by_angle = false;
+		}
+	}
+
+	ESP_LOGI(TAG, "Replaying %zu frames from %s (%s)", g_frame_num, dir_path,
+		g_by_angle ? "by servo angle" : "in order");
+}
+
+static bool load_frame(uint8_t *buf, size_t len)
+{
+	size_t idx;
+
+	if (g_by_angle) {
+		int angle = (int)lroundf(host_servo_angle());
+		int best_diff = 1 << 30;
+
+		idx = 0;
+		for (size_t i = 0; i < g_frame_num; ++i) {
+			int diff = abs(g_frame_angles[i] - angle);
+			if (diff < best_diff) {
+				best_diff = diff;
+				idx = i;
+			}
+		}
+	} else {
+		idx = g_next_frame++ % g_frame_num;
+	}
+
+	FILE *file = fopen(g_frame_files[idx], "rb");
+	if (!file) {
+		return false;
+	}
+
+	size_t read = fread(buf, 1, len, file);
+	fclose(file);
+
+	return read == len;
+}
+
+/*
+ * An arrow-like shape: a bar with a triangular head, plus a small off-centre
+ * dot, so that neither rotational nor mirror symmetry hides the angle.
+ */
+static void render_synthetic(uint8_t *buf)
+{
+	const float rad = (host_servo_angle() - 90.0f) * (float)M_PI / 180.0f;
+	const float c = cosf(rad), s = sinf(rad);
+	const float cx = WIDTH / 2.0f, cy = HEIGHT / 2.0f;
+
+	for (int y = 0; y < HEIGHT; ++y) {
+		for (int x = 0; x < WIDTH; ++x) {
+			float dx = x - cx, dy = y - cy;
+			float u = c * dx + s * dy;
+			float v = -s * dx + c * dy;
+			bool in = (u > -70 && u < 30 && fabsf(v) < 14) ||
+				(u >= 30 && u < 80 && fabsf(v) < (80 - u) * 0.8f) ||
+				((u + 40) * (u + 40) + (v - 45) * (v - 45) < 15 * 15);
+			uint16_t noise = (uint16_t)((x * 7 + y * 13) & 3);
+			uint16_t px = in ? (uint16_t)(0xE71C + noise) : (uint16_t)(0x2104 + noise);
+
+			buf[(y * WIDTH + x) * 2] = px >> 8;
+			buf[(y * WIDTH + x) * 2 + 1] = px & 0xff;
+		}
+	}
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config)
+{
+	const char *dir = getenv("HOST_CAMERA_FRAMES");
+
+	g_fb_count = config->fb_count < MAX_FB ? config->fb_count : MAX_FB;
+
+	for (size_t i = 0; i < g_fb_count; ++i) {
+		g_fbs[i].buf = malloc(WIDTH * HEIGHT * 2);
+		if (!g_fbs[i].buf) {
+			return ESP_ERR_NO_MEM;
+		}
+		g_fbs[i].len = WIDTH * HEIGHT * 2;
+		g_fbs[i].width = WIDTH;
+		g_fbs[i].height = HEIGHT;
+		g_fbs[i].format = PIXFORMAT_RGB565;
+	}
+
+	if (dir) {
+		scan_frames(dir);
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t esp_camera_deinit(void)
+{
+	return ESP_OK;
+}
+
+camera_fb_t *esp_camera_fb_get(void)
+{
+	camera_fb_t *fb = NULL;
+
+	pthread_mutex_lock(&g_lock);
+	for (size_t i = 0; i < g_fb_count; ++i) {
+		if (!g_fb_taken[i]) {
+			g_fb_taken[i] = true;
+			fb = &g_fbs[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	if (!fb) {
+		ESP_LOGE(TAG, "All %zu frame buffers are taken", g_fb_count);
+		return NULL;
+	}
+
+	// Roughly one frame period of the OV2640 at 240x240
+	host_sleep_us(40000);
+
+	if (!(g_frame_num && load_frame(fb->buf, fb->len))) {
+		render_synthetic(fb->buf);
+	}
+	gettimeofday(&fb->timestamp, NULL);
+
+	return fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+	pthread_mutex_lock(&g_lock);
+	for (size_t i = 0; i < g_fb_count; ++i) {
+		if (fb == &g_fbs[i]) {
+			g_fb_taken[i] = false;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+sensor_t *esp_camera_sensor_get(void)
+{
+	return &g_sensor;
+}
+
+bool frame2bmp(camera_fb_t *fb, uint8_t **out, size_t *out_len)
+{
+	const size_t header_len = 54;
+	const size_t row_len = fb->width * 3;
+	const size_t len = header_len + row_len * fb->height;
+	uint8_t *bmp = malloc(len);
+
+	if (!bmp) {
+		return false;
+	}
+
+	memset(bmp, 0, header_len);
+	bmp[0] = 'B';
+	bmp[1] = 'M';
+	host_put_le32(bmp + 2, (uint32_t)len);
+	host_put_le32(bmp + 10, (uint32_t)header_len);
+	host_put_le32(bmp + 14, 40);
+	host_put_le32(bmp + 18, (uint32_t)fb->width);
+	host_put_le32(bmp + 22, (uint32_t)-(int32_t)fb->height);
+	bmp[26] = 1;
+	bmp[28] = 24;
+	host_put_le32(bmp + 34, (uint32_t)(row_len * fb->height));
+
+	uint8_t *dst = bmp + header_len;
+	for (size_t i = 0; i < fb->width * fb->height; ++i) {
+		if (fb->format == PIXFORMAT_GRAYSCALE) {
+			dst[0] = dst[1] = dst[2] = fb->buf[i];
+		} else {
+			uint16_t px = fb->buf[i * 2] << 8 | fb->buf[i * 2 + 1];
+			dst[0] = (px & 0x1f) << 3;
+			dst[1] = (px >> 5 & 0x3f) << 2;
+			dst[2] = (px >> 11) << 3;
+		}
+		dst += 3;
+	}
+
+	*out = bmp;
+	*out_len = len;
+
+	return true;
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
+	pixformat_t format, uint8_t quality, uint8_t **out, size_t *out_len)
+{
+	ESP_LOGE(TAG, "JPEG encoding is not available in the host build");
+
+	return false;
+}
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out, size_t *out_len)
+{
+	return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format,
+		quality, out, out_len);
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+	ESP_LOGE(TAG, "JPEG encoding is not available in the host build");
+
+	return false;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/random.h>
+#include "esp_system.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_mac.h"
+#include "esp_heap_caps.h"
+#include "host_stubs.h"
+
+// Nominal ESP32-CAM memory so free/min-free figures look like the device's
+#define HOST_INTERNAL_RAM (320 * 1024)
+#define HOST_PSRAM (4 * 1024 * 1024)
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t heap_in_use(void)
+{
+	struct mallinfo2 info = mallinfo2();
+
+	return info.uordblks;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch (code) {
+	case ESP_OK: return "ESP_OK";
+	case ESP_FAIL: return "ESP_FAIL";
+	case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+	case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+	case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+	case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+	case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+	case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+	case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+	case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+	case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+	case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+	case ESP_ERR_NOT_FINISHED: return "ESP_ERR_NOT_FINISHED";
+	default: return "UNKNOWN ERROR";
+	}
+}
+
+void esp_restart(void)
+{
+	fprintf(stderr, "esp_restart() called, exiting\n");
+	exit(0);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+	size_t used = heap_in_use();
+	size_t total = HOST_INTERNAL_RAM + HOST_PSRAM;
+
+	return used < total ? (uint32_t)(total - used) : 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+	static uint32_t min_free = UINT32_MAX;
+	uint32_t free_now = esp_get_free_heap_size();
+
+	if (free_now < min_free) {
+		min_free = free_now;
+	}
+
+	return min_free;
+}
+
+uint32_t esp_random(void)
+{
+	uint32_t value;
+
+	if (getrandom(&value, sizeof(value), 0) != sizeof(value)) {
+		value = (uint32_t)rand();
+	}
+
+	return value;
+}
+
+int64_t esp_timer_get_time(void)
+{
+	static uint64_t boot_ns = 0;
+
+	if (!boot_ns) {
+		boot_ns = now_ns();
+	}
+
+	return (int64_t)((now_ns() - boot_ns) / 1000);
+}
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+	return (uint32_t)(now_ns() * 240 / 1000);
+}
+
+/*
+ * $HOST_MAC (12 hex digits) tells host instances sharing a broker apart
+ */
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+	uint8_t host_mac[6] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01};
+	const char *env = getenv("HOST_MAC");
+
+	if (env && strlen(env) == 12) {
+		for (int i = 0; i < 6; ++i) {
+			unsigned int byte;
+
+			if (sscanf(env + 2 * i, "%2x", &byte) != 1) {
+				return ESP_ERR_INVALID_ARG;
+			}
+			host_mac[i] = byte;
+		}
+	}
+
+	memcpy(mac, host_mac, sizeof(host_mac));
+	mac[5] += type;
+
+	return ESP_OK;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+	return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+	free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+	size_t total = caps & MALLOC_CAP_SPIRAM ? HOST_PSRAM : HOST_INTERNAL_RAM;
+	size_t used = heap_in_use();
+
+	// Attribute everything to PSRAM, internal RAM only shows a fixed baseline
+	if (caps & MALLOC_CAP_SPIRAM) {
+		return used < total ? total - used : 0;
+	}
+
+	return total / 2;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+	static size_t min_free[2] = {SIZE_MAX, SIZE_MAX};
+	int idx = (caps & MALLOC_CAP_SPIRAM) != 0;
+	size_t free_now = heap_caps_get_free_size(caps);
+
+	if (free_now < min_free[idx]) {
+		min_free[idx] = free_now;
+	}
+
+	return min_free[idx];
+}
+
+void host_sleep_us(uint64_t us)
+{
+	struct timespec ts = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+
+	nanosleep(&ts, NULL);
+}
+
+void host_put_le32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = value & 0xff;
+	dst[1] = value >> 8 & 0xff;
+	dst[2] = value >> 16 & 0xff;
+	dst[3] = value >> 24 & 0xff;
+}
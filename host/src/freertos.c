@@ -0,0 +1,552 @@
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#define MAX_TASKS 32
+
+
+struct host_task {
+	pthread_t thread;
+	TaskFunction_t fn;
+	void *arg;
+	const char *name;
+	UBaseType_t number;
+	UBaseType_t priority;
+	BaseType_t core_id;
+	void *tls[configNUM_THREAD_LOCAL_STORAGE_POINTERS];
+	bool alive;
+};
+
+struct host_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint8_t *items;
+	size_t item_size;
+	size_t length;
+	size_t head;
+	size_t count;
+};
+
+struct host_event_group {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	EventBits_t bits;
+};
+
+
+static pthread_mutex_t g_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_critical = PTHREAD_MUTEX_INITIALIZER;
+static struct host_task *g_tasks[MAX_TASKS];
+static UBaseType_t g_task_count = 0;
+static __thread struct host_task *g_current = NULL;
+
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void deadline_from_ticks(struct timespec *ts, TickType_t ticks)
+{
+	uint64_t ms = pdTICKS_TO_MS(ticks);
+
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void init_cond(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Wait on a condition with FreeRTOS timeout semantics: 0 polls, portMAX_DELAY
+ * blocks forever. Returns false on timeout.
+ */
+static bool cond_wait_ticks(pthread_cond_t *cond, pthread_mutex_t *lock,
+			TickType_t ticks, const struct timespec *deadline)
+{
+	if (ticks == 0) {
+		return false;
+	}
+	if (ticks == portMAX_DELAY) {
+		pthread_cond_wait(cond, lock);
+		return true;
+	}
+
+	return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static struct host_task *register_task(const char *name, UBaseType_t priority,
+				BaseType_t core_id)
+{
+	struct host_task *task = calloc(1, sizeof(*task));
+	if (!task) {
+		abort();
+	}
+
+	task->name = name;
+	task->priority = priority;
+	task->core_id = core_id;
+	task->alive = true;
+
+	pthread_mutex_lock(&g_tasks_lock);
+	task->number = g_task_count;
+	if (g_task_count < MAX_TASKS) {
+		g_tasks[g_task_count++] = task;
+	}
+	pthread_mutex_unlock(&g_tasks_lock);
+
+	return task;
+}
+
+static struct host_task *current_task(void)
+{
+	if (!g_current) {
+		g_current = register_task("main", 1, 0);
+		g_current->thread = pthread_self();
+	}
+
+	return g_current;
+}
+
+static void *task_trampoline(void *arg)
+{
+	struct host_task *task = arg;
+
+	g_current = task;
+	task->fn(task->arg);
+
+	// FreeRTOS tasks must not return, mirror the device by treating it as delete
+	vTaskDelete(NULL);
+
+	return NULL;
+}
+
+void host_critical_enter(void)
+{
+	pthread_mutex_lock(&g_critical);
+}
+
+void host_critical_exit(void)
+{
+	pthread_mutex_unlock(&g_critical);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+				uint32_t stack_depth, void *arg,
+				UBaseType_t priority, TaskHandle_t *handle,
+				BaseType_t core_id)
+{
+	struct host_task *task = register_task(name, priority, core_id);
+
+	task->fn = fn;
+	task->arg = arg;
+
+	if (pthread_create(&task->thread, NULL, task_trampoline, task) != 0) {
+		task->alive = false;
+		return pdFAIL;
+	}
+	pthread_detach(task->thread);
+
+	if (handle) {
+		*handle = task;
+	}
+
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	if (!task || task == g_current) {
+		current_task()->alive = false;
+		pthread_exit(NULL);
+	}
+
+	task->alive = false;
+	pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	uint64_t us = (uint64_t)pdTICKS_TO_MS(ticks) * 1000;
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000
+	};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t period)
+{
+	const TickType_t now = xTaskGetTickCount();
+
+	*previous_wake += period;
+
+	// Already past it: returns right away, like FreeRTOS
+	if ((TickType_t)(*previous_wake - now) <= period) {
+		vTaskDelay(*previous_wake - now);
+	}
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(monotonic_us() / (1000000 / CONFIG_FREERTOS_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return current_task();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+	BaseType_t core = current_task()->core_id;
+
+	return core == tskNO_AFFINITY ? 0 : core;
+}
+
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index, void *value)
+{
+	if (!task) {
+		task = current_task();
+	}
+	if (index >= 0 && index < configNUM_THREAD_LOCAL_STORAGE_POINTERS) {
+		task->tls[index] = value;
+	}
+}
+
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index)
+{
+	if (!task) {
+		task = current_task();
+	}
+	if (index >= 0 && index < configNUM_THREAD_LOCAL_STORAGE_POINTERS) {
+		return task->tls[index];
+	}
+
+	return NULL;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+	UBaseType_t alive = 0;
+
+	pthread_mutex_lock(&g_tasks_lock);
+	for (UBaseType_t i = 0; i < g_task_count; ++i) {
+		alive += g_tasks[i]->alive;
+	}
+	pthread_mutex_unlock(&g_tasks_lock);
+
+	return alive;
+}
+
+/*
+ * Per-thread CPU time stands in for the run-time counter, the total is the
+ * wall time since the first call multiplied by the two ESP32 cores.
+ */
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size,
+				uint32_t *total_run_time)
+{
+	static uint64_t start_us = 0;
+	UBaseType_t n = 0;
+
+	if (!start_us) {
+		start_us = monotonic_us();
+	}
+
+	pthread_mutex_lock(&g_tasks_lock);
+	for (UBaseType_t i = 0; i < g_task_count && n < size; ++i) {
+		struct host_task *task = g_tasks[i];
+		clockid_t cid;
+		struct timespec ts = {0};
+
+		if (!task->alive) {
+			continue;
+		}
+		if (pthread_getcpuclockid(task->thread, &cid) == 0) {
+			clock_gettime(cid, &ts);
+		}
+
+		status[n] = (TaskStatus_t) {
+			.xHandle = task,
+			.pcTaskName = task->name,
+			.xTaskNumber = task->number,
+			.eCurrentState = eReady,
+			.uxCurrentPriority = task->priority,
+			.uxBasePriority = task->priority,
+			.ulRunTimeCounter = (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000),
+			.xCoreID = task->core_id
+		};
+		++n;
+	}
+	pthread_mutex_unlock(&g_tasks_lock);
+
+	if (total_run_time) {
+		*total_run_time = (uint32_t)((monotonic_us() - start_us) * 2);
+	}
+
+	return n;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	struct host_queue *queue = calloc(1, sizeof(*queue));
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->items = calloc(length, item_size ? item_size : 1);
+	if (!queue->items) {
+		free(queue);
+		return NULL;
+	}
+	queue->item_size = item_size;
+	queue->length = length;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	init_cond(&queue->not_empty);
+	init_cond(&queue->not_full);
+
+	return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+	if (!queue) {
+		return;
+	}
+
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	free(queue->items);
+	free(queue);
+}
+
+BaseType_t xQueueGenericSend(QueueHandle_t queue, const void *item,
+			TickType_t ticks, bool front)
+{
+	struct timespec deadline;
+	BaseType_t ret = pdPASS;
+
+	deadline_from_ticks(&deadline, ticks);
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->length) {
+		if (!cond_wait_ticks(&queue->not_full, &queue->lock, ticks, &deadline)) {
+			ret = errQUEUE_FULL;
+			goto out;
+		}
+	}
+
+	size_t slot;
+	if (front) {
+		queue->head = (queue->head + queue->length - 1) % queue->length;
+		slot = queue->head;
+	} else {
+		slot = (queue->head + queue->count) % queue->length;
+	}
+	if (queue->item_size && item) {
+		memcpy(queue->items + slot * queue->item_size, item, queue->item_size);
+	}
+	++queue->count;
+	pthread_cond_signal(&queue->not_empty);
+
+out:
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+static BaseType_t queue_take(QueueHandle_t queue, void *item, TickType_t ticks, bool remove)
+{
+	struct timespec deadline;
+	BaseType_t ret = pdPASS;
+
+	deadline_from_ticks(&deadline, ticks);
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0) {
+		if (!cond_wait_ticks(&queue->not_empty, &queue->lock, ticks, &deadline)) {
+			ret = pdFAIL;
+			goto out;
+		}
+	}
+
+	if (queue->item_size && item) {
+		memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+	}
+	if (remove) {
+		queue->head = (queue->head + 1) % queue->length;
+		--queue->count;
+		pthread_cond_signal(&queue->not_full);
+	}
+
+out:
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+	return queue_take(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+	return queue_take(queue, item, ticks, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	UBaseType_t count = queue->count;
+	pthread_mutex_unlock(&queue->lock);
+
+	return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	UBaseType_t spaces = queue->length - queue->count;
+	pthread_mutex_unlock(&queue->lock);
+
+	return spaces;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->head = 0;
+	queue->count = 0;
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+
+	return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+	SemaphoreHandle_t sem = xQueueCreate(max_count, 0);
+
+	for (UBaseType_t i = 0; sem && i < initial_count; ++i) {
+		xSemaphoreGive(sem);
+	}
+
+	return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+
+	if (mutex) {
+		xSemaphoreGive(mutex);
+	}
+
+	return mutex;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+	struct host_event_group *group = calloc(1, sizeof(*group));
+	if (!group) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&group->lock, NULL);
+	init_cond(&group->changed);
+
+	return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	pthread_mutex_lock(&group->lock);
+	group->bits |= bits;
+	EventBits_t ret = group->bits;
+	pthread_cond_broadcast(&group->changed);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	pthread_mutex_lock(&group->lock);
+	EventBits_t ret = group->bits;
+	group->bits &= ~bits;
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	pthread_mutex_lock(&group->lock);
+	EventBits_t ret = group->bits;
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+				BaseType_t clear_on_exit, BaseType_t wait_all,
+				TickType_t ticks)
+{
+	struct timespec deadline;
+
+	deadline_from_ticks(&deadline, ticks);
+
+	pthread_mutex_lock(&group->lock);
+	for (;;) {
+		EventBits_t set = group->bits & bits;
+
+		if (wait_all ? set == bits : set != 0) {
+			break;
+		}
+		if (!cond_wait_ticks(&group->changed, &group->lock, ticks, &deadline)) {
+			break;
+		}
+	}
+
+	EventBits_t ret = group->bits;
+	if (clear_on_exit && (wait_all ? (ret & bits) == bits : (ret & bits) != 0)) {
+		group->bits &= ~bits;
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
@@ -0,0 +1,7 @@
+#pragma once
+/* Helpers shared by the host stand-ins, not visible to the firmware sources */
+#include <stdint.h>
+
+void host_sleep_us(uint64_t us);
+void host_put_le32(uint8_t *dst, uint32_t value);
+float host_servo_angle(void);
@@ -0,0 +1,145 @@
+/*
+ * Recording LEDC stand-in. Duty updates are kept per channel and appended to
+ * $HOST_LEDC_LOG as "<us> <channel> <duty>" lines. The servo channel is also
+ * turned into a simulated shaft position that slews at a typical SG90 speed,
+ * which the camera stand-in uses to render/pick frames.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "host_stubs.h"
+
+#define SERVO_CHANNEL LEDC_CHANNEL_7
+#define SERVO_PERIOD_US 20000.0f
+#define SERVO_MIN_US 500.0f
+#define SERVO_MAX_US 2500.0f
+#define SERVO_DEG_PER_US (60.0f / 100000.0f)  // 0.1 s / 60°
+
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_pending[LEDC_CHANNEL_MAX];
+static uint32_t g_duty[LEDC_CHANNEL_MAX];
+static uint32_t g_resolution[LEDC_TIMER_MAX];
+static ledc_timer_t g_channel_timer[LEDC_CHANNEL_MAX];
+static FILE *g_log = NULL;
+static bool g_log_checked = false;
+
+static struct {
+	float from;
+	float to;
+	int64_t since_us;
+} g_servo = {90.0f, 90.0f, 0};
+
+
+static float duty_to_angle(uint32_t duty, uint32_t resolution)
+{
+	float full = (float)((1u << resolution) - 1);
+	float width = duty / full * SERVO_PERIOD_US;
+
+	return (width - SERVO_MIN_US) / (SERVO_MAX_US - SERVO_MIN_US) * 180.0f;
+}
+
+static float servo_position(int64_t now)
+{
+	float dist = g_servo.to - g_servo.from;
+	float travel = (now - g_servo.since_us) * SERVO_DEG_PER_US;
+
+	if (travel >= (dist < 0 ? -dist : dist)) {
+		return g_servo.to;
+	}
+
+	return g_servo.from + (dist < 0 ? -travel : travel);
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf)
+{
+	if (timer_conf->timer_num >= LEDC_TIMER_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	g_resolution[timer_conf->timer_num] = timer_conf->duty_resolution;
+
+	return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *channel_conf)
+{
+	if (channel_conf->channel >= LEDC_CHANNEL_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	g_channel_timer[channel_conf->channel] = channel_conf->timer_sel;
+	g_pending[channel_conf->channel] = channel_conf->duty;
+
+	return ledc_update_duty(channel_conf->speed_mode, channel_conf->channel);
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t duty)
+{
+	if (channel >= LEDC_CHANNEL_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pthread_mutex_lock(&g_lock);
+	g_pending[channel] = duty;
+	pthread_mutex_unlock(&g_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+	int64_t now = esp_timer_get_time();
+
+	if (channel >= LEDC_CHANNEL_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pthread_mutex_lock(&g_lock);
+	g_duty[channel] = g_pending[channel];
+
+	if (channel == SERVO_CHANNEL) {
+		uint32_t resolution = g_resolution[g_channel_timer[channel]];
+		float target = duty_to_angle(g_duty[channel], resolution);
+
+		// A zero duty means no pulses, the shaft stays where it is
+		if (g_duty[channel] && target >= -5.0f && target <= 185.0f) {
+			g_servo.from = servo_position(now);
+			g_servo.to = target;
+			g_servo.since_us = now;
+		}
+	}
+
+	if (!g_log_checked) {
+		const char *path = getenv("HOST_LEDC_LOG");
+
+		g_log = path ? fopen(path, "w") : NULL;
+		g_log_checked = true;
+	}
+	if (g_log) {
+		fprintf(g_log, "%lld %d %u\n", (long long)now, channel, g_duty[channel]);
+		fflush(g_log);
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+	pthread_mutex_lock(&g_lock);
+	uint32_t duty = channel < LEDC_CHANNEL_MAX ? g_duty[channel] : 0;
+	pthread_mutex_unlock(&g_lock);
+
+	return duty;
+}
+
+float host_servo_angle(void)
+{
+	pthread_mutex_lock(&g_lock);
+	float angle = servo_position(esp_timer_get_time());
+	pthread_mutex_unlock(&g_lock);
+
+	return angle;
+}
@@ -0,0 +1,14 @@
+#include <unistd.h>
+
+void app_main(void);
+
+
+int main(void)
+{
+	app_main();
+
+	// On the device app_main() returns and the other tasks keep running
+	for (;;) {
+		pause();
+	}
+}
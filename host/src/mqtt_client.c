@@ -0,0 +1,507 @@
+/*
+ * esp-mqtt stand-in.
+ *
+ * With a broker URI (mqtt://host[:port], overridable by $HOST_MQTT_URI) it
+ * speaks a minimal MQTT 3.1.1 client: CONNECT, SUBSCRIBE, PUBLISH (QoS 0/1),
+ * PUBACK, PINGREQ and a last will, which is enough to drive the host firmware with
+ * mosquitto_pub/sub, repl.sh and the benchmark tools. With a bare "mqtt://"
+ * it falls back to a line protocol on stdin/stdout: every input line is
+ * delivered to the first subscribed topic and every publish is printed as
+ * "<topic> <payload>".
+ */
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mqtt_client.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define MAX_SUBS 8
+#define KEEPALIVE_S 60
+// Unacknowledged QoS 1 messages whose size is remembered for the outbox
+#define MAX_INFLIGHT 256
+
+
+struct esp_mqtt_client {
+	char host[128];
+	char port[8];
+	char client_id[64];
+	char will_topic[128];  // empty for no last will
+	char will_msg[128];
+	uint8_t will_flags;
+	bool line_mode;
+	int sockfd;
+	pthread_mutex_t tx_lock;
+	esp_event_handler_t handler;
+	void *handler_arg;
+	char *subs[MAX_SUBS];
+	int sub_count;
+	uint16_t next_id;
+	int outbox;  // bytes of unacknowledged QoS 1 messages, like esp-mqtt
+	int inflight[MAX_INFLIGHT];
+};
+
+
+static const char *TAG = "host_mqtt";
+
+
+static void dispatch(esp_mqtt_client_handle_t client, esp_mqtt_event_t *event)
+{
+	event->client = client;
+	if (client->handler) {
+		client->handler(client->handler_arg, "MQTT_EVENTS", event->event_id, event);
+	}
+}
+
+static bool topic_matches(const char *filter, const char *topic, size_t topic_len)
+{
+	const char *t = topic, *end = topic + topic_len;
+
+	while (*filter) {
+		if (*filter == '#') {
+			return true;
+		}
+		if (*filter == '+') {
+			while (t < end && *t != '/') {
+				++t;
+			}
+			++filter;
+			continue;
+		}
+		if (t == end || *filter != *t) {
+			return false;
+		}
+		++filter;
+		++t;
+	}
+
+	return t == end;
+}
+
+static bool is_subscribed(esp_mqtt_client_handle_t client, const char *topic, size_t len)
+{
+	for (int i = 0; i < client->sub_count; ++i) {
+		if (topic_matches(client->subs[i], topic, len)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void deliver(esp_mqtt_client_handle_t client, char *topic, int topic_len,
+		char *data, int data_len)
+{
+	esp_mqtt_event_t event = {
+		.event_id = MQTT_EVENT_DATA,
+		.topic = topic,
+		.topic_len = topic_len,
+		.data = data,
+		.data_len = data_len,
+		.total_data_len = data_len
+	};
+
+	dispatch(client, &event);
+}
+
+static bool send_all(int sockfd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = send(sockfd, buf, len, MSG_NOSIGNAL);
+		if (ret <= 0) {
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool recv_all(int sockfd, uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = recv(sockfd, buf, len, 0);
+		if (ret <= 0) {
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static size_t put_remaining_len(uint8_t *dst, size_t len)
+{
+	size_t n = 0;
+
+	do {
+		uint8_t byte = len % 128;
+		len /= 128;
+		dst[n++] = byte | (len ? 0x80 : 0);
+	} while (len);
+
+	return n;
+}
+
+static size_t put_str(uint8_t *dst, const char *str, size_t len)
+{
+	dst[0] = len >> 8;
+	dst[1] = len & 0xff;
+	memcpy(dst + 2, str, len);
+
+	return len + 2;
+}
+
+static bool send_packet(esp_mqtt_client_handle_t client, uint8_t type,
+			const uint8_t *var, size_t var_len,
+			const uint8_t *payload, size_t payload_len)
+{
+	uint8_t fixed[5];
+	size_t n;
+	bool ok;
+
+	fixed[0] = type;
+	n = 1 + put_remaining_len(fixed + 1, var_len + payload_len);
+
+	pthread_mutex_lock(&client->tx_lock);
+	ok = send_all(client->sockfd, fixed, n) &&
+		send_all(client->sockfd, var, var_len) &&
+		(!payload_len || send_all(client->sockfd, payload, payload_len));
+	pthread_mutex_unlock(&client->tx_lock);
+
+	return ok;
+}
+
+static int broker_connect(esp_mqtt_client_handle_t client)
+{
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *result, *rp;
+	int sockfd = -1;
+
+	if (getaddrinfo(client->host, client->port, &hints, &result) != 0) {
+		return -1;
+	}
+	for (rp = result; rp; rp = rp->ai_next) {
+		sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sockfd == -1) {
+			continue;
+		}
+		if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+			break;
+		}
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(result);
+
+	return sockfd;
+}
+
+static bool mqtt_handshake(esp_mqtt_client_handle_t client)
+{
+	uint8_t var[10 + 2 + sizeof(client->client_id) + 2 + sizeof(client->will_topic) +
+		2 + sizeof(client->will_msg)];
+	size_t n = 0;
+
+	n += put_str(var, "MQTT", 4);
+	var[n++] = 4;     // protocol level 3.1.1
+	var[n++] = 0x02 | client->will_flags;  // clean session
+	var[n++] = 0;
+	var[n++] = KEEPALIVE_S;
+	n += put_str(var + n, client->client_id, strlen(client->client_id));
+	if (client->will_flags) {
+		n += put_str(var + n, client->will_topic, strlen(client->will_topic));
+		n += put_str(var + n, client->will_msg, strlen(client->will_msg));
+	}
+
+	if (!send_packet(client, 0x10, var, n, NULL, 0)) {
+		return false;
+	}
+
+	uint8_t connack[4];
+	return recv_all(client->sockfd, connack, sizeof(connack)) &&
+		connack[0] == 0x20 && connack[3] == 0;
+}
+
+static void ping_task(void *arg)
+{
+	esp_mqtt_client_handle_t client = arg;
+
+	for (;;) {
+		vTaskDelay(pdMS_TO_TICKS(KEEPALIVE_S * 1000 / 2));
+		send_packet(client, 0xC0, NULL, 0, NULL, 0);
+	}
+}
+
+static void broker_task(void *arg)
+{
+	esp_mqtt_client_handle_t client = arg;
+	esp_mqtt_event_t event = {0};
+
+	client->sockfd = broker_connect(client);
+	if (client->sockfd == -1 || !mqtt_handshake(client)) {
+		ESP_LOGE(TAG, "Cannot connect to mqtt://%s:%s", client->host, client->port);
+		event.event_id = MQTT_EVENT_ERROR;
+		esp_mqtt_error_codes_t err = {.error_type = 111};
+		event.error_handle = &err;
+		dispatch(client, &event);
+		vTaskDelete(NULL);
+	}
+
+	event.event_id = MQTT_EVENT_CONNECTED;
+	dispatch(client, &event);
+	xTaskCreate(ping_task, "mqtt_ping", 2048, client, 5, NULL);
+
+	for (;;) {
+		uint8_t header;
+		size_t len = 0, shift = 0;
+		uint8_t byte;
+
+		if (!recv_all(client->sockfd, &header, 1)) {
+			break;
+		}
+		do {
+			if (!recv_all(client->sockfd, &byte, 1)) {
+				goto disconnected;
+			}
+			len |= (size_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+
+		uint8_t *body = malloc(len + 1);
+		if (!body || !recv_all(client->sockfd, body, len)) {
+			free(body);
+			break;
+		}
+
+		switch (header >> 4) {
+		case 3: { // PUBLISH
+			size_t topic_len = body[0] << 8 | body[1];
+			size_t off = 2 + topic_len;
+			uint8_t qos = header >> 1 & 3;
+
+			if (qos) {
+				uint8_t ack[2] = {body[off], body[off + 1]};
+				send_packet(client, 0x40, ack, 2, NULL, 0);
+				off += 2;
+			}
+			body[len] = '\0';
+			deliver(client, (char *)body + 2, topic_len,
+				(char *)body + off, len - off);
+			break;
+		}
+		case 4: // PUBACK
+			event.msg_id = body[0] << 8 | body[1];
+			pthread_mutex_lock(&client->tx_lock);
+			client->outbox -= client->inflight[event.msg_id % MAX_INFLIGHT];
+			client->inflight[event.msg_id % MAX_INFLIGHT] = 0;
+			pthread_mutex_unlock(&client->tx_lock);
+			event.event_id = MQTT_EVENT_PUBLISHED;
+			dispatch(client, &event);
+			break;
+		case 9: // SUBACK
+			event.event_id = MQTT_EVENT_SUBSCRIBED;
+			event.msg_id = body[0] << 8 | body[1];
+			dispatch(client, &event);
+			break;
+		default:
+			break;
+		}
+		free(body);
+	}
+
+disconnected:
+	event.event_id = MQTT_EVENT_DISCONNECTED;
+	dispatch(client, &event);
+	close(client->sockfd);
+	vTaskDelete(NULL);
+}
+
+static void line_task(void *arg)
+{
+	esp_mqtt_client_handle_t client = arg;
+	esp_mqtt_event_t event = {0};
+	char line[1024];
+
+	event.event_id = MQTT_EVENT_CONNECTED;
+	dispatch(client, &event);
+
+	while (fgets(line, sizeof(line), stdin)) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = '\0';
+
+		if (client->sub_count && len) {
+			deliver(client, client->subs[0], strlen(client->subs[0]), line, len);
+		}
+	}
+
+	// Give queued work a chance to finish before the process goes away
+	vTaskDelay(pdMS_TO_TICKS(500));
+	exit(0);
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+	esp_mqtt_client_handle_t client = calloc(1, sizeof(*client));
+	const char *uri = getenv("HOST_MQTT_URI");
+
+	if (!client) {
+		return NULL;
+	}
+	if (!uri) {
+		uri = config->broker.address.uri;
+	}
+
+	pthread_mutex_init(&client->tx_lock, NULL);
+	client->sockfd = -1;
+	snprintf(client->client_id, sizeof(client->client_id), "%s",
+		config->credentials.client_id ? config->credentials.client_id :
+		"ESP32_host");
+
+	if (config->session.last_will.topic) {
+		snprintf(client->will_topic, sizeof(client->will_topic), "%s",
+			config->session.last_will.topic);
+		snprintf(client->will_msg, sizeof(client->will_msg), "%.*s",
+			config->session.last_will.msg_len ? config->session.last_will.msg_len :
+			(int)strlen(config->session.last_will.msg),
+			config->session.last_will.msg);
+		client->will_flags = 0x04 | (config->session.last_will.qos & 3) << 3 |
+			(config->session.last_will.retain ? 0x20 : 0);
+	}
+
+	if (!uri || strncmp(uri, "mqtt://", 7) || !uri[7]) {
+		client->line_mode = true;
+		return client;
+	}
+
+	const char *host = uri + 7;
+	const char *colon = strrchr(host, ':');
+	if (colon) {
+		snprintf(client->host, sizeof(client->host), "%.*s", (int)(colon - host), host);
+		snprintf(client->port, sizeof(client->port), "%s", colon + 1);
+	} else {
+		snprintf(client->host, sizeof(client->host), "%s", host);
+		snprintf(client->port, sizeof(client->port), "1883");
+	}
+
+	return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+					esp_mqtt_event_id_t event,
+					esp_event_handler_t event_handler,
+					void *event_handler_arg)
+{
+	client->handler = event_handler;
+	client->handler_arg = event_handler_arg;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+	BaseType_t ret = xTaskCreate(client->line_mode ? line_task : broker_task,
+				"mqtt_task", 6144, client, 5, NULL);
+
+	return ret == pdPASS ? ESP_OK : ESP_FAIL;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+	if (client->sub_count == MAX_SUBS) {
+		return -1;
+	}
+	client->subs[client->sub_count++] = strdup(topic);
+
+	uint16_t id = ++client->next_id;
+
+	if (client->line_mode) {
+		esp_mqtt_event_t event = {.event_id = MQTT_EVENT_SUBSCRIBED, .msg_id = id};
+		dispatch(client, &event);
+		return id;
+	}
+
+	size_t topic_len = strlen(topic);
+	uint8_t var[2];
+	uint8_t payload[topic_len + 3];
+
+	var[0] = id >> 8;
+	var[1] = id & 0xff;
+	put_str(payload, topic, topic_len);
+	payload[topic_len + 2] = 0;
+
+	return send_packet(client, 0x82, var, 2, payload, sizeof(payload)) ? id : -1;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
+			const char *data, int len, int qos, int retain)
+{
+	if (!len && data) {
+		len = strlen(data);
+	}
+
+	if (client->line_mode) {
+		pthread_mutex_lock(&client->tx_lock);
+		printf("%s ", topic);
+		fwrite(data, 1, len, stdout);
+		putchar('\n');
+		fflush(stdout);
+		pthread_mutex_unlock(&client->tx_lock);
+
+		return 0;
+	}
+
+	if (client->sockfd == -1) {
+		return -1;
+	}
+
+	size_t topic_len = strlen(topic);
+	uint8_t var[topic_len + 4];
+	size_t n = put_str(var, topic, topic_len);
+	uint16_t id = 0;
+
+	if (qos) {
+		id = ++client->next_id;
+		var[n++] = id >> 8;
+		var[n++] = id & 0xff;
+	}
+
+	uint8_t type = 0x30 | (qos ? 1 : 0) << 1 | (retain ? 1 : 0);
+
+	// Counted before sending, the PUBACK may come back before send_packet() does
+	if (qos) {
+		pthread_mutex_lock(&client->tx_lock);
+		client->outbox += len - client->inflight[id % MAX_INFLIGHT];
+		client->inflight[id % MAX_INFLIGHT] = len;
+		pthread_mutex_unlock(&client->tx_lock);
+	}
+
+	if (!send_packet(client, type, var, n, (const uint8_t *)data, len)) {
+		// Not kept for a resend, unlike esp-mqtt
+		pthread_mutex_lock(&client->tx_lock);
+		client->outbox -= client->inflight[id % MAX_INFLIGHT];
+		client->inflight[id % MAX_INFLIGHT] = 0;
+		pthread_mutex_unlock(&client->tx_lock);
+		return -1;
+	}
+
+	return id;
+}
+
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
+{
+	int size;
+
+	pthread_mutex_lock(&client->tx_lock);
+	size = client->outbox;
+	pthread_mutex_unlock(&client->tx_lock);
+
+	return size;
+}
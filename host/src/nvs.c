@@ -0,0 +1,155 @@
+/*
+ * NVS stand-in: namespace = directory, key = file, under $HOST_NVS_DIR
+ * (default ./host_nvs). Survives "reboots" of the host firmware like the
+ * real partition does.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "nvs_flash.h"
+
+#define MAX_HANDLES 16
+
+
+static char g_namespaces[MAX_HANDLES][16];
+static nvs_open_mode_t g_modes[MAX_HANDLES];
+
+
+static const char *nvs_dir(void)
+{
+	const char *dir = getenv("HOST_NVS_DIR");
+
+	return dir ? dir : "host_nvs";
+}
+
+static bool key_path(nvs_handle_t handle, const char *key, char *path, size_t len)
+{
+	if (handle == 0 || handle > MAX_HANDLES || !g_namespaces[handle - 1][0]) {
+		return false;
+	}
+	snprintf(path, len, "%s/%s/%s", nvs_dir(), g_namespaces[handle - 1], key);
+
+	return true;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+	mkdir(nvs_dir(), 0755);
+
+	return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+	return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+	char path[256];
+
+	for (int i = 0; i < MAX_HANDLES; ++i) {
+		if (!g_namespaces[i][0]) {
+			snprintf(path, sizeof(path), "%s/%s", nvs_dir(), name);
+			// Like NVS, a namespace only comes into existence when written
+			if (open_mode == NVS_READONLY && access(path, F_OK)) {
+				return ESP_ERR_NVS_NOT_FOUND;
+			}
+			mkdir(nvs_dir(), 0755);
+			mkdir(path, 0755);
+			snprintf(g_namespaces[i], sizeof(g_namespaces[i]), "%s", name);
+			g_modes[i] = open_mode;
+			*out_handle = i + 1;
+			return ESP_OK;
+		}
+	}
+
+	return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+	if (handle && handle <= MAX_HANDLES) {
+		g_namespaces[handle - 1][0] = '\0';
+	}
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+	return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+	char path[256];
+
+	if (!key_path(handle, key, path, sizeof(path))) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	return remove(path) == 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+	char path[256];
+	FILE *file;
+
+	if (!key_path(handle, key, path, sizeof(path))) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (!(file = fopen(path, "rb"))) {
+		return ESP_ERR_NVS_NOT_FOUND;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size_t size = (size_t)ftell(file);
+	rewind(file);
+
+	esp_err_t ret = ESP_OK;
+	if (out_value) {
+		if (*length < size) {
+			ret = ESP_ERR_INVALID_SIZE;
+		} else if (fread(out_value, 1, size, file) != size) {
+			ret = ESP_FAIL;
+		}
+	}
+	*length = size;
+	fclose(file);
+
+	return ret;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+	char path[256];
+	FILE *file;
+
+	if (!key_path(handle, key, path, sizeof(path)) ||
+		g_modes[handle - 1] != NVS_READWRITE) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (!(file = fopen(path, "wb"))) {
+		return ESP_FAIL;
+	}
+
+	size_t written = fwrite(value, 1, length, file);
+	fclose(file);
+
+	return written == length ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+	size_t len = sizeof(*out_value);
+
+	return nvs_get_blob(handle, key, out_value, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+	return nvs_set_blob(handle, key, &value, sizeof(value));
+}
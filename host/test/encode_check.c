@@ -0,0 +1,156 @@
+/*
+ * enc_qoi_stream() on frames that don't compress: every pixel pair costs a
+ * QOI_OP_RUN and a QOI_OP_RGB, and the leading singles shift where the chunk
+ * boundaries fall until one lands between the two. Every chunk has to fit
+ * ENC_CHUNK_SIZE and the stream has to decode back to the frame.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encode_lib.h"
+#include "perf_lib.h"
+
+#define WIDTH 160
+#define HEIGHT 120
+#define MAX_STREAM (WIDTH * HEIGHT * 4 + 64)
+
+
+typedef struct {
+	uint8_t data[MAX_STREAM];
+	size_t len;
+	size_t max_chunk;
+} stream_t;
+
+
+void perf_start(perf_phase_t phase)
+{
+}
+
+void perf_stop(perf_phase_t phase)
+{
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+	return false;
+}
+
+static esp_err_t collect(void *ctx, const void *data, size_t len)
+{
+	stream_t *out = ctx;
+
+	if (len > out->max_chunk) {
+		out->max_chunk = len;
+	}
+	if (out->len + len > MAX_STREAM) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+
+	return ESP_OK;
+}
+
+// Distinct colors with green alternating low and high, never a DIFF or LUMA
+static void put_color(uint8_t *dst, unsigned k)
+{
+	const unsigned r = (k / 32) % 32, g = (k % 2 ? 48 : 0) + (k / 2) % 16, b = (k / 1024) % 32;
+
+	dst[0] = r << 3 | g >> 3;
+	dst[1] = (g & 0x07) << 5 | b;
+}
+
+static void expand(const uint8_t *src, uint8_t *rgb)
+{
+	rgb[0] = src[0] & 0xF8;
+	rgb[1] = (src[0] & 0x07) << 5 | (src[1] & 0xE0) >> 3;
+	rgb[2] = (src[1] & 0x1F) << 3;
+}
+
+// Decodes and compares with the frame, returns the first bad pixel or -1
+static long check_decode(const stream_t *in, const camera_fb_t *frame)
+{
+	const uint8_t *p = in->data + 14, *end = in->data + in->len - 8;
+	uint8_t index[64][3] = {{0}}, px[3] = {0, 0, 0};
+	size_t i = 0, pixels = frame->width * frame->height;
+
+	while (p < end && i < pixels) {
+		uint8_t op = *p++, run = 1, expected[3];
+
+		if (op == 0xFE) {
+			memcpy(px, p, 3);
+			p += 3;
+		} else if ((op & 0xC0) == 0x00) {
+			memcpy(px, index[op], 3);
+		} else if ((op & 0xC0) == 0x40) {
+			px[0] += (op >> 4 & 3) - 2;
+			px[1] += (op >> 2 & 3) - 2;
+			px[2] += (op & 3) - 2;
+		} else if ((op & 0xC0) == 0x80) {
+			const int dg = (op & 0x3F) - 32;
+
+			px[0] += dg + (*p >> 4) - 8;
+			px[1] += dg;
+			px[2] += dg + (*p & 0x0F) - 8;
+			++p;
+		} else {
+			run = (op & 0x3F) + 1;
+		}
+		memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64], px, 3);
+
+		for (; run && i < pixels; --run, ++i) {
+			expand(frame->buf + i * 2, expected);
+			if (memcmp(px, expected, 3)) {
+				return i;
+			}
+		}
+	}
+
+	return i == pixels && p == end ? -1 : (long)i;
+}
+
+int main(void)
+{
+	static stream_t out;
+	uint8_t *buf = malloc(WIDTH * HEIGHT * 2);
+	camera_fb_t frame = {
+		.buf = buf,
+		.len = WIDTH * HEIGHT * 2,
+		.width = WIDTH,
+		.height = HEIGHT,
+		.format = PIXFORMAT_RGB565
+	};
+	int failures = 0;
+
+	// 0-4 singles cover every chunk offset modulo the 5-byte pairs
+	for (unsigned singles = 0; singles < 5; ++singles) {
+		unsigned k = 1;
+
+		for (size_t i = 0; i < WIDTH * HEIGHT; ++i) {
+			put_color(buf + i * 2, k);
+			if (i < singles || (i - singles) % 2) {
+				++k;
+			}
+		}
+
+		memset(&out, 0, sizeof(out));
+		esp_err_t ret = enc_qoi_stream(&frame, collect, &out);
+		long bad = ret == ESP_OK ? check_decode(&out, &frame) : 0;
+
+		printf("%u singles: %zu bytes, largest chunk %zu, ", singles, out.len, out.max_chunk);
+		if (ret != ESP_OK) {
+			printf("error 0x%x\n", ret);
+		} else if (bad >= 0) {
+			printf("decode mismatch at pixel %ld\n", bad);
+		} else {
+			printf("ok\n");
+		}
+		if (ret != ESP_OK || bad >= 0 || out.max_chunk > ENC_CHUNK_SIZE) {
+			++failures;
+		}
+	}
+
+	free(buf);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
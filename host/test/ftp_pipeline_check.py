@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Pipelined FTP login of the host build against tools/ftp_standin.py.
+
+With the stand-in answering every command --rtt ms after it arrived, a save
+logs in lock-step and one pipelined (`ftpsession off`, so each save logs in).
+The pipelined login, PASV included, has to take at least one round trip
+less; the times come from the upload's perf record. A stand-in started with
+--no-pipelining then has to get the lock-step fallback, and the picture
+still has to arrive.
+
+  ftp_pipeline_check.py --firmware build-host/shape_detector_host --port 2121
+"""
+import argparse
+import json
+import os
+import queue
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.join(HERE, '..', '..', 'tools')
+sys.path.insert(0, TOOLS)
+import bench_commands  # noqa: E402
+
+TIMEOUT = 30.0
+
+
+def start_standin(args, directory, *extra):
+    standin = subprocess.Popen([sys.executable, os.path.join(TOOLS, 'ftp_standin.py'),
+                                '--port', str(args.port), '--dir', directory,
+                                '--rtt', str(args.rtt)] + list(extra),
+                               stdout=subprocess.PIPE, text=True)
+    # Listening once it says so
+    if not standin.stdout.readline().startswith('Listening'):
+        standin.kill()
+        raise RuntimeError('ftp_standin.py did not start')
+    return standin
+
+
+def command(link, line):
+    latency, reply, _, _ = bench_commands.run_command(link, line, TIMEOUT)
+    if latency is None:
+        raise RuntimeError('no reply to %r' % line)
+    return reply
+
+
+def save(link, name):
+    """Returns the upload's reply and its perf record, which comes first."""
+    tag = '#' + name
+    replies, record = [], None
+
+    bench_commands.drain(link)
+    link.publish('%s saveas %s' % (tag, name))
+
+    deadline = time.monotonic() + TIMEOUT
+    while len(replies) < 2 or record is None:
+        try:
+            message = link.messages.get(timeout=max(0.0, deadline - time.monotonic()))
+        except queue.Empty:
+            raise RuntimeError('upload of %s did not finish: %r' % (name, replies))
+        if message is None:
+            raise RuntimeError('the host build went away')
+        _, topic, payload = message
+        if topic == bench_commands.TOPIC_OUT and payload.startswith(tag + ' '):
+            replies.append(payload[len(tag) + 1:])
+        elif topic == bench_commands.TOPIC_PERF and json.loads(payload)['cmd'] == 'upload':
+            record = json.loads(payload)
+
+    return replies[1], record
+
+
+def login_ms(record):
+    return (record['ftp_login_us'] + record['pasv_us']) / 1000.0
+
+
+def run_firmware(args, nvs_dir, lines):
+    link = bench_commands.SpawnLink('HOST_NVS_DIR=%s exec %s' % (nvs_dir, args.firmware))
+    try:
+        if bench_commands.run_command(link, bench_commands.ENQ, TIMEOUT)[0] is None:
+            raise RuntimeError('the host build did not come up')
+        for line in ('perf on', 'ftpsession off', 'shoot'):
+            command(link, line)
+        return lines(link)
+    finally:
+        link.close()
+
+
+def check_pipelined(args, work):
+    def lines(link):
+        command(link, 'ftppipeline off')
+        _, lockstep = save(link, 'lockstep.bmp')
+        command(link, 'ftppipeline on')
+        _, pipelined = save(link, 'pipelined.bmp')
+        return login_ms(lockstep), login_ms(pipelined)
+
+    standin = start_standin(args, os.path.join(work, 'ftp'))
+    try:
+        lockstep, pipelined = run_firmware(args, os.path.join(work, 'nvs1'), lines)
+    finally:
+        standin.kill()
+        standin.wait()
+
+    saved = (lockstep - pipelined) / args.rtt
+    print('--rtt %g: login + PASV %.1f ms lock-step, %.1f ms pipelined, '
+          '%.1f round trips saved' % (args.rtt, lockstep, pipelined, saved))
+    return saved >= 1.0
+
+
+def check_fallback(args, work):
+    directory = os.path.join(work, 'ftp_no_pipelining')
+
+    def lines(link):
+        command(link, 'ftppipeline on')
+        return save(link, 'fallback.bmp')[0]
+
+    standin = start_standin(args, directory, '--no-pipelining')
+    try:
+        reply = run_firmware(args, os.path.join(work, 'nvs2'), lines)
+    finally:
+        standin.kill()
+        output = standin.stdout.read()
+        standin.wait()
+
+    path = os.path.join(directory, 'fallback.bmp')
+    dropped = 'dropping' in output
+    stored = os.path.exists(path) and os.path.getsize(path) > 0
+    print('--no-pipelining: pipelined commands %s, upload %s (%s)'
+          % ('dropped' if dropped else 'never sent', 'stored' if stored else 'missing',
+             reply.replace('\033[32m', '').replace('\033[31m', '').replace('\033[39m', '')))
+    return dropped and stored and 'stored locally' in reply
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--firmware', required=True, help='host build of the firmware')
+    parser.add_argument('--port', type=int, default=2121, help='FTP port it was built with')
+    parser.add_argument('--rtt', type=float, default=50.0, help='milliseconds')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as work:
+        results = [check_pipelined(args, work), check_fallback(args, work)]
+
+    return 0 if all(results) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,14 +1,24 @@
+#include <math.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_random.h>
 #include <esp_camera.h>
+#include <nvs.h>
 #include "servo_lib.h"
 #include "camera_lib.h"
 #include "mqtt_lib.h"
 #include "ftp_lib.h"
+#include "search_lib.h"
+#include "image_lib.h"
+#include "perf_lib.h"
+#include "upload_lib.h"
+#include "stream_lib.h"
+#include "command_lib.h"
+#include "metrics_lib.h"
 
 #define RED "\033[31m"
 #define GRN "\033[32m"
@@ -21,12 +31,20 @@ static int conv_arg_to_int(char *arg);
 void shoot(camera_fb_t **ptr_picture)
 {
 	if (*ptr_picture) {
+		search_clear_reference();
 		free_picture(ptr_picture);
 	}
 
+	if (servo_wait(SERVO_WAIT_MS) != ESP_OK) {
+		mqtt_publish(RED "Servo is still moving" NO_COLOR);
+	}
+
 	*ptr_picture = take_picture();
 
 	if (*ptr_picture) {
+		// Not fatal, `fetch` builds the descriptor itself when it's missing
+		search_set_reference(*ptr_picture);
+
 		mqtt_publish(GRN "New picture taken (%.2f KiB)" NO_COLOR,
 			(*ptr_picture)->len / 1024.0);
 	} else {
@@ -46,44 +64,184 @@ void save(camera_fb_t *picture, const char *filename)
 
 	}
 
-	esp_err_t ret;
+	char path[UPLOAD_PATH_LEN];
+	// The upload's result answers to the same correlation ID
+	esp_err_t ret = upload_enqueue(picture, filename, mqtt_reply_id(), path);
+	upload_stats_t stats;
 
-	switch (picture->format) {
-	case PIXFORMAT_RGB565:
-	case PIXFORMAT_GRAYSCALE:
-		uint8_t *bmp = NULL;
-		size_t bmp_size = 0;
+	upload_get_stats(&stats);
 
-		if (!frame2bmp(picture, &bmp, &bmp_size)) {
-			mqtt_publish(RED "Conversion to BMP failed" NO_COLOR);
-			return;
+	if (ret == ESP_OK) {
+		mqtt_publish(GRN "Picture (%.2f KiB) queued for upload as %s, %u of %u "
+			"in queue" NO_COLOR, picture->len / 1024.0, path,
+			stats.depth, stats.capacity);
+	} else if (ret == ESP_ERR_NOT_SUPPORTED) {
+		mqtt_publish(RED "Picture format not supported" NO_COLOR);
+	} else if (ret == ESP_ERR_INVALID_SIZE) {
+		mqtt_publish(RED "File name is too long" NO_COLOR);
+	} else if (ret == ESP_ERR_NO_MEM) {
+		mqtt_publish(RED "Not enough memory to queue the picture" NO_COLOR);
+	} else {
+		mqtt_publish(RED "Upload queue is full (%u), picture dropped" NO_COLOR,
+			stats.capacity);
+	}
+}
+
+/*
+ * Runs in the upload task once a queued picture is stored or given up on
+ */
+void upload_done(const upload_result_t *result)
+{
+	double ms = result->elapsed_us / 1000.0;
+
+	mqtt_reply_begin(result->tag[0] ? result->tag : NULL, false);
+
+	if (result->err == ESP_OK && result->transport == UPLOAD_MQTT) {
+		mqtt_publish(GRN "%s sent over MQTT, %zu bytes in %lu chunks (%s, encoded "
+			"in %.1f ms) in %.1f ms (%.1f KiB/s), %lu enqueue retries, after %.1f ms "
+			"waiting" NO_COLOR, result->path, result->bytes,
+			(unsigned long)result->chunks, enc_format_ext(result->format),
+			result->encode_us / 1000.0, ms,
+			ms > 0 ? result->bytes / 1.024 / ms : 0.0,
+			(unsigned long)result->enqueue_retries, result->wait_us / 1000.0);
+	} else if (result->err == ESP_OK) {
+		mqtt_publish(GRN "%s stored locally over FTP, %zu bytes (%s, encoded in "
+			"%.1f ms) in %.1f ms (%.1f KiB/s) after %.1f ms waiting" NO_COLOR,
+			result->path, result->bytes, enc_format_ext(result->format),
+			result->encode_us / 1000.0, ms,
+			ms > 0 ? result->bytes / 1.024 / ms : 0.0, result->wait_us / 1000.0);
+	} else if (result->err == ESP_ERR_NOT_FOUND) {
+		mqtt_publish(RED "Failed to connect to the FTP server, %s dropped "
+			"after %u attempts" NO_COLOR, result->path, result->attempts);
+	} else if (result->encode_failed) {
+		mqtt_publish(RED "Failed to encode %s as %s (%s)" NO_COLOR, result->path,
+			enc_format_ext(result->format), esp_err_to_name(result->err));
+	} else {
+		mqtt_publish(RED "Failed in uploading %s over %s after %u attempts"
+			NO_COLOR, result->path, upload_transport_name(result->transport),
+			result->attempts);
+	}
+
+	mqtt_reply_end();
+}
+
+void format(char *arg)
+{
+	enc_format_t format;
+	uint8_t quality;
+
+	upload_get_encoding(&format, &quality);
+
+	if (!arg) {
+		mqtt_publish(RED "`format` requires argument (bmp/jpg/qoi)" NO_COLOR);
+
+	} else if (!enc_format_from_name(arg, &format)) {
+		mqtt_publish(RED "Invalid argument (bmp/jpg/qoi)" NO_COLOR);
+
+	} else {
+		upload_set_encoding(format, quality);
+		mqtt_publish(GRN "Pictures are saved as %s" NO_COLOR, enc_format_ext(format));
+
+	}
+}
+
+void jpeg_quality(char *arg)
+{
+	enc_format_t format;
+	uint8_t quality;
+
+	int value = conv_arg_to_int(arg);
+	if (value == INT_MIN) {
+		return;
+	}
+
+	upload_get_encoding(&format, &quality);
+
+	if (value < 1 || value > 100) {
+		mqtt_publish(RED "Value has to be between 1 and 100" NO_COLOR);
+	} else {
+		upload_set_encoding(format, value);
+		mqtt_publish(GRN "JPEG quality set to %d" NO_COLOR, value);
+	}
+}
+
+void stream(char *arg)
+{
+	stream_stats_t stats;
+
+	if (!arg) {
+		mqtt_publish(RED "`stream` requires argument (on/off/stats)" NO_COLOR);
+
+	} else if (!strcmp(arg, "on")) {
+		esp_err_t ret = stream_start(STREAM_DEFAULT_PORT);
+
+		if (ret == ESP_OK || ret == ESP_ERR_INVALID_STATE) {
+			mqtt_publish(GRN "Preview stream on port %d, / for MJPEG, /raw for "
+				"raw frames" NO_COLOR, STREAM_DEFAULT_PORT);
+		} else {
+			mqtt_publish(RED "Failed to start the preview stream" NO_COLOR);
 		}
 
-		ret = ftp_upload_data(filename, bmp, bmp_size);
-		free(bmp);
-		bmp = NULL;
+	} else if (!strcmp(arg, "off")) {
+		stream_stop();
+		mqtt_publish(GRN "Preview stream is OFF" NO_COLOR);
 
-		break;
-	case PIXFORMAT_JPEG:
-		ret = ftp_upload_data(filename, picture->buf, picture->len);
+	} else if (!strcmp(arg, "stats")) {
+		stream_get_stats(&stats);
+		mqtt_publish(GRN "Preview stream %s, %s, %u fps cap, scale 1/%u: %lu frames "
+			"(%.2f MiB) sent, %lu dropped" NO_COLOR, stats.running ? "ON" : "OFF",
+			stats.client ? "client connected" : "no client", stats.fps,
+			stats.scale, (unsigned long)stats.frames,
+			stats.bytes / 1024.0 / 1024, (unsigned long)stats.dropped);
 
-		break;
-	default:
-		mqtt_publish(RED "Picture format not supported" NO_COLOR);
+	} else {
+		mqtt_publish(RED "Invalid argument (on/off/stats)" NO_COLOR);
+
+	}
+}
+
+void stream_fps(char *arg)
+{
+	int value = conv_arg_to_int(arg);
+	if (value == INT_MIN) {
+		return;
+	}
 
+	if (value < 1 || value > STREAM_MAX_FPS || stream_set_fps(value) != ESP_OK) {
+		mqtt_publish(RED "Value has to be between 1 and %d" NO_COLOR, STREAM_MAX_FPS);
+	} else {
+		mqtt_publish(GRN "Preview stream capped at %d fps" NO_COLOR, value);
+	}
+}
+
+void stream_scale(char *arg)
+{
+	int value = conv_arg_to_int(arg);
+	if (value == INT_MIN) {
 		return;
 	}
 
-	if (ret == ESP_OK) {
-		mqtt_publish(GRN "New picture (%.2f KiB) taken and stored "
-			"locally over FTP" NO_COLOR, picture->len / 1024.0);
-	} else if (ret == ESP_ERR_NOT_FOUND) {
-		mqtt_publish(RED "Failed to connect to the FTP server" NO_COLOR);
+	if (value < 1 || value > 4 || stream_set_scale(value) != ESP_OK) {
+		mqtt_publish(RED "Scale has to be 1, 2 or 4" NO_COLOR);
 	} else {
-		mqtt_publish(RED "Failed in uploading picture over FTP" NO_COLOR);
+		mqtt_publish(GRN "Preview stream scaled to 1/%d" NO_COLOR, value);
 	}
 }
 
+void uploads(void)
+{
+	upload_stats_t stats;
+
+	upload_get_stats(&stats);
+
+	mqtt_publish(GRN "Uploads over %s: %u of %u queued (%zu bytes pending), "
+		"%lu done, %lu failed, %lu dropped, %lu retries" NO_COLOR,
+		upload_transport_name(upload_get_transport()), stats.depth,
+		stats.capacity, stats.bytes_pending, (unsigned long)stats.completed,
+		(unsigned long)stats.failed, (unsigned long)stats.dropped,
+		(unsigned long)stats.retries);
+}
+
 void flash(char *arg)
 {
 	if (!arg) {
@@ -122,43 +280,57 @@ void flash_intensity(char *arg)
 void rotate(char *arg)
 {
 	if (!arg) {
-		mqtt_publish(RED "`rotate` requires argument (int or rand)" NO_COLOR);
+		mqtt_publish(RED "`rotate` requires argument (degrees or rand)" NO_COLOR);
 		return;
 	}
 
-	int angle;
+	int16_t ddeg;
 	bool relative_angle = false;
 	char success_msg[50];
 
 	if (!strcmp(arg, "rand")) {
-		angle = esp_random() % 181;
+		const int angle = esp_random() % 181;
+		ddeg = angle * SERVO_DDEG_PER_DEG;
 
 		for (uint8_t i = 0; i < 2; ++i) {
 			set_servo_angle(95, relative_angle);
-			vTaskDelay(pdMS_TO_TICKS(100));
+			servo_wait(SERVO_WAIT_MS);
 			set_servo_angle(85, relative_angle);
-			vTaskDelay(pdMS_TO_TICKS(100));
+			servo_wait(SERVO_WAIT_MS);
 		}
-		vTaskDelay(pdMS_TO_TICKS(150));
 
-		snprintf(success_msg, 50, GRN "Angle is changed to %d°" NO_COLOR, angle);
+		snprintf(success_msg, 50, "Angle is changed to %d°", angle);
 	} else {
-		angle = conv_arg_to_int(arg);
-		if (angle == INT_MIN) {
+		char *endptr;
+		const float angle = strtof(arg, &endptr);
+
+		if (endptr == arg || *endptr != '\0') {
+			mqtt_publish(RED "Angle conversion failed" NO_COLOR);
+			return;
+		}
+
+		// Also keeps NaN and out of int16_t range values out
+		if (!(fabsf(angle) <= SERVO_MAX_DDEG / SERVO_DDEG_PER_DEG)) {
+			mqtt_publish(RED "Angle given is outside of the range" NO_COLOR);
 			return;
 		}
 
+		// Finer than a tenth of a degree is rounded
+		ddeg = (int16_t)lroundf(angle * SERVO_DDEG_PER_DEG);
+
 		if (arg[0] == '-' || arg[0] == '+') {
 			relative_angle = true;
 		}
 
-		sprintf(success_msg, GRN "Angle is changed" NO_COLOR);
+		sprintf(success_msg, "Angle is changed");
 	}
 
-	esp_err_t ret = set_servo_angle(angle, relative_angle);
+	esp_err_t ret = set_servo_angle_ddeg(ddeg, relative_angle);
 
+	// The move runs on, a following job waits for the servo to be still
 	if (ret == ESP_OK) {
-		mqtt_publish(success_msg);
+		mqtt_publish(GRN "%s, still in ~%lu ms" NO_COLOR, success_msg,
+			(unsigned long)servo_still_in_ms());
 
 	} else if (ret == ESP_ERR_INVALID_ARG) {
 		mqtt_publish(RED "Angle given is outside of the range" NO_COLOR);
@@ -169,9 +341,184 @@ void rotate(char *arg)
 	}
 }
 
-void fetch(camera_fb_t *orig_picture)
+void servo_pulse(char *arg)
 {
-	mqtt_publish(RED "Not yet implemented" NO_COLOR);
+	uint16_t min_us, max_us;
+
+	if (arg && !strcmp(arg, "default")) {
+		min_us = SERVO_DEFAULT_MIN_PULSE_US;
+		max_us = SERVO_DEFAULT_MAX_PULSE_US;
+
+	} else if (arg) {
+		char *endptr;
+		const long min = strtol(arg, &endptr, 10);
+		const long max = *endptr == '-' ? strtol(endptr + 1, &endptr, 10) : -1;
+
+		if (*endptr != '\0' || min < 0 || min > UINT16_MAX || max < 0 || max > UINT16_MAX) {
+			mqtt_publish(RED "Pulse range has to be given as min-max in us" NO_COLOR);
+			return;
+		}
+		min_us = min;
+		max_us = max;
+
+	} else {
+		servo_get_pulse_range(&min_us, &max_us);
+		mqtt_publish(GRN "Servo pulse range is %u-%u us" NO_COLOR, min_us, max_us);
+		return;
+
+	}
+
+	esp_err_t ret = servo_set_pulse_range(min_us, max_us);
+
+	if (ret == ESP_OK) {
+		mqtt_publish(GRN "Servo pulse range set to %u-%u us and saved, still in ~%lu ms"
+			NO_COLOR, min_us, max_us, (unsigned long)servo_still_in_ms());
+
+	} else if (ret == ESP_ERR_INVALID_ARG) {
+		mqtt_publish(RED "Pulse range has to be within %d-%d us and at least %d us wide"
+			NO_COLOR, SERVO_PULSE_LIMIT_MIN_US, SERVO_PULSE_LIMIT_MAX_US,
+			SERVO_PULSE_MIN_SPAN_US);
+
+	} else {
+		mqtt_publish(RED "Saving the pulse range failed (%s)" NO_COLOR,
+			esp_err_to_name(ret));
+
+	}
+}
+
+void fetch(camera_fb_t *orig_picture, char *arg)
+{
+	if (!orig_picture) {
+		mqtt_publish(RED "No picture in buffer, did you take a shot?" NO_COLOR);
+		return;
+	}
+
+	search_result_t result;
+	esp_err_t ret;
+	enum { SWEEP, PIPE, PHASE, INDEX } mode;
+
+	if (!arg || !strcmp(arg, "sweep")) {
+		ret = search_angle_sweep(orig_picture, &result);
+		mode = SWEEP;
+
+	} else if (!strcmp(arg, "pipe")) {
+		ret = search_angle_pipelined(orig_picture, &result);
+		mode = PIPE;
+
+	} else if (!strcmp(arg, "phase")) {
+		ret = search_angle_phase(orig_picture, &result);
+		mode = PHASE;
+
+	} else if (!strcmp(arg, "index")) {
+		ret = search_angle_index(orig_picture, &result);
+		mode = INDEX;
+
+	} else {
+		mqtt_publish(RED "Invalid argument (sweep/pipe/phase/index)" NO_COLOR);
+		return;
+
+	}
+
+	if (ret == ESP_OK && mode == PHASE) {
+		mqtt_publish(GRN "Angle is changed to %.1f° (offset %.1f°, residual "
+			"%.1f°, confidence %.2f, %u captures, %.2f s)" NO_COLOR,
+			result.angle, result.rotation, result.score,
+			result.confidence, result.captures,
+			result.elapsed_us / 1000000.0);
+
+	} else if (ret == ESP_OK && mode == PIPE) {
+		mqtt_publish(GRN "Angle is changed to %.1f° (score %.3f, %u captures, "
+			"%.2f s, %.1f fps, stalls: capture %.2f s, scoring %.2f s)"
+			NO_COLOR, result.angle, result.score, result.captures,
+			result.elapsed_us / 1000000.0,
+			result.captures * 1000000.0 / result.elapsed_us,
+			result.capture_stall_us / 1000000.0,
+			result.score_stall_us / 1000000.0);
+
+	} else if (ret == ESP_OK) {
+		mqtt_publish(GRN "Angle is changed to %.1f° (score %.3f, %u captures, "
+			"%.2f s)" NO_COLOR, result.angle, result.score,
+			result.captures, result.elapsed_us / 1000000.0);
+
+	} else if (ret == ESP_ERR_NOT_SUPPORTED) {
+		mqtt_publish(RED "Picture format not supported" NO_COLOR);
+
+	} else if (ret == ESP_ERR_NOT_FINISHED) {
+		mqtt_publish(RED "Fetch cancelled after %u captures (%.2f s)" NO_COLOR,
+			result.captures, result.elapsed_us / 1000000.0);
+
+	} else if (ret == ESP_ERR_NOT_FOUND && mode == PHASE) {
+		mqtt_publish(RED "Reference not recognized (confidence %.2f)" NO_COLOR,
+			result.confidence);
+
+	} else if (ret == ESP_ERR_INVALID_RESPONSE && mode == PHASE) {
+		mqtt_publish(RED "Not aligned: residual %.1f° at %.1f° after %u captures "
+			"(%.2f s), the servo is at the end of its range or the corrections "
+			"ran out" NO_COLOR, result.score, result.angle, result.captures,
+			result.elapsed_us / 1000000.0);
+
+	} else if (ret == ESP_ERR_NOT_FOUND && mode == INDEX) {
+		mqtt_publish(RED "Reference not in the calibration index (score %.3f)"
+			NO_COLOR, result.score);
+
+	} else if (ret == ESP_ERR_NVS_NOT_FOUND) {
+		mqtt_publish(RED "No calibration index, run calibrate first" NO_COLOR);
+
+	} else if (ret == ESP_ERR_INVALID_STATE || ret == ESP_ERR_INVALID_CRC) {
+		mqtt_publish(RED "Calibration index is stale, run calibrate again"
+			NO_COLOR);
+
+	} else {
+		mqtt_publish(RED "Fetching angle failed after %u captures (%.2f s)"
+			NO_COLOR, result.captures, result.elapsed_us / 1000000.0);
+
+	}
+}
+
+void calibrate(char *arg)
+{
+	int step = CALIB_DEFAULT_STEP;
+
+	if (arg) {
+		step = conv_arg_to_int(arg);
+		if (step == INT_MIN) {
+			return;
+		}
+	}
+
+	// Before it's narrowed to uint8_t, 261 would pass as 5
+	if (step < CALIB_MIN_STEP || step > CALIB_MAX_STEP) {
+		mqtt_publish(RED "Step has to be between %d and %d" NO_COLOR,
+			CALIB_MIN_STEP, CALIB_MAX_STEP);
+		return;
+	}
+
+	search_result_t result;
+	calib_info_t info;
+
+	esp_err_t ret = search_calibrate(step, &result, &info);
+
+	if (ESP_OK == ret) {
+		mqtt_publish(GRN "Calibrated every %u° (%u entries, %zu bytes, "
+			"%.2f s)" NO_COLOR, info.step, info.count, info.bytes,
+			result.elapsed_us / 1000000.0);
+
+	} else if (ESP_ERR_INVALID_ARG == ret) {
+		mqtt_publish(RED "Step has to be between %d and %d" NO_COLOR,
+			CALIB_MIN_STEP, CALIB_MAX_STEP);
+
+	} else if (ESP_ERR_NOT_SUPPORTED == ret) {
+		mqtt_publish(RED "Picture format not supported" NO_COLOR);
+
+	} else if (ESP_ERR_NOT_FINISHED == ret) {
+		mqtt_publish(RED "Calibration cancelled after %u captures, the previous "
+			"index is kept" NO_COLOR, result.captures);
+
+	} else {
+		mqtt_publish(RED "Calibration failed after %u captures" NO_COLOR,
+			result.captures);
+
+	}
 }
 
 void adjust_img_properties(char *setting, char *arg)
@@ -195,6 +542,288 @@ void adjust_img_properties(char *setting, char *arg)
 	}
 }
 
+void ftp_session(char *arg)
+{
+	bool enable;
+
+	if (!arg) {
+		mqtt_publish(RED "`ftpsession` requires argument (on/off)" NO_COLOR);
+		return;
+
+	} else if (!strcmp(arg, "on")) {
+		enable = true;
+
+	} else if (!strcmp(arg, "off")) {
+		enable = false;
+
+	} else {
+		mqtt_publish(RED "Invalid argument (on/off)" NO_COLOR);
+		return;
+
+	}
+
+	if (ftp_session_enable(enable) == ESP_OK) {
+		mqtt_publish(GRN "FTP session is %s" NO_COLOR, enable ? "ON" : "OFF");
+	} else {
+		mqtt_publish(RED "Failed to change the FTP session mode" NO_COLOR);
+	}
+}
+
+void ftp_pipeline(char *arg)
+{
+	if (!arg) {
+		mqtt_publish(RED "`ftppipeline` requires argument (on/off)" NO_COLOR);
+
+	} else if (!strcmp(arg, "on")) {
+		ftp_pipelining_enable(true);
+		mqtt_publish(GRN "FTP command pipelining is ON" NO_COLOR);
+
+	} else if (!strcmp(arg, "off")) {
+		ftp_pipelining_enable(false);
+		mqtt_publish(GRN "FTP command pipelining is OFF" NO_COLOR);
+
+	} else {
+		mqtt_publish(RED "Invalid argument (on/off)" NO_COLOR);
+
+	}
+}
+
+/*
+ * `ftpchunk`, `ftpsndbuf` and `ftpnodelay`, applied from the next upload on
+ */
+void ftp_data(char *setting, char *arg)
+{
+	ftp_data_opts_t opts;
+
+	ftp_get_data_opts(&opts);
+
+	if (!strcmp(setting, "ftpnodelay")) {
+		if (!arg || (strcmp(arg, "on") && strcmp(arg, "off"))) {
+			mqtt_publish(RED "Invalid argument (on/off)" NO_COLOR);
+			return;
+		}
+		opts.nodelay = !strcmp(arg, "on");
+
+	} else {
+		int value = conv_arg_to_int(arg);
+		if (value == INT_MIN) {
+			return;
+		}
+
+		if (!strcmp(setting, "ftpchunk")) {
+			opts.chunk = value < 0 ? 0 : value;
+		} else {
+			opts.sndbuf = value;
+		}
+
+	}
+
+	if (ftp_set_data_opts(&opts) == ESP_OK) {
+		mqtt_publish(GRN "FTP data: chunk %zu B, sndbuf %d B%s, nodelay %s" NO_COLOR,
+			opts.chunk, opts.sndbuf, opts.sndbuf ? "" : " (default)",
+			opts.nodelay ? "on" : "off");
+	} else {
+		mqtt_publish(RED "Chunk has to be between %d and %d, sndbuf positive "
+			"or 0 for default" NO_COLOR, FTP_DATA_CHUNK_MIN, FTP_DATA_CHUNK_MAX);
+	}
+}
+
+void transport(char *arg)
+{
+	upload_transport_t transport;
+
+	if (!arg) {
+		mqtt_publish(RED "`transport` requires argument (ftp/mqtt)" NO_COLOR);
+		return;
+
+	} else if (!strcmp(arg, "ftp")) {
+		transport = UPLOAD_FTP;
+
+	} else if (!strcmp(arg, "mqtt")) {
+		transport = UPLOAD_MQTT;
+
+	} else {
+		mqtt_publish(RED "Invalid argument (ftp/mqtt)" NO_COLOR);
+		return;
+
+	}
+
+	upload_set_transport(transport);
+	mqtt_publish(GRN "Pictures are saved over %s" NO_COLOR,
+		upload_transport_name(transport));
+}
+
+void mqtt_upload(char *setting, char *arg)
+{
+	mqtt_upload_opts_t opts;
+
+	mqtt_get_upload_opts(&opts);
+
+	int value = conv_arg_to_int(arg);
+	if (value == INT_MIN) {
+		return;
+	}
+
+	if (!strcmp(setting, "mqttchunk")) {
+		opts.chunk = value < 0 ? 0 : value;
+	} else if (value == 0 || value == 1) {
+		opts.qos = value;
+	} else {
+		mqtt_publish(RED "QoS has to be 0 or 1" NO_COLOR);
+		return;
+	}
+
+	if (mqtt_set_upload_opts(&opts) == ESP_OK) {
+		mqtt_publish(GRN "MQTT pictures: chunk %zu B, QoS %u" NO_COLOR,
+			opts.chunk, opts.qos);
+	} else {
+		mqtt_publish(RED "Chunk has to be between %d and %d" NO_COLOR,
+			MQTT_CHUNK_MIN, MQTT_CHUNK_MAX);
+	}
+}
+
+void perf(char *arg)
+{
+	if (!arg) {
+		mqtt_publish(RED "`perf` requires argument (on/off)" NO_COLOR);
+
+	} else if (!strcmp(arg, "on")) {
+		perf_enable(true);
+		mqtt_publish(GRN "Phase timings are published on the perf topic" NO_COLOR);
+
+	} else if (!strcmp(arg, "off")) {
+		perf_enable(false);
+		mqtt_publish(GRN "Phase timings are off" NO_COLOR);
+
+	} else {
+		mqtt_publish(RED "Invalid argument (on/off)" NO_COLOR);
+
+	}
+}
+
+void metrics(char *arg)
+{
+	if (!arg) {
+		mqtt_publish(RED "`metrics` requires argument (seconds/off)" NO_COLOR);
+		return;
+	}
+
+	if (!strcmp(arg, "off")) {
+		metrics_stop();
+		mqtt_publish(GRN "Metrics are off" NO_COLOR);
+		return;
+	}
+
+	int value = conv_arg_to_int(arg);
+	if (value == INT_MIN) {
+		return;
+	}
+
+	esp_err_t ret = value < 1 || value > METRICS_MAX_PERIOD_S ?
+		ESP_ERR_INVALID_ARG : metrics_start(value);
+
+	if (ret == ESP_ERR_INVALID_ARG) {
+		mqtt_publish(RED "Period has to be between 1 and %d seconds" NO_COLOR,
+			METRICS_MAX_PERIOD_S);
+	} else if (ret != ESP_OK) {
+		mqtt_publish(RED "Failed to start the metrics" NO_COLOR);
+	} else {
+		mqtt_publish(GRN "Metrics are published on the metrics topic every %d s"
+			NO_COLOR, value);
+	}
+}
+
+void status(void)
+{
+	static const char *names[CMD_QUEUES] = {
+		[CMD_CONTROL] = "control",
+		[CMD_JOB] = "job"
+	};
+	char report[256];
+	int len = 0;
+
+	for (uint8_t i = 0; i < CMD_QUEUES && len < (int)sizeof(report); ++i) {
+		cmd_stats_t stats;
+
+		command_get_stats(i, &stats);
+
+		len += snprintf(report + len, sizeof(report) - len, "\n  %-8s", names[i]);
+		if (len >= (int)sizeof(report)) {
+			break;
+		}
+
+		if (stats.running[0]) {
+			len += snprintf(report + len, sizeof(report) - len, "%s for %.2f s",
+				stats.running, stats.running_us / 1000000.0);
+		} else {
+			len += snprintf(report + len, sizeof(report) - len, "idle");
+		}
+		if (len >= (int)sizeof(report)) {
+			break;
+		}
+
+		len += snprintf(report + len, sizeof(report) - len, ", %u waiting, %lu done, "
+			"last waited %.1f ms and ran %.1f ms, max wait %.1f ms", stats.waiting,
+			(unsigned long)stats.done, stats.last_wait_us / 1000.0,
+			stats.last_exec_us / 1000.0, stats.max_wait_us / 1000.0);
+	}
+
+	const uint32_t still_in = servo_still_in_ms();
+
+	if (len < (int)sizeof(report) && still_in) {
+		snprintf(report + len, sizeof(report) - len, "\n  %-8smoving to %.1f°, still in ~%lu ms",
+			"servo", get_servo_angle_ddeg() / (float)SERVO_DDEG_PER_DEG,
+			(unsigned long)still_in);
+	} else if (len < (int)sizeof(report)) {
+		snprintf(report + len, sizeof(report) - len, "\n  %-8sstill at %.1f°",
+			"servo", get_servo_angle_ddeg() / (float)SERVO_DDEG_PER_DEG);
+	}
+
+	mqtt_publish(GRN "Commands:%s" NO_COLOR, report);
+}
+
+/*
+ * A command the dispatcher didn't run, `reason` completes the sentence
+ */
+void rejected(const char *command, const char *reason)
+{
+	mqtt_publish(RED "`%s` %s" NO_COLOR, command, reason);
+}
+
+void cancel(void)
+{
+	uint8_t dropped;
+	bool running = command_cancel(&dropped);
+
+	if (!running && !dropped) {
+		mqtt_publish(GRN "Nothing to cancel" NO_COLOR);
+	} else {
+		mqtt_publish(GRN "%s%u queued job%s dropped" NO_COLOR,
+			running ? "Running job stops at its next step, " : "",
+			dropped, dropped == 1 ? "" : "s");
+	}
+}
+
+void benchmark(void)
+{
+	img_bench_result_t results[8];
+	char report[200];
+	int len = 0;
+
+	size_t n = img_benchmark(results, sizeof(results) / sizeof(results[0]));
+	if (!n) {
+		mqtt_publish(RED "Not enough memory for the benchmark" NO_COLOR);
+		return;
+	}
+
+	for (size_t i = 0; i < n && len < (int)sizeof(report); ++i) {
+		len += snprintf(report + len, sizeof(report) - len, "\n  %-18s %6.2f",
+				results[i].name, results[i].cycles_per_pixel);
+	}
+
+	mqtt_publish(GRN "Image kernels, cycles/pixel (240x240):%s" NO_COLOR, report);
+}
+
 
 static int conv_arg_to_int(char *arg)
 {
@@ -0,0 +1,213 @@
+#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_rom_crc.h>
+#include <nvs.h>
+#include "esp_err_ext.h"
+#include "calib_lib.h"
+
+#define NVS_NAMESPACE "calib"
+#define NVS_KEY "index"
+#define CALIB_MAGIC 0x424C4143  // "CALB"
+#define MAX_ANGLE 180
+#define MAX_ENTRIES (MAX_ANGLE / CALIB_MIN_STEP + 2)
+
+
+static const char *TAG = "calib_lib";
+
+typedef struct {
+	int16_t angle;
+	shape_sig_t sig;
+} calib_entry_t;
+
+/*
+ * Stored as a single NVS blob: header followed by `count` entries. The crc
+ * covers the entries and every header field before it.
+ */
+typedef struct {
+	uint32_t magic;
+	uint16_t desc_version;
+	uint8_t step;
+	uint8_t count;
+	uint32_t config_id;
+	uint32_t crc;
+	calib_entry_t entries[MAX_ENTRIES];
+} calib_index_t;
+
+static calib_index_t *g_draft;  // being recorded by calibrate
+static calib_index_t *g_index;  // loaded from NVS on first lookup
+
+
+static size_t index_size(const calib_index_t *index)
+{
+	return offsetof(calib_index_t, entries) + index->count * sizeof(calib_entry_t);
+}
+
+static uint32_t index_crc(const calib_index_t *index)
+{
+	uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)index,
+		offsetof(calib_index_t, crc));
+
+	return esp_rom_crc32_le(crc, (const uint8_t *)index->entries,
+		index->count * sizeof(calib_entry_t));
+}
+
+static esp_err_t load_index(void)
+{
+	nvs_handle_t handle;
+
+	if (g_index) {
+		return ESP_OK;
+	}
+
+	ESP_ERROR_RETURN(nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle));
+
+	calib_index_t *index = malloc(sizeof(calib_index_t));
+	if (!index) {
+		nvs_close(handle);
+		return ESP_ERR_NO_MEM;
+	}
+
+	size_t size = sizeof(calib_index_t);
+	esp_err_t ret = nvs_get_blob(handle, NVS_KEY, index, &size);
+	nvs_close(handle);
+
+	if (ret == ESP_OK && (size < offsetof(calib_index_t, entries) ||
+			index->magic != CALIB_MAGIC || !index->count || index->count > MAX_ENTRIES ||
+			size != index_size(index) || index->crc != index_crc(index))) {
+		ret = ESP_ERR_INVALID_CRC;
+	}
+
+	if (ret != ESP_OK) {
+		free(index);
+		return ret;
+	}
+
+	g_index = index;
+
+	return ESP_OK;
+}
+
+esp_err_t calib_begin(uint8_t step, uint32_t config_id)
+{
+	if (step < CALIB_MIN_STEP || step > CALIB_MAX_STEP) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	calib_abort();
+
+	g_draft = calloc(1, sizeof(calib_index_t));
+	if (!g_draft) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	g_draft->magic = CALIB_MAGIC;
+	g_draft->desc_version = DESC_VERSION;
+	g_draft->step = step;
+	g_draft->config_id = config_id;
+
+	return ESP_OK;
+}
+
+esp_err_t calib_add(int16_t angle, const shape_sig_t *sig)
+{
+	if (!g_draft) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (g_draft->count == MAX_ENTRIES) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	g_draft->entries[g_draft->count].angle = angle;
+	g_draft->entries[g_draft->count].sig = *sig;
+	++g_draft->count;
+
+	return ESP_OK;
+}
+
+esp_err_t calib_commit(calib_info_t *info)
+{
+	nvs_handle_t handle;
+
+	if (!g_draft || !g_draft->count) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	g_draft->crc = index_crc(g_draft);
+
+	ESP_ERROR_RETURN(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle));
+
+	esp_err_t ret = nvs_set_blob(handle, NVS_KEY, g_draft, index_size(g_draft));
+	if (ret == ESP_OK) {
+		ret = nvs_commit(handle);
+	}
+	nvs_close(handle);
+	ESP_ERROR_RETURN(ret);
+
+	info->step = g_draft->step;
+	info->count = g_draft->count;
+	info->bytes = index_size(g_draft);
+
+	ESP_LOGI(TAG, "Index of %u entries (%zu bytes) saved", info->count, info->bytes);
+
+	// The draft becomes the cached index, no need to read it back
+	free(g_index);
+	g_index = g_draft;
+	g_draft = NULL;
+
+	return ESP_OK;
+}
+
+void calib_abort(void)
+{
+	free(g_draft);
+	g_draft = NULL;
+}
+
+/*
+ * Nearest entry by signature distance, refined between its neighbours with a
+ * parabola through the three distances so the result isn't limited to the
+ * calibration step.
+ */
+esp_err_t calib_lookup(uint32_t config_id, const shape_sig_t *sig,
+		float *angle, float *distance)
+{
+	ESP_ERROR_RETURN(load_index());
+
+	if (g_index->desc_version != DESC_VERSION || g_index->config_id != config_id) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	float dist[MAX_ENTRIES] = {0};
+	uint8_t best = 0;
+
+	for (uint8_t i = 0; i < g_index->count; ++i) {
+		dist[i] = desc_sig_distance(sig, &g_index->entries[i].sig);
+		if (i == 0 || dist[i] < dist[best]) {
+			best = i;
+		}
+	}
+
+	*angle = g_index->entries[best].angle;
+	*distance = dist[best];
+
+	if (best > 0 && best + 1 < g_index->count) {
+		const float l = dist[best - 1], c = dist[best], r = dist[best + 1];
+		const float curvature = l - 2 * c + r;
+
+		if (curvature > 0) {
+			float offset = 0.5f * (l - r) / curvature;
+			float span = offset < 0 ?
+				g_index->entries[best].angle - g_index->entries[best - 1].angle :
+				g_index->entries[best + 1].angle - g_index->entries[best].angle;
+
+			*angle += fmaxf(-0.5f, fminf(0.5f, offset)) * span;
+		}
+	}
+
+	return ESP_OK;
+}
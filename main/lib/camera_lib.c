@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <esp_system.h>
 #include <esp_log.h>
 #include <esp_err.h>
@@ -9,6 +10,8 @@
 #include <hal/ledc_types.h>
 #include <driver/ledc.h>
 #include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "camera_lib.h"
 
 // Configuration for OV2640 sensor
 #define CAM_PIN_PWDN 32
@@ -44,6 +47,19 @@ static struct flash_config {
 	uint8_t intensity;
 } g_flash;
 
+// Last values applied through set_cam_sensor(), the sensor can't be queried
+static struct sensor_settings {
+	int8_t brightness;
+	int8_t contrast;
+	int8_t saturation;
+} g_sensor_settings;
+
+/*
+ * Held by commands while they run and by the preview stream while it has a
+ * frame, so the stream never takes the frame buffer a command waits for.
+ */
+static SemaphoreHandle_t g_camera_lock;
+
 static camera_config_t camera_config = {
 	.pin_pwdn = CAM_PIN_PWDN,
 	.pin_reset = CAM_PIN_RESET,
@@ -69,7 +85,7 @@ static camera_config_t camera_config = {
 	.pixel_format = PIXFORMAT_RGB565,  // PIXFORMAT_ + GRAYSCALE|RGB565|JPEG
 	.frame_size = FRAMESIZE_240X240,  // FRAMESIZE_ + 96X96|QQVGA|240X240|QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA
 	.jpeg_quality = 10,
-	.fb_count = 2,
+	.fb_count = CAMERA_FB_COUNT,
 	.grab_mode = CAMERA_GRAB_LATEST,
 	.fb_location = CAMERA_FB_IN_PSRAM
 };
@@ -115,6 +131,11 @@ esp_err_t init_camera(void)
 	ESP_ERROR_CHECK(esp_camera_init(&camera_config));
 	ESP_ERROR_CHECK(setup_flash_led());
 
+	g_camera_lock = xSemaphoreCreateMutex();
+	if (!g_camera_lock) {
+		return ESP_ERR_NO_MEM;
+	}
+
 	ESP_LOGI(TAG, "Camera and flash LED are initialized");
 
 	return ESP_OK;
@@ -154,7 +175,9 @@ camera_fb_t *take_picture()
 		}
 		vTaskDelay(pdMS_TO_TICKS(100));
 
+		perf_start(PERF_CAPTURE);
 		picture = esp_camera_fb_get();
+		perf_stop(PERF_CAPTURE);
 
 		for (uint8_t i = 0; i < 5; ++i) {
 			if (set_flash_brightness(MIN_FLASH_INTENSITY) == ESP_OK) {
@@ -163,7 +186,9 @@ camera_fb_t *take_picture()
 		}
 
 	} else {
+		perf_start(PERF_CAPTURE);
 		picture = esp_camera_fb_get();
+		perf_stop(PERF_CAPTURE);
 
 	}
 
@@ -178,6 +203,43 @@ camera_fb_t *take_picture()
 	return picture;
 }
 
+/*
+ * Waits for the preview stream to hand back its frame, if it has one
+ */
+void camera_lock(void)
+{
+	xSemaphoreTake(g_camera_lock, portMAX_DELAY);
+}
+
+void camera_unlock(void)
+{
+	xSemaphoreGive(g_camera_lock);
+}
+
+/*
+ * A frame for the preview stream, without the flash. NULL while a command
+ * uses the camera.
+ */
+camera_fb_t *take_preview(void)
+{
+	if (xSemaphoreTake(g_camera_lock, 0) != pdTRUE) {
+		return NULL;
+	}
+
+	camera_fb_t *picture = esp_camera_fb_get();
+	if (!picture) {
+		xSemaphoreGive(g_camera_lock);
+	}
+
+	return picture;
+}
+
+void free_preview(camera_fb_t *picture)
+{
+	esp_camera_fb_return(picture);
+	xSemaphoreGive(g_camera_lock);
+}
+
 void free_picture(camera_fb_t **ptr_picture)
 {
 	esp_camera_fb_return(*ptr_picture);
@@ -198,14 +260,49 @@ esp_err_t set_cam_sensor(char *setting, int value)
 
 	if (!strcmp(setting, "brightness")) {
 		ret = cam_sensor->set_brightness(cam_sensor, value);
+		if (ESP_OK == ret) {
+			g_sensor_settings.brightness = value;
+		}
 
 	} else if (!strcmp(setting, "contrast")) {
 		ret = cam_sensor->set_contrast(cam_sensor, value);
+		if (ESP_OK == ret) {
+			g_sensor_settings.contrast = value;
+		}
 
 	} else if (!strcmp(setting, "saturation")) {
 		ret = cam_sensor->set_saturation(cam_sensor, value);
+		if (ESP_OK == ret) {
+			g_sensor_settings.saturation = value;
+		}
 
 	}
 
 	return ret;
 }
+
+/*
+ * FNV-1a over everything that changes how a scene looks in a frame: format,
+ * frame size, flash and sensor settings. Data derived from frames (e.g. the
+ * calibration index) stores it to detect that it no longer applies.
+ */
+uint32_t get_camera_config_id(void)
+{
+	const int32_t fields[] = {
+		camera_config.pixel_format,
+		camera_config.frame_size,
+		g_flash.on,
+		g_flash.on ? g_flash.intensity : 0,
+		g_sensor_settings.brightness,
+		g_sensor_settings.contrast,
+		g_sensor_settings.saturation
+	};
+	const uint8_t *bytes = (const uint8_t *)fields;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(fields); ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	return hash;
+}
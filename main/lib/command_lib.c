@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include "command_lib.h"
+
+/*
+ * The MQTT task runs at priority 5, the control worker right below it so it
+ * preempts a job doing CPU work (scoring) on the same core.
+ */
+#define CMD_CONTROL_STACK 4096
+#define CMD_CONTROL_PRIORITY 4
+#define CMD_JOB_STACK 6144
+#define CMD_JOB_PRIORITY 3
+
+
+static const char *TAG = "command_lib";
+
+typedef struct {
+	char payload[CMD_PAYLOAD_LEN];
+	int64_t submitted_us;
+} cmd_item_t;
+
+static struct worker {
+	QueueHandle_t queue;
+	int64_t started_us;
+	cmd_stats_t stats;
+} g_workers[CMD_QUEUES];
+
+static cmd_exec_t g_exec;
+static volatile bool g_cancel;
+static volatile int64_t g_deadline_us;  // of the running job, 0 for none
+
+// The stats are written by the workers and read from the MQTT task
+static portMUX_TYPE g_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * Held while a worker takes a command off its queue and marks it running,
+ * so command_cancel() finds a job either still queued or running
+ */
+static SemaphoreHandle_t g_take_lock;
+
+
+static void worker_task(void *arg);
+
+
+esp_err_t command_init(cmd_exec_t exec)
+{
+	static const struct {
+		const char *name;
+		UBaseType_t length;
+		uint32_t stack;
+		UBaseType_t priority;
+	} config[CMD_QUEUES] = {
+		[CMD_CONTROL] = {"cmd_control", CMD_CONTROL_QUEUE_LEN, CMD_CONTROL_STACK, CMD_CONTROL_PRIORITY},
+		[CMD_JOB] = {"cmd_job", CMD_JOB_QUEUE_LEN, CMD_JOB_STACK, CMD_JOB_PRIORITY}
+	};
+
+	g_exec = exec;
+
+	g_take_lock = xSemaphoreCreateMutex();
+	if (!g_take_lock) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (uint8_t i = 0; i < CMD_QUEUES; ++i) {
+		g_workers[i].queue = xQueueCreate(config[i].length, sizeof(cmd_item_t));
+		if (!g_workers[i].queue) {
+			return ESP_ERR_NO_MEM;
+		}
+
+		if (xTaskCreate(worker_task, config[i].name, config[i].stack, &g_workers[i],
+				config[i].priority, NULL) != pdPASS) {
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t command_submit(cmd_queue_t queue, const char *payload)
+{
+	cmd_item_t item;
+
+	if (strlen(payload) >= sizeof(item.payload)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	strcpy(item.payload, payload);
+	item.submitted_us = esp_timer_get_time();
+
+	if (xQueueSend(g_workers[queue].queue, &item, 0) != pdTRUE) {
+		ESP_LOGW(TAG, "Queue %d is full, \"%s\" dropped", queue, payload);
+		return ESP_ERR_TIMEOUT;
+	}
+
+	return ESP_OK;
+}
+
+/*
+ * Drops the commands that haven't started yet, returns how many
+ */
+uint8_t command_flush(cmd_queue_t queue)
+{
+	cmd_item_t item;
+	uint8_t dropped = 0;
+
+	while (xQueueReceive(g_workers[queue].queue, &item, 0) == pdTRUE) {
+		++dropped;
+	}
+
+	return dropped;
+}
+
+void command_get_stats(cmd_queue_t queue, cmd_stats_t *stats)
+{
+	struct worker *worker = &g_workers[queue];
+
+	portENTER_CRITICAL(&g_stats_lock);
+	*stats = worker->stats;
+	if (stats->running[0]) {
+		stats->running_us = esp_timer_get_time() - worker->started_us;
+	}
+	portEXIT_CRITICAL(&g_stats_lock);
+
+	stats->waiting = uxQueueMessagesWaiting(worker->queue);
+}
+
+/*
+ * Stops the running job at its next check and drops the queued ones.
+ * Returns whether a job was running.
+ */
+bool command_cancel(uint8_t *dropped)
+{
+	bool running;
+
+	xSemaphoreTake(g_take_lock, portMAX_DELAY);
+
+	*dropped = command_flush(CMD_JOB);
+
+	portENTER_CRITICAL(&g_stats_lock);
+	running = g_workers[CMD_JOB].stats.running[0];
+	g_cancel = running;
+	portEXIT_CRITICAL(&g_stats_lock);
+
+	xSemaphoreGive(g_take_lock);
+
+	return running;
+}
+
+/*
+ * Limits the job worker's current step, 0 lifts the limit
+ */
+void command_set_timeout(uint32_t timeout_ms)
+{
+	g_deadline_us = timeout_ms ? esp_timer_get_time() + timeout_ms * 1000LL : 0;
+}
+
+bool command_cancelled(void)
+{
+	const int64_t deadline = g_deadline_us;
+
+	if (!g_cancel && deadline && esp_timer_get_time() > deadline) {
+		ESP_LOGW(TAG, "Job ran out of time, cancelling it");
+		g_cancel = true;
+	}
+
+	return g_cancel;
+}
+
+static void worker_task(void *arg)
+{
+	struct worker *worker = arg;
+	char name[sizeof(worker->stats.running)];
+	cmd_item_t item;
+
+	for (;;) {
+		// Waits without the lock, command_cancel() may flush it meanwhile
+		xQueuePeek(worker->queue, &item, portMAX_DELAY);
+
+		xSemaphoreTake(g_take_lock, portMAX_DELAY);
+		if (xQueueReceive(worker->queue, &item, 0) != pdTRUE) {
+			xSemaphoreGive(g_take_lock);
+			continue;
+		}
+
+		const int64_t start = esp_timer_get_time();
+		const int64_t wait = start - item.submitted_us;
+
+		// The first command's name, after the correlation ID if there is one
+		const char *first = item.payload;
+		if (first[0] == '#') {
+			first += strcspn(first, " ");
+			first += strspn(first, " ");
+		}
+		snprintf(name, sizeof(name), "%.*s", (int)strcspn(first, " ;"), first);
+
+		portENTER_CRITICAL(&g_stats_lock);
+		worker->started_us = start;
+		memcpy(worker->stats.running, name, sizeof(name));
+		worker->stats.last_wait_us = wait;
+		if (wait > worker->stats.max_wait_us) {
+			worker->stats.max_wait_us = wait;
+		}
+		if (worker == &g_workers[CMD_JOB]) {
+			g_cancel = false;
+			g_deadline_us = 0;
+		}
+		portEXIT_CRITICAL(&g_stats_lock);
+
+		xSemaphoreGive(g_take_lock);
+
+		g_exec(item.payload, wait);
+
+		portENTER_CRITICAL(&g_stats_lock);
+		worker->stats.running[0] = '\0';
+		worker->stats.last_exec_us = esp_timer_get_time() - start;
+		++worker->stats.done;
+		portEXIT_CRITICAL(&g_stats_lock);
+	}
+}
@@ -0,0 +1,369 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "image_lib.h"
+#include "descriptor_lib.h"
+
+#define WORK_PIXELS (DESC_WORK_SIDE * DESC_WORK_SIDE)
+// Upper bound for a traced boundary, every pixel can be visited from two sides
+#define MAX_TRACE (2 * WORK_PIXELS)
+
+
+/*
+ * Otsu's method on the 256-bin histogram: the threshold that maximizes the
+ * between-class variance.
+ */
+static uint8_t otsu_threshold(const uint32_t hist[256], uint32_t total)
+{
+	uint64_t sum_all = 0;
+
+	for (uint16_t v = 0; v < 256; ++v) {
+		sum_all += (uint64_t)v * hist[v];
+	}
+
+	uint64_t sum_bg = 0;
+	uint32_t weight_bg = 0;
+	float best_var = -1.0f;
+	uint8_t best = 0;
+
+	for (uint16_t t = 0; t < 256; ++t) {
+		weight_bg += hist[t];
+		if (!weight_bg) {
+			continue;
+		}
+
+		uint32_t weight_fg = total - weight_bg;
+		if (!weight_fg) {
+			break;
+		}
+
+		sum_bg += (uint64_t)t * hist[t];
+
+		float mean_bg = (float)sum_bg / weight_bg;
+		float mean_fg = (float)(sum_all - sum_bg) / weight_fg;
+		float var = (float)weight_bg * weight_fg * (mean_bg - mean_fg) * (mean_bg - mean_fg);
+
+		if (var > best_var) {
+			best_var = var;
+			best = (uint8_t)t;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Binarize so that the object is 1. The class that covers most of the frame
+ * border is taken as background, which handles both bright objects on a dark
+ * table and the other way round.
+ */
+static void binarize(const uint8_t *gray, uint8_t threshold, uint8_t *bin, bool *dark_object)
+{
+	const uint16_t side = DESC_WORK_SIDE;
+	uint16_t bright_border = 0;
+
+	for (uint16_t i = 0; i < side; ++i) {
+		bright_border += gray[i] > threshold;
+		bright_border += gray[(side - 1) * side + i] > threshold;
+		bright_border += gray[i * side] > threshold;
+		bright_border += gray[i * side + side - 1] > threshold;
+	}
+
+	*dark_object = bright_border > 2 * side;
+
+	for (uint16_t i = 0; i < WORK_PIXELS; ++i) {
+		bin[i] = (gray[i] > threshold) != *dark_object;
+	}
+}
+
+static void compute_moments(const uint8_t *bin, shape_desc_t *desc, float *mcx, float *mcy)
+{
+	float m00 = 0, m10 = 0, m01 = 0;
+
+	for (uint16_t y = 0; y < DESC_WORK_SIDE; ++y) {
+		for (uint16_t x = 0; x < DESC_WORK_SIDE; ++x) {
+			if (bin[y * DESC_WORK_SIDE + x]) {
+				m00 += 1;
+				m10 += x;
+				m01 += y;
+			}
+		}
+	}
+
+	desc->area = (uint16_t)m00;
+	memset(desc->hu, 0, sizeof(desc->hu));
+	if (!desc->area) {
+		*mcx = *mcy = DESC_WORK_SIDE / 2.0f;
+		return;
+	}
+
+	const float cx = m10 / m00, cy = m01 / m00;
+	float mu20 = 0, mu02 = 0, mu11 = 0, mu30 = 0, mu03 = 0, mu21 = 0, mu12 = 0;
+
+	for (uint16_t y = 0; y < DESC_WORK_SIDE; ++y) {
+		const float dy = y - cy;
+
+		for (uint16_t x = 0; x < DESC_WORK_SIDE; ++x) {
+			if (!bin[y * DESC_WORK_SIDE + x]) {
+				continue;
+			}
+
+			const float dx = x - cx;
+
+			mu20 += dx * dx;
+			mu02 += dy * dy;
+			mu11 += dx * dy;
+			mu30 += dx * dx * dx;
+			mu03 += dy * dy * dy;
+			mu21 += dx * dx * dy;
+			mu12 += dx * dy * dy;
+		}
+	}
+
+	// Scale invariant eta_pq = mu_pq / m00^(1 + (p + q) / 2)
+	const float s2 = m00 * m00, s3 = s2 * sqrtf(m00);
+	const float n20 = mu20 / s2, n02 = mu02 / s2, n11 = mu11 / s2;
+	const float n30 = mu30 / s3, n03 = mu03 / s3, n21 = mu21 / s3, n12 = mu12 / s3;
+	const float a = n30 + n12, b = n21 + n03;
+
+	desc->hu[0] = n20 + n02;
+	desc->hu[1] = (n20 - n02) * (n20 - n02) + 4 * n11 * n11;
+	desc->hu[2] = (n30 - 3 * n12) * (n30 - 3 * n12) + (3 * n21 - n03) * (3 * n21 - n03);
+	desc->hu[3] = a * a + b * b;
+	desc->hu[4] = (n30 - 3 * n12) * a * (a * a - 3 * b * b) +
+		(3 * n21 - n03) * b * (3 * a * a - b * b);
+	desc->hu[5] = (n20 - n02) * (a * a - b * b) + 4 * n11 * a * b;
+	desc->hu[6] = (3 * n21 - n03) * a * (a * a - 3 * b * b) -
+		(n30 - 3 * n12) * b * (3 * a * a - b * b);
+
+	desc->cx = (uint8_t)lroundf(cx);
+	desc->cy = (uint8_t)lroundf(cy);
+	*mcx = cx;
+	*mcy = cy;
+}
+
+static inline bool is_set(const uint8_t *bin, int x, int y)
+{
+	return x >= 0 && y >= 0 && x < DESC_WORK_SIDE && y < DESC_WORK_SIDE &&
+		bin[y * DESC_WORK_SIDE + x];
+}
+
+/*
+ * Moore-neighbour tracing of the outer boundary of the first object met in
+ * raster order. Returns the number of boundary points written to trace.
+ */
+static uint16_t trace_boundary(const uint8_t *bin, uint8_t (*trace)[2])
+{
+	static const int8_t dx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+	static const int8_t dy[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+	int sx = -1, sy = -1;
+
+	for (int i = 0; i < WORK_PIXELS && sx < 0; ++i) {
+		if (bin[i]) {
+			sx = i % DESC_WORK_SIDE;
+			sy = i / DESC_WORK_SIDE;
+		}
+	}
+	if (sx < 0) {
+		return 0;
+	}
+
+	int x = sx, y = sy;
+	// Entered from the west, so start looking from north-west
+	uint8_t dir = 5;
+	uint16_t n = 0;
+
+	do {
+		trace[n][0] = (uint8_t)x;
+		trace[n][1] = (uint8_t)y;
+		++n;
+
+		uint8_t k;
+		for (k = 0; k < 8; ++k) {
+			uint8_t d = (dir + k) % 8;
+
+			if (is_set(bin, x + dx[d], y + dy[d])) {
+				x += dx[d];
+				y += dy[d];
+				// Continue the search from the neighbour before the one found
+				dir = (d + 6) % 8;
+				break;
+			}
+		}
+		if (k == 8) {
+			break;  // isolated pixel
+		}
+	} while ((x != sx || y != sy) && n < MAX_TRACE);
+
+	return n;
+}
+
+static void radial_signature(const uint8_t (*trace)[2], uint16_t len,
+			float cx, float cy, uint8_t *radial)
+{
+	float dist[DESC_RADIAL_BINS] = {0};
+	float max_dist = 0;
+
+	for (uint16_t i = 0; i < len; ++i) {
+		const float dx = trace[i][0] - cx, dy = trace[i][1] - cy;
+		const float d = sqrtf(dx * dx + dy * dy);
+		float angle = atan2f(dy, dx);
+
+		if (angle < 0) {
+			angle += 2.0f * (float)M_PI;
+		}
+
+		uint16_t bin = (uint16_t)(angle * DESC_RADIAL_BINS / (2.0f * (float)M_PI)) %
+			DESC_RADIAL_BINS;
+
+		if (d > dist[bin]) {
+			dist[bin] = d;
+		}
+		if (d > max_dist) {
+			max_dist = d;
+		}
+	}
+
+	for (uint16_t i = 0; i < DESC_RADIAL_BINS; ++i) {
+		radial[i] = max_dist > 0 ? (uint8_t)lroundf(dist[i] * 255 / max_dist) : 0;
+	}
+}
+
+// 2x2 majority (at least two of four) of the work mask into packed rows
+static void pack_mask(const uint8_t *bin, uint32_t *mask)
+{
+	for (uint16_t my = 0; my < DESC_MASK_SIDE; ++my) {
+		const uint8_t *top = bin + 2 * my * DESC_WORK_SIDE;
+		const uint8_t *bottom = top + DESC_WORK_SIDE;
+		uint32_t row = 0;
+
+		for (uint16_t mx = 0; mx < DESC_MASK_SIDE; ++mx) {
+			uint8_t votes = top[2 * mx] + top[2 * mx + 1] +
+				bottom[2 * mx] + bottom[2 * mx + 1];
+
+			row |= (uint32_t)(votes >= 2) << mx;
+		}
+		mask[my] = row;
+	}
+}
+
+bool desc_compute(const uint8_t *pixels, uint16_t width, uint16_t height,
+		bool rgb565, shape_desc_t *desc)
+{
+	const uint8_t factor = (width < height ? width : height) / DESC_WORK_SIDE;
+	const uint16_t scaled_w = factor ? width / factor : 0;
+	const uint16_t scaled_h = factor ? height / factor : 0;
+	bool ok = false;
+
+	uint8_t *scaled = malloc(scaled_w * scaled_h);
+	uint8_t *proxy = malloc(WORK_PIXELS);
+	uint8_t *work = malloc(WORK_PIXELS);
+	uint8_t (*trace)[2] = malloc(MAX_TRACE * sizeof(*trace));
+	uint32_t *hist = malloc(256 * sizeof(uint32_t));
+
+	if (!factor || !scaled || !proxy || !work || !trace || !hist) {
+		goto cleanup;
+	}
+
+	if (!img_box_downscale(pixels, width, height, factor, rgb565, scaled)) {
+		goto cleanup;
+	}
+
+	// Crop the centred square for non-square frames
+	const uint16_t x0 = (scaled_w - DESC_WORK_SIDE) / 2;
+	const uint16_t y0 = (scaled_h - DESC_WORK_SIDE) / 2;
+
+	for (uint16_t row = 0; row < DESC_WORK_SIDE; ++row) {
+		memcpy(proxy + row * DESC_WORK_SIDE,
+			scaled + (size_t)(y0 + row) * scaled_w + x0, DESC_WORK_SIDE);
+	}
+
+	if (!img_blur3x3(proxy, DESC_WORK_SIDE, DESC_WORK_SIDE, work)) {
+		goto cleanup;
+	}
+
+	memset(desc, 0, sizeof(*desc));
+
+	img_histogram(work, WORK_PIXELS, hist);
+	desc->threshold = otsu_threshold(hist, WORK_PIXELS);
+	binarize(work, desc->threshold, proxy, &desc->dark_object);
+
+	float cx, cy;
+	compute_moments(proxy, desc, &cx, &cy);
+	pack_mask(proxy, desc->sig.mask);
+
+	uint16_t trace_len = trace_boundary(proxy, trace);
+	radial_signature(trace, trace_len, cx, cy, desc->sig.radial);
+
+	desc->contour_len = trace_len < DESC_CONTOUR_POINTS ? trace_len : DESC_CONTOUR_POINTS;
+	for (uint16_t i = 0; i < desc->contour_len; ++i) {
+		const uint16_t src = (uint32_t)i * trace_len / desc->contour_len;
+
+		desc->contour[i][0] = trace[src][0];
+		desc->contour[i][1] = trace[src][1];
+	}
+
+	ok = true;
+
+cleanup:
+	free(scaled);
+	free(proxy);
+	free(work);
+	free(trace);
+	free(hist);
+
+	return ok;
+}
+
+/*
+ * Orientation sensitive distance used for alignment: Jaccard distance of the
+ * masks plus the mean difference of the radial signatures, 0 for identical
+ * signatures and at most 2.
+ */
+float desc_sig_distance(const shape_sig_t *a, const shape_sig_t *b)
+{
+	uint32_t diff = 0, uni = 0;
+
+	for (uint16_t i = 0; i < DESC_MASK_SIDE; ++i) {
+		diff += __builtin_popcount(a->mask[i] ^ b->mask[i]);
+		uni += __builtin_popcount(a->mask[i] | b->mask[i]);
+	}
+
+	uint32_t radial = 0;
+	for (uint16_t i = 0; i < DESC_RADIAL_BINS; ++i) {
+		radial += abs((int)a->radial[i] - b->radial[i]);
+	}
+
+	return (uni ? (float)diff / uni : 0.0f) + radial / (255.0f * DESC_RADIAL_BINS);
+}
+
+float desc_distance(const shape_desc_t *a, const shape_desc_t *b)
+{
+	return desc_sig_distance(&a->sig, &b->sig);
+}
+
+/*
+ * Rotation invariant shape distance on log-scaled Hu moments (as in OpenCV's
+ * CONTOURS_MATCH_I1), for telling whether it is the same object at all.
+ */
+float desc_hu_distance(const shape_desc_t *a, const shape_desc_t *b)
+{
+	float dist = 0;
+
+	for (uint8_t i = 0; i < DESC_HU_MOMENTS; ++i) {
+		const float ha = fabsf(a->hu[i]), hb = fabsf(b->hu[i]);
+
+		if (ha < 1e-12f || hb < 1e-12f) {
+			continue;
+		}
+
+		const float la = copysignf(1.0f, a->hu[i]) * log10f(ha);
+		const float lb = copysignf(1.0f, b->hu[i]) * log10f(hb);
+
+		dist += fabsf(1.0f / la - 1.0f / lb);
+	}
+
+	return dist;
+}
@@ -0,0 +1,356 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <esp_err.h>
+#include <esp_camera.h>
+#include <img_converters.h>
+#include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "encode_lib.h"
+
+#define BMP_HEADER_LEN 54
+#define BMP_BYTES_PER_PIXEL 3
+
+#define QOI_HEADER_LEN 14
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_MAX_RUN 62
+// Written for one pixel at most: a pending QOI_OP_RUN and a QOI_OP_RGB
+#define QOI_MAX_PIXEL_LEN 5
+
+
+static const char *g_format_ext[ENC_FORMATS] = {
+	[ENC_BMP] = "bmp",
+	[ENC_JPEG] = "jpg",
+	[ENC_QOI] = "qoi"
+};
+
+typedef struct {
+	enc_sink_t sink;
+	void *ctx;
+	esp_err_t ret;
+} jpeg_sink_t;
+
+
+static void put_le16(uint8_t *dst, uint16_t value)
+{
+	dst[0] = value;
+	dst[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *dst, uint32_t value)
+{
+	put_le16(dst, value);
+	put_le16(dst + 2, value >> 16);
+}
+
+static void put_be32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+const char *enc_format_ext(enc_format_t format)
+{
+	return format < ENC_FORMATS ? g_format_ext[format] : "";
+}
+
+/*
+ * Accepts the format names as well as file names, by their extension
+ */
+bool enc_format_from_name(const char *name, enc_format_t *format)
+{
+	const char *ext = strrchr(name, '.');
+
+	ext = ext ? ext + 1 : name;
+
+	if (!strcasecmp(ext, "jpeg")) {
+		*format = ENC_JPEG;
+		return true;
+	}
+
+	for (uint8_t i = 0; i < ENC_FORMATS; ++i) {
+		if (!strcasecmp(ext, g_format_ext[i])) {
+			*format = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// BMP rows are padded to a multiple of 4 bytes
+static size_t bmp_row_size(uint16_t width)
+{
+	return (width * BMP_BYTES_PER_PIXEL + 3) & ~(size_t)3;
+}
+
+/*
+ * 24-bit BGR with a negative height (rows top to bottom), the same layout as
+ * frame2bmp() produces.
+ */
+static void bmp_header(const camera_fb_t *frame, uint8_t *header)
+{
+	const uint32_t pixels_size = bmp_row_size(frame->width) * frame->height;
+
+	memset(header, 0, BMP_HEADER_LEN);
+
+	header[0] = 'B';
+	header[1] = 'M';
+	put_le32(header + 2, BMP_HEADER_LEN + pixels_size);
+	put_le32(header + 10, BMP_HEADER_LEN);
+	put_le32(header + 14, 40);
+	put_le32(header + 18, frame->width);
+	put_le32(header + 22, -(int32_t)frame->height);
+	put_le16(header + 26, 1);
+	put_le16(header + 28, BMP_BYTES_PER_PIXEL * 8);
+	put_le32(header + 34, pixels_size);
+}
+
+static void bmp_row(const camera_fb_t *frame, uint16_t y, uint8_t *dst)
+{
+	if (frame->format == PIXFORMAT_GRAYSCALE) {
+		const uint8_t *src = frame->buf + (size_t)y * frame->width;
+
+		for (uint16_t x = 0; x < frame->width; ++x, dst += 3) {
+			dst[0] = dst[1] = dst[2] = src[x];
+		}
+
+	} else {
+		// Big-endian RGB565: RRRRRGGG GGGBBBBB
+		const uint8_t *src = frame->buf + (size_t)y * frame->width * 2;
+
+		for (uint16_t x = 0; x < frame->width; ++x, src += 2, dst += 3) {
+			dst[0] = (src[1] & 0x1F) << 3;
+			dst[1] = (src[0] & 0x07) << 5 | (src[1] & 0xE0) >> 3;
+			dst[2] = src[0] & 0xF8;
+		}
+
+	}
+
+	memset(dst, 0, bmp_row_size(frame->width) - frame->width * BMP_BYTES_PER_PIXEL);
+}
+
+size_t enc_bmp_size(const camera_fb_t *frame)
+{
+	return BMP_HEADER_LEN + bmp_row_size(frame->width) * frame->height;
+}
+
+esp_err_t enc_bmp_stream(const camera_fb_t *frame, enc_sink_t sink, void *ctx)
+{
+	if (frame->format != PIXFORMAT_RGB565 && frame->format != PIXFORMAT_GRAYSCALE) {
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	const size_t row_size = bmp_row_size(frame->width);
+	uint16_t rows_per_chunk = ENC_CHUNK_SIZE / row_size;
+	if (!rows_per_chunk) {
+		rows_per_chunk = 1;
+	}
+
+	uint8_t *chunk = malloc(rows_per_chunk * row_size);
+	if (!chunk) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	uint8_t header[BMP_HEADER_LEN];
+	bmp_header(frame, header);
+
+	esp_err_t ret = sink(ctx, header, sizeof(header));
+
+	for (uint16_t y = 0; y < frame->height && ret == ESP_OK; y += rows_per_chunk) {
+		uint16_t rows = frame->height - y < rows_per_chunk ?
+			frame->height - y : rows_per_chunk;
+
+		perf_start(PERF_ENCODE);
+		for (uint16_t r = 0; r < rows; ++r) {
+			bmp_row(frame, y + r, chunk + r * row_size);
+		}
+		perf_stop(PERF_ENCODE);
+
+		ret = sink(ctx, chunk, rows * row_size);
+	}
+
+	free(chunk);
+
+	return ret;
+}
+
+// RGB888 the same way as the BMP rows, so both decode to identical pixels
+static void pixel_rgb(const camera_fb_t *frame, size_t i, uint8_t *rgb)
+{
+	if (frame->format == PIXFORMAT_GRAYSCALE) {
+		rgb[0] = rgb[1] = rgb[2] = frame->buf[i];
+	} else {
+		const uint8_t *src = frame->buf + i * 2;
+
+		rgb[0] = src[0] & 0xF8;
+		rgb[1] = (src[0] & 0x07) << 5 | (src[1] & 0xE0) >> 3;
+		rgb[2] = (src[1] & 0x1F) << 3;
+	}
+}
+
+static uint8_t qoi_hash(const uint8_t *rgb)
+{
+	return (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+}
+
+/*
+ * QOI with 3 channels; alpha is always 255 so only the RGB ops are used.
+ */
+esp_err_t enc_qoi_stream(const camera_fb_t *frame, enc_sink_t sink, void *ctx)
+{
+	if (frame->format != PIXFORMAT_RGB565 && frame->format != PIXFORMAT_GRAYSCALE) {
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	uint8_t *chunk = malloc(ENC_CHUNK_SIZE);
+	// Seen pixels, zeroed entries can't match as nothing is hashed into them
+	uint8_t (*index)[3] = calloc(64, 3);
+	bool *used = calloc(64, sizeof(bool));
+	if (!chunk || !index || !used) {
+		free(chunk);
+		free(index);
+		free(used);
+		return ESP_ERR_NO_MEM;
+	}
+
+	const size_t pixels = (size_t)frame->width * frame->height;
+	uint8_t prev[3] = {0, 0, 0};
+	uint8_t run = 0;
+	size_t len = 0;
+	esp_err_t ret = ESP_OK;
+
+	memcpy(chunk, "qoif", 4);
+	put_be32(chunk + 4, frame->width);
+	put_be32(chunk + 8, frame->height);
+	chunk[12] = 3;
+	chunk[13] = 0;
+	len = QOI_HEADER_LEN;
+
+	perf_start(PERF_ENCODE);
+	for (size_t i = 0; i < pixels && ret == ESP_OK; ++i) {
+		uint8_t px[3];
+
+		pixel_rgb(frame, i, px);
+
+		if (!memcmp(px, prev, 3)) {
+			if (++run == QOI_MAX_RUN || i == pixels - 1) {
+				chunk[len++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+		} else {
+			if (run) {
+				chunk[len++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			uint8_t hash = qoi_hash(px);
+
+			if (used[hash] && !memcmp(index[hash], px, 3)) {
+				chunk[len++] = QOI_OP_INDEX | hash;
+			} else {
+				int8_t dr = px[0] - prev[0];
+				int8_t dg = px[1] - prev[1];
+				int8_t db = px[2] - prev[2];
+				int8_t dr_dg = dr - dg;
+				int8_t db_dg = db - dg;
+
+				memcpy(index[hash], px, 3);
+				used[hash] = true;
+
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					chunk[len++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+				} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+					   db_dg >= -8 && db_dg <= 7) {
+					chunk[len++] = QOI_OP_LUMA | (dg + 32);
+					chunk[len++] = (dr_dg + 8) << 4 | (db_dg + 8);
+				} else {
+					chunk[len++] = QOI_OP_RGB;
+					memcpy(chunk + len, px, 3);
+					len += 3;
+				}
+			}
+
+			memcpy(prev, px, 3);
+		}
+
+		if (len > ENC_CHUNK_SIZE - QOI_MAX_PIXEL_LEN) {
+			perf_stop(PERF_ENCODE);
+			ret = sink(ctx, chunk, len);
+			perf_start(PERF_ENCODE);
+			len = 0;
+		}
+	}
+	perf_stop(PERF_ENCODE);
+
+	if (ret == ESP_OK) {
+		// End marker: seven 0x00 and a 0x01
+		if (len > ENC_CHUNK_SIZE - 8) {
+			ret = sink(ctx, chunk, len);
+			len = 0;
+		}
+		memset(chunk + len, 0, 7);
+		chunk[len + 7] = 1;
+		len += 8;
+	}
+
+	if (ret == ESP_OK) {
+		ret = sink(ctx, chunk, len);
+	}
+
+	free(chunk);
+	free(index);
+	free(used);
+
+	return ret;
+}
+
+// The driver wants the number of bytes taken, anything less aborts encoding
+static size_t jpeg_out(void *arg, size_t index, const void *data, size_t len)
+{
+	jpeg_sink_t *out = arg;
+
+	if (out->ret == ESP_OK) {
+		out->ret = out->sink(out->ctx, data, len);
+	}
+
+	return out->ret == ESP_OK ? len : 0;
+}
+
+esp_err_t enc_jpeg_stream(const camera_fb_t *frame, uint8_t quality,
+		enc_sink_t sink, void *ctx)
+{
+	jpeg_sink_t out = {sink, ctx, ESP_OK};
+
+	if (quality < 1 || quality > 100) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	// The driver has no const in its API, the frame isn't modified though
+	if (!frame2jpg_cb((camera_fb_t *)frame, quality, jpeg_out, &out)) {
+		return out.ret != ESP_OK ? out.ret : ESP_FAIL;
+	}
+
+	return out.ret;
+}
+
+esp_err_t enc_stream(const camera_fb_t *frame, enc_format_t format, uint8_t quality,
+		enc_sink_t sink, void *ctx)
+{
+	switch (format) {
+	case ENC_BMP:
+		return enc_bmp_stream(frame, sink, ctx);
+	case ENC_JPEG:
+		return enc_jpeg_stream(frame, quality, sink, ctx);
+	case ENC_QOI:
+		return enc_qoi_stream(frame, sink, ctx);
+	default:
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+}
@@ -0,0 +1,99 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "fft_lib.h"
+
+#define FFT_MAX_LOG2 8
+
+
+/*
+ * Twiddles and bit reversal are tabulated once for FFT_MAX_POINTS, smaller
+ * transforms use a strided subset. ESP32's FPU is single precision only, so
+ * everything is float; the tables are built with the float sin/cos as well.
+ */
+static float g_cos[FFT_MAX_POINTS / 2];
+static float g_sin[FFT_MAX_POINTS / 2];
+static uint8_t g_bitrev[FFT_MAX_POINTS];
+static bool g_initialized = false;
+
+
+void fft_init(void)
+{
+	if (g_initialized) {
+		return;
+	}
+
+	for (uint16_t i = 0; i < FFT_MAX_POINTS / 2; ++i) {
+		float phase = -2.0f * (float)M_PI * i / FFT_MAX_POINTS;
+
+		g_cos[i] = cosf(phase);
+		g_sin[i] = sinf(phase);
+	}
+
+	for (uint16_t i = 0; i < FFT_MAX_POINTS; ++i) {
+		uint16_t rev = 0;
+
+		for (uint8_t bit = 0; bit < FFT_MAX_LOG2; ++bit) {
+			rev |= ((i >> bit) & 1) << (FFT_MAX_LOG2 - 1 - bit);
+		}
+		g_bitrev[i] = (uint8_t)rev;
+	}
+
+	g_initialized = true;
+}
+
+/*
+ * The inverse transform is not scaled by 1/n, callers that need absolute
+ * values do that themselves (phase correlation only cares about the peak).
+ */
+bool fft_radix2(float *re, float *im, uint16_t n, bool inverse)
+{
+	uint8_t log2n = 0;
+
+	while ((1u << log2n) < n) {
+		++log2n;
+	}
+	if (n < 2 || (1u << log2n) != n || n > FFT_MAX_POINTS) {
+		return false;
+	}
+
+	fft_init();
+
+	const uint8_t shift = FFT_MAX_LOG2 - log2n;
+
+	for (uint16_t i = 0; i < n; ++i) {
+		uint16_t j = g_bitrev[i] >> shift;
+
+		if (j > i) {
+			float tmp = re[i];
+			re[i] = re[j];
+			re[j] = tmp;
+
+			tmp = im[i];
+			im[i] = im[j];
+			im[j] = tmp;
+		}
+	}
+
+	const float sign = inverse ? -1.0f : 1.0f;
+
+	for (uint16_t half = 1, stride = FFT_MAX_POINTS / 2; half < n; half <<= 1, stride >>= 1) {
+		for (uint16_t k = 0; k < half; ++k) {
+			const float wr = g_cos[k * stride];
+			const float wi = sign * g_sin[k * stride];
+
+			for (uint16_t i = k; i < n; i += half << 1) {
+				const uint16_t j = i + half;
+				const float tr = wr * re[j] - wi * im[j];
+				const float ti = wr * im[j] + wi * re[j];
+
+				re[j] = re[i] - tr;
+				im[j] = im[i] - ti;
+				re[i] += tr;
+				im[i] += ti;
+			}
+		}
+	}
+
+	return true;
+}
@@ -1,12 +1,23 @@
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <esp_system.h>
 #include <esp_log.h>
 #include <esp_err.h>
 #include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "ftp_lib.h"
 
 /*
  * IP and port max lengths as strings. These are used when FTP
@@ -15,12 +26,34 @@
 #define IP_LEN 40
 #define PORT_LEN 7
 
+// Most servers drop idle control connections after a few minutes
+#define FTP_KEEPALIVE_MS 30000
+#define FTP_REPLY_TIMEOUT_MS 5000
+// Shorter, a server that drops pipelined commands never answers them
+#define FTP_PIPELINE_TIMEOUT_MS 2000
+#define FTP_REPLY_BUF_LEN 512
+// A stalled data connection fails the upload instead of blocking forever
+#define FTP_DATA_TIMEOUT_MS 10000
+
+// One send() per lwIP send buffer, the stack can't take more at once anyway
+#ifdef CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#define FTP_DATA_CHUNK_DEFAULT CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#else
+#define FTP_DATA_CHUNK_DEFAULT 5744
+#endif
+
+// Reply classes accepted by ftp_expect()
+#define FTP_1XX (1 << 1)
+#define FTP_2XX (1 << 2)
+#define FTP_3XX (1 << 3)
+
 
 static const char *TAG = "ftp_lib";
 
 /*
  * During initiation, store sockaddr elements in this global
  * struct to omit executing getaddrinfo() for every transfer.
+ * ai_addr stays NULL until the server was reached once.
  */
 static struct __attribute__ ((packed)) conn_info {
 	int ai_family;
@@ -29,15 +62,52 @@ static struct __attribute__ ((packed)) conn_info {
 	socklen_t ai_addrlen;
 	struct sockaddr *ai_addr;
 	const char *ip;
+	const char *port;
 	const char *user;
 	const char *pass;
 } g_conn_info;
 
+// Control connection kept open between uploads when the session is enabled
+static struct ftp_session {
+	bool enabled;
+	int sockfd;  // -1 when not logged in
+	int64_t last_used_us;
+	SemaphoreHandle_t lock;  // held from ftp_upload_begin() to ftp_upload_end()
+	TaskHandle_t keepalive;
+} g_session;
+
+static struct ftp_pipeline {
+	bool enabled;
+	bool unsupported;  // the server failed a pipelined login
+} g_pipeline;
+
+static ftp_data_opts_t g_data_opts = {
+	.chunk = FTP_DATA_CHUNK_DEFAULT,
+	.sndbuf = 0,
+	.nodelay = true
+};
+
+/*
+ * Bytes received on the control connection but not consumed yet. There is
+ * only one control connection at a time, it's reset on every login.
+ */
+static struct reply_buffer {
+	size_t len;
+	char buf[FTP_REPLY_BUF_LEN];
+} g_reply;
+
+
+static esp_err_t ftp_resolve(void);
 
 static int ftp_connect()
 {
 	int ret, sockfd;
 
+	// The server wasn't up at boot, try again now
+	if (!g_conn_info.ai_addr && ftp_resolve() != ESP_OK) {
+		return -1;
+	}
+
 	sockfd = socket(g_conn_info.ai_family,
 		g_conn_info.ai_socktype,
 		g_conn_info.ai_protocol);
@@ -113,33 +183,166 @@ static esp_err_t ftp_send_command(int sockfd, const char *command, const char *a
 
 		return ESP_FAIL;
 	} else if (verbose) {
-		if (!strcmp(command, "PASS")) {
-			ESP_LOGI(TAG, "FTP< PASS %.*s", strlen(args),
+		if (!strcmp(command, "PASS") && args) {
+			ESP_LOGI(TAG, "FTP< PASS %.*s", (int)strlen(args),
 				 "********************************");
 		} else {
-			ESP_LOGI(TAG, "FTP< %.*s", strlen(buffer) - 2, buffer);
+			ESP_LOGI(TAG, "FTP< %.*s", (int)strlen(buffer) - 2, buffer);
 		}
 	}
 
 	return ESP_OK;
 }
 
-static void ftp_receive_response(int sockfd)
+/*
+ * Send several commands with a single send(), their replies come back in
+ * the same order.
+ */
+static esp_err_t ftp_send_batch(int sockfd, const char *const commands[][2], size_t count)
 {
-	ssize_t ret;
-	char buffer[256] = {0};
-
-	for (uint8_t i = 0; i < 50; ++i) {
-		ret = recv(sockfd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-		if (ret >= 0) {
-			ESP_LOGI(TAG, "FTP> %s", buffer);
-			return;
+	char buffer[256];
+	size_t len = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const char *command = commands[i][0], *args = commands[i][1];
+		int n = snprintf(buffer + len, sizeof(buffer) - len, args ? "%s %s\r\n" : "%s\r\n",
+			command, args);
+
+		if (n < 0 || (size_t)n >= sizeof(buffer) - len) {
+			ESP_LOGE(TAG, "Command batch doesn't fit");
+			return ESP_ERR_INVALID_SIZE;
+		}
+
+		if (!strcmp(command, "PASS") && args) {
+			ESP_LOGI(TAG, "FTP< PASS %.*s", (int)strlen(args),
+				 "********************************");
+		} else {
+			ESP_LOGI(TAG, "FTP< %.*s", n - 2, buffer + len);
 		}
+		len += n;
+	}
 
-		vTaskDelay(pdMS_TO_TICKS(100));
+	if (send(sockfd, buffer, len, 0) != (ssize_t)len) {
+		ESP_LOGE(TAG, "Failed to send commands");
+		return ESP_FAIL;
 	}
 
-	ESP_LOGW(TAG, "Resource temporarily unavailable");
+	return ESP_OK;
+}
+
+/*
+ * Wait for the complete reply to the oldest outstanding command and return
+ * its code (1xx-5xx), or -1 on timeout or a closed connection. Lines are
+ * CRLF terminated, a multi-line reply starts with "NNN-" and ends with the
+ * line starting with "NNN ". The last line's text goes to `text`.
+ */
+static int ftp_read_reply_within(int sockfd, uint32_t timeout_ms, char *text, size_t text_len)
+{
+	const int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+	int multiline_code = 0;
+
+	for (;;) {
+		char *eol;
+
+		// Consume every complete line that is already buffered
+		while ((eol = memchr(g_reply.buf, '\n', g_reply.len))) {
+			char *line = g_reply.buf;
+			size_t line_len = eol - line + 1;
+			int code = 0;
+
+			*eol = '\0';
+			if (eol > line && eol[-1] == '\r') {
+				eol[-1] = '\0';
+			}
+
+			ESP_LOGI(TAG, "FTP> %s", line);
+
+			if (isdigit((unsigned char)line[0]) && isdigit((unsigned char)line[1]) &&
+					isdigit((unsigned char)line[2])) {
+				code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + line[2] - '0';
+			}
+
+			bool last = false;
+			if (!multiline_code && code && line[3] == '-') {
+				multiline_code = code;
+			} else if (code && (!multiline_code || code == multiline_code) &&
+					line[3] != '-') {
+				last = true;
+			}
+
+			if (last && text) {
+				size_t n = strnlen(line, text_len - 1);
+
+				memcpy(text, line, n);
+				text[n] = '\0';
+			}
+
+			g_reply.len -= line_len;
+			memmove(g_reply.buf, g_reply.buf + line_len, g_reply.len);
+
+			if (last) {
+				return code;
+			}
+		}
+
+		// A line longer than the buffer isn't a reply line, drop it
+		if (g_reply.len == sizeof(g_reply.buf)) {
+			g_reply.len = 0;
+		}
+
+		const int64_t remaining_us = deadline - esp_timer_get_time();
+		if (remaining_us <= 0) {
+			ESP_LOGW(TAG, "No reply from the FTP server");
+			return -1;
+		}
+
+		struct timeval timeout = {
+			.tv_sec = remaining_us / 1000000,
+			.tv_usec = remaining_us % 1000000
+		};
+		fd_set readfds;
+
+		FD_ZERO(&readfds);
+		FD_SET(sockfd, &readfds);
+
+		int ret = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
+		if (ret < 0 && errno != EINTR) {
+			ESP_LOGE(TAG, "select() failed: %s", strerror(errno));
+			return -1;
+		} else if (ret <= 0) {
+			continue;
+		}
+
+		ssize_t received = recv(sockfd, g_reply.buf + g_reply.len,
+			sizeof(g_reply.buf) - g_reply.len, 0);
+		if (received <= 0) {
+			ESP_LOGW(TAG, "FTP server closed the connection");
+			return -1;
+		}
+		g_reply.len += received;
+	}
+}
+
+static int ftp_read_reply(int sockfd, char *text, size_t text_len)
+{
+	return ftp_read_reply_within(sockfd, FTP_REPLY_TIMEOUT_MS, text, text_len);
+}
+
+/*
+ * Read the reply and check its class: FTP_2XX etc. OR-ed together, e.g.
+ * USER may be answered by 331 (password needed) or 230 (logged in).
+ */
+static esp_err_t ftp_expect(int sockfd, uint8_t classes, char *text, size_t text_len)
+{
+	int code = ftp_read_reply(sockfd, text, text_len);
+
+	if (code < 0) {
+		return ESP_ERR_TIMEOUT;
+	} else if (!(classes & 1 << (code / 100))) {
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	return ESP_OK;
 }
 
 /*
@@ -150,33 +353,20 @@ static void ftp_receive_response(int sockfd)
  * while 'vsftpd' returns '0,0,0,0,p1,p2'. At least, that's the case when the
  * transfer IP remains the same as the control connection.
  */
-static esp_err_t get_transfer_addr(int sockfd, char *ip, char *port)
+static esp_err_t get_transfer_addr(const char *reply, char *ip, char *port)
 {
-	ssize_t ret;
-	char buffer[256] = {0};
-	// There could be multiple FTP outputs when connection is lagging
-	char *transfer_str = NULL;
-	uint8_t i = 0, commas_num = 0;
+	int ret = 0;
+	// The text before the address differs between servers
+	const char *transfer_str = strchr(reply, '(');
+	uint8_t i = 1, commas_num = 0;
 	uint8_t h1, h2, h3, h4, p1, p2;
 	char ipv6[5];
 
-	for (uint8_t i = 0; i < 50; ++i) {
-		ret = recv(sockfd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-		if (ret > 0) {
-			if ((transfer_str = strstr(buffer, "227 Entering Passive Mode ("))) {
-				ESP_LOGI(TAG, "FTP> %s", buffer);
-				break;
-			} else {
-				ESP_LOGE(TAG, "Didn't receive PASV IP/PORT");
-				return ESP_FAIL;
-			}
-		}
-
-		vTaskDelay(pdMS_TO_TICKS(100));
+	if (strncmp(reply, "227", 3) || !transfer_str) {
+		ESP_LOGE(TAG, "Didn't receive PASV IP/PORT");
+		return ESP_FAIL;
 	}
 
-	while (transfer_str[i++] != '(')
-		;
 	while (transfer_str[i] && transfer_str[i++] != ')') {
 		if (',' == transfer_str[i]) {
 			++commas_num;
@@ -185,12 +375,12 @@ static esp_err_t get_transfer_addr(int sockfd, char *ip, char *port)
 
 	if (5 == commas_num) {
 		ret = sscanf(transfer_str,
-			"227 Entering Passive Mode (%hhu,%hhu,%hhu,%hhu,%hhu,%hhu).",
+			"(%hhu,%hhu,%hhu,%hhu,%hhu,%hhu)",
 			&h1, &h2, &h3, &h4, &p1, &p2);
 
 	} else if (2 == commas_num) { // 'ProFTPD' IPv6 format: IPv6,p1,p2
 		ret = sscanf(transfer_str,
-			"227 Entering Passive Mode (%4[^,],%hhu,%hhu)",
+			"(%4[^,],%hhu,%hhu)",
 			ipv6, &p1, &p2);
 
 	}
@@ -228,16 +418,19 @@ static void close_ftp(int sockfd, bool verbose)
 	ftp_send_command(sockfd, "QUIT", NULL, verbose);
 
 	if (verbose) {
-		ftp_receive_response(sockfd);
+		ftp_read_reply(sockfd, NULL, 0);
 	}
 
 	close(sockfd);
 }
 
-esp_err_t init_ftp_client(const char *host, const char *port, const char *user, const char *pass)
+/*
+ * Looks the server up and checks it takes connections
+ */
+static esp_err_t ftp_resolve(void)
 {
 	struct addrinfo hints;
-	struct addrinfo *result;
+	struct addrinfo *result = NULL;
 	int sockfd;
 
 	memset(&hints, 0, sizeof(hints));
@@ -245,15 +438,13 @@ esp_err_t init_ftp_client(const char *host, const char *port, const char *user,
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	sockfd = getaddrinfo_tryconnect(&hints, &result, host, port);
+	sockfd = getaddrinfo_tryconnect(&hints, &result, g_conn_info.ip, g_conn_info.port);
 	if (-1 == sockfd) {
 		freeaddrinfo(result);
 		return ESP_FAIL;
 	}
 	close_ftp(sockfd, false);
 
-	memset(&g_conn_info, 0, sizeof(g_conn_info));
-
 	g_conn_info.ai_family = result->ai_family;
 	g_conn_info.ai_socktype = result->ai_socktype;
 	g_conn_info.ai_protocol = result->ai_protocol;
@@ -267,10 +458,6 @@ esp_err_t init_ftp_client(const char *host, const char *port, const char *user,
 	}
 	memmove(g_conn_info.ai_addr, result->ai_addr, result->ai_addrlen);
 
-	g_conn_info.ip = host;
-	g_conn_info.user = user;
-	g_conn_info.pass = pass;
-
 	freeaddrinfo(result);
 
 	ESP_LOGI(TAG, "FTP client initialized");
@@ -278,61 +465,475 @@ esp_err_t init_ftp_client(const char *host, const char *port, const char *user,
 	return ESP_OK;
 }
 
-esp_err_t ftp_upload_data(const char *data_path, const uint8_t *data, size_t size)
+/*
+ * Fails when the server can't be reached, the settings are kept anyway and
+ * the first upload tries again
+ */
+esp_err_t init_ftp_client(const char *host, const char *port, const char *user, const char *pass)
 {
-	int sockfd = ftp_connect();
-	if (-1 == sockfd) {
-		return ESP_ERR_NOT_FOUND;
+	g_conn_info.ip = host;
+	g_conn_info.port = port;
+	g_conn_info.user = user;
+	g_conn_info.pass = pass;
+
+	return ftp_resolve();
+}
+
+static esp_err_t reply_to_err(int code)
+{
+	return code < 0 ? ESP_ERR_TIMEOUT : ESP_ERR_INVALID_RESPONSE;
+}
+
+/*
+ * USER, PASS, TYPE I and PASV in one go. Returns ESP_ERR_NOT_SUPPORTED when
+ * the server doesn't keep up (replies missing or out of order), the caller
+ * then logs in again lock-step.
+ */
+static esp_err_t ftp_login_pipelined(int sockfd, char *pasv_reply, size_t pasv_len)
+{
+	const char *const commands[][2] = {
+		{"USER", g_conn_info.user},
+		{"PASS", g_conn_info.pass},
+		{"TYPE", "I"},
+		{"PASV", NULL}
+	};
+
+	ESP_ERROR_RETURN(ftp_send_batch(sockfd, commands, 4));
+
+	int user = ftp_read_reply_within(sockfd, FTP_PIPELINE_TIMEOUT_MS, NULL, 0);
+	if (user < 0) {
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	int pass = ftp_read_reply_within(sockfd, FTP_PIPELINE_TIMEOUT_MS, NULL, 0);
+
+	// 230 to USER means no password is needed, PASS then gets 503 or 2xx
+	if (user == 331 && pass / 100 == 2) {
+		;
+	} else if (user == 230 && (pass == 503 || pass / 100 == 2)) {
+		;
+	} else if (user / 100 == 5 || pass == 530) {
+		ESP_LOGE(TAG, "FTP login failed");
+		return ESP_ERR_INVALID_RESPONSE;
+	} else {
+		return ESP_ERR_NOT_SUPPORTED;
 	}
-	ftp_receive_response(sockfd);
 
+	int type = ftp_read_reply_within(sockfd, FTP_PIPELINE_TIMEOUT_MS, NULL, 0);
+	int pasv = ftp_read_reply_within(sockfd, FTP_PIPELINE_TIMEOUT_MS,
+		pasv_reply, pasv_len);
+
+	return type / 100 == 2 && pasv == 227 ? ESP_OK : ESP_ERR_NOT_SUPPORTED;
+}
+
+static esp_err_t ftp_login_lockstep(int sockfd)
+{
 	ESP_ERROR_RETURN(ftp_send_command(sockfd, "USER", g_conn_info.user, true));
-	ftp_receive_response(sockfd);
-	ESP_ERROR_RETURN(ftp_send_command(sockfd, "PASS", g_conn_info.pass, true));
-	ftp_receive_response(sockfd);
+
+	int code = ftp_read_reply(sockfd, NULL, 0);
+	if (code == 331) {
+		ESP_ERROR_RETURN(ftp_send_command(sockfd, "PASS", g_conn_info.pass, true));
+		code = ftp_read_reply(sockfd, NULL, 0);
+	}
+	if (code / 100 != 2) {
+		ESP_LOGE(TAG, "FTP login failed");
+		return reply_to_err(code);
+	}
 
 	ESP_ERROR_RETURN(ftp_send_command(sockfd, "TYPE", "I", true));
-	ftp_receive_response(sockfd);
 
-	ESP_ERROR_RETURN(ftp_send_command(sockfd, "PASV", NULL, true));
+	return ftp_expect(sockfd, FTP_2XX, NULL, 0);
+}
+
+/*
+ * Connect and log in. With pipelining PASV is sent along and its reply is
+ * stored in `pasv_reply`, `*pasv_done` tells whether that happened.
+ */
+static esp_err_t ftp_login(int *ptr_sockfd, char *pasv_reply, size_t pasv_len, bool *pasv_done)
+{
+	esp_err_t ret;
+	int code;
+
+	*pasv_done = false;
+
+	for (;;) {
+		int sockfd = ftp_connect();
+		if (-1 == sockfd) {
+			return ESP_ERR_NOT_FOUND;
+		}
+		g_reply.len = 0;
+
+		// A 120 "ready in n minutes" banner is followed by the real one
+		while ((code = ftp_read_reply(sockfd, NULL, 0)) / 100 == 1)
+			;
+
+		if (code != 220) {
+			ret = reply_to_err(code);
+
+		} else if (g_pipeline.enabled && !g_pipeline.unsupported) {
+			ret = ftp_login_pipelined(sockfd, pasv_reply, pasv_len);
+			*pasv_done = ret == ESP_OK;
+
+			if (ret == ESP_ERR_NOT_SUPPORTED) {
+				ESP_LOGW(TAG, "Server doesn't handle pipelined commands, "
+					"falling back to lock-step");
+				g_pipeline.unsupported = true;
+				close(sockfd);
+				continue;
+			}
+
+		} else {
+			ret = ftp_login_lockstep(sockfd);
+
+		}
+
+		if (ret == ESP_OK) {
+			*ptr_sockfd = sockfd;
+		} else {
+			close(sockfd);
+		}
+
+		return ret;
+	}
+}
+
+/*
+ * Failing options are only logged, lwIP is built without SO_SNDBUF unless
+ * CONFIG_LWIP_SO_SNDBUF is set and the transfer works without them.
+ */
+static void tune_data_socket(int data_sockfd)
+{
+	int nodelay = g_data_opts.nodelay;
+	struct timeval timeout = {
+		.tv_sec = FTP_DATA_TIMEOUT_MS / 1000,
+		.tv_usec = FTP_DATA_TIMEOUT_MS % 1000 * 1000
+	};
+
+	if (setsockopt(data_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay))) {
+		ESP_LOGW(TAG, "Failed to set TCP_NODELAY: %s", strerror(errno));
+	}
+
+	if (g_data_opts.sndbuf > 0 && setsockopt(data_sockfd, SOL_SOCKET, SO_SNDBUF,
+					       &g_data_opts.sndbuf, sizeof(g_data_opts.sndbuf))) {
+		ESP_LOGW(TAG, "Failed to set SO_SNDBUF: %s", strerror(errno));
+	}
+
+	if (setsockopt(data_sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+		ESP_LOGW(TAG, "Failed to set SO_SNDTIMEO: %s", strerror(errno));
+	}
+}
+
+static esp_err_t ftp_open_data(int sockfd, const char *pasv_reply, int *ptr_data_sockfd)
+{
+	char reply[128];
+
+	if (!pasv_reply) {
+		ESP_ERROR_RETURN(ftp_send_command(sockfd, "PASV", NULL, true));
+		ESP_ERROR_RETURN(ftp_expect(sockfd, FTP_2XX, reply, sizeof(reply)));
+		pasv_reply = reply;
+	}
+
 	char pasv_ip[IP_LEN] = {0};
 	char pasv_port[PORT_LEN] = {0};
-	ESP_ERROR_RETURN(get_transfer_addr(sockfd, pasv_ip, pasv_port));
+	ESP_ERROR_RETURN(get_transfer_addr(pasv_reply, pasv_ip, pasv_port));
 
 	struct addrinfo hints;
 	struct addrinfo *result;
-	int data_sockfd;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = g_conn_info.ai_family;
 	hints.ai_socktype = g_conn_info.ai_socktype;
 	hints.ai_protocol = g_conn_info.ai_protocol;
 
-	data_sockfd = getaddrinfo_tryconnect(&hints, &result, pasv_ip, pasv_port);
+	*ptr_data_sockfd = getaddrinfo_tryconnect(&hints, &result, pasv_ip, pasv_port);
 	freeaddrinfo(result);
-	if (-1 == data_sockfd) {
-		close_ftp(sockfd, true);
+
+	if (-1 == *ptr_data_sockfd) {
 		return ESP_FAIL;
 	}
 
-	if (ftp_send_command(sockfd, "STOR", data_path, true) != ESP_OK) {
-		close(data_sockfd);
-		close_ftp(sockfd, true);
-		return ESP_FAIL;
+	tune_data_socket(*ptr_data_sockfd);
+
+	return ESP_OK;
+}
+
+/*
+ * Pipelining is opt-in, some servers drop commands that arrive before the
+ * previous reply. Those are detected on the first login and from then on
+ * (until pipelining is enabled again) handled lock-step.
+ */
+void ftp_pipelining_enable(bool enable)
+{
+	g_pipeline.enabled = enable;
+	g_pipeline.unsupported = false;
+}
+
+/*
+ * Data connection options, applied from the next upload on. `sndbuf` 0
+ * keeps the stack's default.
+ */
+esp_err_t ftp_set_data_opts(const ftp_data_opts_t *opts)
+{
+	if (opts->chunk < FTP_DATA_CHUNK_MIN || opts->chunk > FTP_DATA_CHUNK_MAX ||
+	    opts->sndbuf < 0) {
+		return ESP_ERR_INVALID_ARG;
 	}
-	ftp_receive_response(sockfd);
 
-	if (send(data_sockfd, data, size, 0) == -1) {
-		ESP_LOGE(TAG, "Failed in sending data");
+	g_data_opts = *opts;
+
+	return ESP_OK;
+}
+
+void ftp_get_data_opts(ftp_data_opts_t *opts)
+{
+	*opts = g_data_opts;
+}
+
+/*
+ * A session connection the server has closed (idle timeout, restart) is
+ * readable: either EOF or an unsolicited reply such as "421 Timeout".
+ */
+static bool session_alive(int sockfd)
+{
+	char buffer[64];
+
+	if (g_reply.len) {
+		return false;
+	}
+
+	ssize_t ret = recv(sockfd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+
+	return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void session_close(void)
+{
+	if (g_session.sockfd != -1) {
+		close_ftp(g_session.sockfd, false);
+		g_session.sockfd = -1;
+	}
+}
+
+static void session_keepalive_task(void *arg)
+{
+	for (;;) {
+		vTaskDelay(pdMS_TO_TICKS(FTP_KEEPALIVE_MS));
+
+		xSemaphoreTake(g_session.lock, portMAX_DELAY);
+
+		if (g_session.sockfd != -1 &&
+				esp_timer_get_time() - g_session.last_used_us >=
+				FTP_KEEPALIVE_MS * 1000LL) {
+			if (!session_alive(g_session.sockfd) ||
+					ftp_send_command(g_session.sockfd, "NOOP", NULL, false) != ESP_OK ||
+					ftp_expect(g_session.sockfd, FTP_2XX, NULL, 0) != ESP_OK) {
+				ESP_LOGW(TAG, "Session dropped by the server");
+				close(g_session.sockfd);
+				g_session.sockfd = -1;
+			} else {
+				g_session.last_used_us = esp_timer_get_time();
+			}
+		}
+
+		xSemaphoreGive(g_session.lock);
+	}
+}
+
+/*
+ * Keep one logged in control connection across uploads, so an upload costs
+ * only PASV and STOR. It's (re)established on demand and kept alive with
+ * NOOP while idle.
+ */
+esp_err_t ftp_session_enable(bool enable)
+{
+	if (!g_session.lock) {
+		g_session.lock = xSemaphoreCreateMutex();
+		g_session.sockfd = -1;
+
+		if (!g_session.lock) {
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	xSemaphoreTake(g_session.lock, portMAX_DELAY);
+
+	if (enable && !g_session.keepalive &&
+			xTaskCreate(session_keepalive_task, "ftp_keepalive", 3072,
+				NULL, 1, &g_session.keepalive) != pdPASS) {
+		g_session.keepalive = NULL;
+		xSemaphoreGive(g_session.lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+	g_session.enabled = enable;
+	if (!enable) {
+		session_close();
+	}
+
+	xSemaphoreGive(g_session.lock);
+
+	return ESP_OK;
+}
+
+/*
+ * Log in (or reuse the session), open the data connection and start STOR.
+ * The file content is then written with ftp_upload_write() and the transfer
+ * finished by ftp_upload_end(), so callers can produce it while it is being
+ * sent.
+ */
+esp_err_t ftp_upload_begin(const char *data_path, ftp_stream_t *stream)
+{
+	esp_err_t ret = ESP_OK;
+	int sockfd = -1, data_sockfd = -1;
+
+	stream->sockfd = -1;
+	stream->data_sockfd = -1;
+	stream->sent = 0;
+	stream->elapsed_us = 0;
+	stream->session = g_session.lock && g_session.enabled;
+
+	if (stream->session) {
+		xSemaphoreTake(g_session.lock, portMAX_DELAY);
+
+		if (g_session.sockfd != -1 && !session_alive(g_session.sockfd)) {
+			ESP_LOGW(TAG, "Session dropped by the server, reconnecting");
+			close(g_session.sockfd);
+			g_session.sockfd = -1;
+		}
+		sockfd = g_session.sockfd;
+	}
+
+	// A reused session that still fails at PASV gets one fresh login
+	for (uint8_t attempt = 0; attempt < 2; ++attempt) {
+		char pasv_reply[128];
+		bool pasv_done = false;
+
+		if (-1 == sockfd) {
+			perf_start(PERF_FTP_LOGIN);
+			ret = ftp_login(&sockfd, pasv_reply, sizeof(pasv_reply), &pasv_done);
+			perf_stop(PERF_FTP_LOGIN);
+			if (ret != ESP_OK) {
+				break;
+			}
+			attempt = 1;
+		}
+
+		perf_start(PERF_FTP_PASV);
+		ret = ftp_open_data(sockfd, pasv_done ? pasv_reply : NULL, &data_sockfd);
+		perf_stop(PERF_FTP_PASV);
+		if (ret == ESP_OK || !stream->session) {
+			break;
+		}
+
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	if (ret != ESP_OK) {
+		goto fail;
+	}
+
+	perf_start(PERF_FTP_STOR);
+	ret = ftp_send_command(sockfd, "STOR", data_path, true);
+	if (ret == ESP_OK) {
+		ret = ftp_expect(sockfd, FTP_1XX, NULL, 0);
+	}
+	if (ret != ESP_OK) {
 		close(data_sockfd);
+		perf_stop(PERF_FTP_STOR);
+		goto fail;
+	}
+
+	stream->sockfd = sockfd;
+	stream->data_sockfd = data_sockfd;
+	stream->start_us = esp_timer_get_time();
+
+	return ESP_OK;
+
+fail:
+	if (sockfd != -1) {
 		close_ftp(sockfd, true);
-		return ESP_FAIL;
 	}
 
-	close(data_sockfd);
-	ftp_receive_response(sockfd);
+	if (stream->session) {
+		g_session.sockfd = -1;
+		xSemaphoreGive(g_session.lock);
+	}
+
+	return ret;
+}
 
-	close_ftp(sockfd, true);
+/*
+ * send() may take only a part of the buffer, the rest is sent in further
+ * rounds of at most `chunk` bytes.
+ */
+esp_err_t ftp_upload_write(ftp_stream_t *stream, const void *data, size_t size)
+{
+	const uint8_t *pos = data;
+
+	while (size) {
+		size_t len = size < g_data_opts.chunk ? size : g_data_opts.chunk;
+		ssize_t sent = send(stream->data_sockfd, pos, len, 0);
+
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			ESP_LOGE(TAG, "Failed in sending data: %s", strerror(errno));
+			return errno == EAGAIN || errno == EWOULDBLOCK ? ESP_ERR_TIMEOUT : ESP_FAIL;
+		}
+
+		pos += sent;
+		size -= sent;
+		stream->sent += sent;
+	}
 
 	return ESP_OK;
 }
+
+/*
+ * Closing the data connection marks the end of the file, when `complete` is
+ * false the server still gets a partial one.
+ */
+esp_err_t ftp_upload_end(ftp_stream_t *stream, bool complete)
+{
+	close(stream->data_sockfd);
+	esp_err_t ret = ftp_expect(stream->sockfd, FTP_2XX, NULL, 0);
+	perf_stop(PERF_FTP_STOR);
+
+	// Up to the server's confirmation, the data has really arrived then
+	stream->elapsed_us = esp_timer_get_time() - stream->start_us;
+
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Transfer not confirmed by the server");
+	}
+
+	if (stream->session) {
+		g_session.sockfd = stream->sockfd;
+		g_session.last_used_us = esp_timer_get_time();
+		xSemaphoreGive(g_session.lock);
+	} else {
+		close_ftp(stream->sockfd, true);
+	}
+
+	ESP_LOGI(TAG, "%zu bytes uploaded in %lld us", stream->sent, (long long)stream->elapsed_us);
+
+	stream->sockfd = -1;
+	stream->data_sockfd = -1;
+
+	return !complete ? ESP_FAIL : ret;
+}
+
+/*
+ * Whole buffer upload, `stream` receives the transfer statistics.
+ */
+esp_err_t ftp_upload_data(const char *data_path, const uint8_t *data, size_t size,
+			  ftp_stream_t *stream)
+{
+	ESP_ERROR_RETURN(ftp_upload_begin(data_path, stream));
+
+	esp_err_t ret = ftp_upload_write(stream, data, size);
+	esp_err_t end_ret = ftp_upload_end(stream, ret == ESP_OK);
+
+	return ret == ESP_OK ? end_ret : ret;
+}
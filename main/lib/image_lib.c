@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "image_lib.h"
+
+#ifdef ESP_PLATFORM
+#include <esp_cpu.h>
+#define cycle_count() esp_cpu_get_cycle_count()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycle_count() ((uint32_t)__rdtsc())
+#else
+#include <time.h>
+static uint32_t cycle_count(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+#endif
+
+#define BENCH_SIDE 240
+#define BENCH_RUNS 5
+
+/*
+ * SWAR lane masks: a 32-bit word is split into two 16-bit lanes holding the
+ * even and the odd bytes, so two sums can be accumulated with one add.
+ */
+#define EVEN_BYTES 0x00ff00ffu
+
+
+/*
+ * Luma (BT.601, 77/150/29 out of 256) is linear in R, G and B, and the 8-bit
+ * expansion of every channel depends on bits of only one RGB565 byte (G's
+ * two lowest expanded bits replicate its top bits, which are in the high
+ * byte). So luma splits exactly into a sum of two 256-entry tables indexed
+ * by the high and low byte, scaled by 256.
+ */
+static uint16_t g_luma_hi[256];
+static uint16_t g_luma_lo[256];
+static bool g_initialized = false;
+
+
+static inline uint32_t load32(const uint8_t *src)
+{
+	uint32_t word;
+
+	// Compiles to a single l32i when aligned, frame buffers always are
+	memcpy(&word, src, sizeof(word));
+
+	return word;
+}
+
+static inline uint8_t luma_pair(uint8_t hi, uint8_t lo)
+{
+	return (g_luma_hi[hi] + g_luma_lo[lo]) >> 8;
+}
+
+void img_init(void)
+{
+	if (g_initialized) {
+		return;
+	}
+
+	for (uint16_t b = 0; b < 256; ++b) {
+		uint8_t r5 = b >> 3, g_hi = b & 0x7;
+		uint8_t g_lo = b >> 5, b5 = b & 0x1f;
+
+		uint16_t r8 = r5 << 3 | r5 >> 2;
+		uint16_t b8 = b5 << 3 | b5 >> 2;
+
+		g_luma_hi[b] = 77 * r8 + 150 * (g_hi << 5 | g_hi >> 1);
+		g_luma_lo[b] = 150 * (g_lo << 2) + 29 * b8;
+	}
+
+	g_initialized = true;
+}
+
+/*
+ * Two pixels per 32-bit load; on a little-endian core the word holds
+ * hi0 lo0 hi1 lo1 from the least significant byte up. The two results are
+ * written with one 16-bit store.
+ */
+void img_rgb565_to_gray(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+	size_t i = 0;
+
+	img_init();
+
+	for (; i + 2 <= pixels; i += 2) {
+		const uint32_t w = load32(src + i * 2);
+		const uint16_t pair = luma_pair(w & 0xff, w >> 8 & 0xff) |
+			luma_pair(w >> 16 & 0xff, w >> 24) << 8;
+
+		memcpy(dst + i, &pair, sizeof(pair));
+	}
+
+	if (i < pixels) {
+		dst[i] = luma_pair(src[i * 2], src[i * 2 + 1]);
+	}
+}
+
+/*
+ * Box downscale to grayscale, fused with the conversion for RGB565 input:
+ * every factor x factor block becomes one averaged pixel. Only one converted
+ * input row and a row of column sums are kept, the output is
+ * (width / factor) x (height / factor).
+ */
+bool img_box_downscale(const uint8_t *src, uint16_t width, uint16_t height,
+		uint8_t factor, bool rgb565, uint8_t *dst)
+{
+	if (!factor) {
+		return false;
+	}
+
+	const uint16_t out_w = width / factor, out_h = height / factor;
+	const uint16_t used_w = out_w * factor;
+	const uint32_t area = factor * factor;
+
+	// Row state lives on the heap, callers run on small task stacks
+	uint8_t *row = malloc(width);
+	uint32_t *sums = malloc(out_w * sizeof(uint32_t));
+	if (!row || !sums) {
+		free(row);
+		free(sums);
+		return false;
+	}
+
+	for (uint16_t oy = 0; oy < out_h; ++oy) {
+		memset(sums, 0, out_w * sizeof(uint32_t));
+
+		for (uint16_t y = oy * factor; y < (oy + 1) * factor; ++y) {
+			const uint8_t *gray = src + (size_t)y * width;
+
+			if (rgb565) {
+				img_rgb565_to_gray(src + (size_t)y * width * 2, row, used_w);
+				gray = row;
+			}
+
+			for (uint16_t ox = 0, x = 0; ox < out_w; ++ox) {
+				uint32_t sum = 0;
+
+				for (uint8_t i = 0; i < factor; ++i) {
+					sum += gray[x++];
+				}
+				sums[ox] += sum;
+			}
+		}
+
+		for (uint16_t ox = 0; ox < out_w; ++ox) {
+			*dst++ = (sums[ox] + area / 2) / area;
+		}
+	}
+
+	free(row);
+	free(sums);
+
+	return true;
+}
+
+/*
+ * 2x2 box downscale. Each 32-bit load covers four pixels of a row; the even
+ * and odd bytes of the two rows are added in two 16-bit lanes at once, which
+ * gives both 2x2 sums of the word without unpacking single bytes.
+ */
+void img_downscale2_gray(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst)
+{
+	const uint16_t out_w = width / 2;
+
+	for (uint16_t y = 0; y + 1 < height; y += 2) {
+		const uint8_t *top = src + (size_t)y * width;
+		const uint8_t *bottom = top + width;
+		uint16_t x = 0;
+
+		for (; x + 4 <= out_w * 2; x += 4) {
+			const uint32_t t = load32(top + x), b = load32(bottom + x);
+			const uint32_t sums = (t & EVEN_BYTES) + (t >> 8 & EVEN_BYTES) +
+				(b & EVEN_BYTES) + (b >> 8 & EVEN_BYTES) + 0x00020002u;
+			const uint16_t pair = (sums >> 2 & 0xff) | (sums >> 18 & 0xff) << 8;
+
+			memcpy(dst + x / 2, &pair, sizeof(pair));
+		}
+
+		for (; x < out_w * 2; x += 2) {
+			dst[x / 2] = (top[x] + top[x + 1] + bottom[x] + bottom[x + 1] + 2) >> 2;
+		}
+
+		dst += out_w;
+	}
+}
+
+/*
+ * Separable [1 2 1] x [1 2 1] / 16 blur with replicated borders. Horizontal
+ * sums of three consecutive rows are kept in a ring, each input row is
+ * read exactly once.
+ */
+bool img_blur3x3(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst)
+{
+	if (width < 2) {
+		return false;
+	}
+
+	uint16_t *rows = malloc(3 * width * sizeof(uint16_t));
+	if (!rows) {
+		return false;
+	}
+	uint16_t *ring[3] = {rows, rows + width, rows + 2 * width};
+
+	for (int32_t y = -1; y <= height; ++y) {
+		const int32_t sy = y < 0 ? 0 : (y >= height ? height - 1 : y);
+		const uint8_t *row = src + (size_t)sy * width;
+		uint16_t *h = ring[(y + 3) % 3];
+
+		h[0] = 3 * row[0] + row[1];
+		for (uint16_t x = 1; x + 1 < width; ++x) {
+			h[x] = row[x - 1] + 2 * row[x] + row[x + 1];
+		}
+		h[width - 1] = row[width - 2] + 3 * row[width - 1];
+
+		if (y < 1) {
+			continue;
+		}
+
+		const uint16_t *above = ring[(y + 1) % 3];
+		const uint16_t *center = ring[(y + 2) % 3];
+		uint8_t *out = dst + (size_t)(y - 1) * width;
+
+		for (uint16_t x = 0; x < width; ++x) {
+			out[x] = (above[x] + 2 * center[x] + h[x] + 8) >> 4;
+		}
+	}
+
+	free(rows);
+
+	return true;
+}
+
+// Gradient magnitude |gx| + |gy| (saturated), border pixels are 0
+void img_sobel(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst)
+{
+	memset(dst, 0, width);
+	memset(dst + (size_t)(height - 1) * width, 0, width);
+
+	for (uint16_t y = 1; y + 1 < height; ++y) {
+		const uint8_t *a = src + (size_t)(y - 1) * width;
+		const uint8_t *b = a + width;
+		const uint8_t *c = b + width;
+		uint8_t *out = dst + (size_t)y * width;
+
+		out[0] = 0;
+		for (uint16_t x = 1; x + 1 < width; ++x) {
+			int gx = (a[x + 1] + 2 * b[x + 1] + c[x + 1]) -
+				(a[x - 1] + 2 * b[x - 1] + c[x - 1]);
+			int gy = (c[x - 1] + 2 * c[x] + c[x + 1]) -
+				(a[x - 1] + 2 * a[x] + a[x + 1]);
+			int mag = abs(gx) + abs(gy);
+
+			out[x] = mag > 255 ? 255 : mag;
+		}
+		out[width - 1] = 0;
+	}
+}
+
+/*
+ * Four bytes per load, counted into four interleaved sub-histograms so that
+ * consecutive increments of equal values don't wait on each other's store.
+ */
+void img_histogram(const uint8_t *src, size_t pixels, uint32_t hist[256])
+{
+	uint32_t (*sub)[256] = calloc(4, sizeof(*sub));
+	size_t i = 0;
+
+	if (!sub) {
+		memset(hist, 0, 256 * sizeof(uint32_t));
+		for (; i < pixels; ++i) {
+			++hist[src[i]];
+		}
+		return;
+	}
+
+	for (; i + 4 <= pixels; i += 4) {
+		const uint32_t w = load32(src + i);
+
+		++sub[0][w & 0xff];
+		++sub[1][w >> 8 & 0xff];
+		++sub[2][w >> 16 & 0xff];
+		++sub[3][w >> 24];
+	}
+	for (; i < pixels; ++i) {
+		++sub[0][src[i]];
+	}
+
+	for (uint16_t v = 0; v < 256; ++v) {
+		hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+	}
+
+	free(sub);
+}
+
+/*
+ * Runs every kernel on a synthetic 240x240 frame (the configured camera
+ * frame size) and reports the best of BENCH_RUNS in CPU cycles per input
+ * pixel. On Linux x86 the TSC is used, elsewhere nanoseconds stand in.
+ */
+size_t img_benchmark(img_bench_result_t *results, size_t max_results)
+{
+	const size_t pixels = BENCH_SIDE * BENCH_SIDE;
+	size_t n = 0;
+
+	uint8_t *rgb = malloc(pixels * 2);
+	uint8_t *gray = malloc(pixels);
+	uint8_t *out = malloc(pixels);
+	uint32_t *hist = malloc(256 * sizeof(uint32_t));
+
+	if (!rgb || !gray || !out || !hist) {
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < pixels * 2; ++i) {
+		rgb[i] = (uint8_t)(i * 2654435761u >> 13);
+	}
+	img_init();
+	img_rgb565_to_gray(rgb, gray, pixels);
+
+	for (uint8_t kernel = 0; kernel < 6 && n < max_results; ++kernel) {
+		uint32_t best = UINT32_MAX;
+
+		for (uint8_t run = 0; run < BENCH_RUNS; ++run) {
+			uint32_t start = cycle_count();
+
+			switch (kernel) {
+			case 0:
+				img_rgb565_to_gray(rgb, out, pixels);
+				break;
+			case 1:
+				img_box_downscale(rgb, BENCH_SIDE, BENCH_SIDE, 8, true, out);
+				break;
+			case 2:
+				img_downscale2_gray(gray, BENCH_SIDE, BENCH_SIDE, out);
+				break;
+			case 3:
+				img_blur3x3(gray, BENCH_SIDE, BENCH_SIDE, out);
+				break;
+			case 4:
+				img_sobel(gray, BENCH_SIDE, BENCH_SIDE, out);
+				break;
+			case 5:
+				img_histogram(gray, pixels, hist);
+				break;
+			}
+
+			uint32_t cycles = cycle_count() - start;
+			if (cycles < best) {
+				best = cycles;
+			}
+		}
+
+		static const char *names[] = {
+			"rgb565_to_gray", "box_downscale8", "downscale2_gray",
+			"blur3x3", "sobel", "histogram"
+		};
+
+		results[n].name = names[kernel];
+		results[n].cycles_per_pixel = (float)best / pixels;
+		++n;
+	}
+
+cleanup:
+	free(rgb);
+	free(gray);
+	free(out);
+	free(hist);
+
+	return n;
+}
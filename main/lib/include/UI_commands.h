@@ -1,10 +1,31 @@
 #pragma once
 #include <esp_camera.h>
+#include "upload_lib.h"
 
 void shoot(camera_fb_t **ptr_picture);
 void save(camera_fb_t *picture, const char *filename);
+void upload_done(const upload_result_t *result);
+void uploads(void);
+void format(char *arg);
+void jpeg_quality(char *arg);
+void stream(char *arg);
+void stream_fps(char *arg);
+void stream_scale(char *arg);
 void flash(char *arg);
 void flash_intensity(char *arg);
 void rotate(char *arg);
-void fetch(camera_fb_t *orig_picture);
+void servo_pulse(char *arg);
+void fetch(camera_fb_t *orig_picture, char *arg);
+void calibrate(char *arg);
 void adjust_img_properties(char *setting, char *arg);
+void ftp_session(char *arg);
+void ftp_pipeline(char *arg);
+void ftp_data(char *setting, char *arg);
+void transport(char *arg);
+void mqtt_upload(char *setting, char *arg);
+void perf(char *arg);
+void metrics(char *arg);
+void status(void);
+void rejected(const char *command, const char *reason);
+void cancel(void);
+void benchmark(void);
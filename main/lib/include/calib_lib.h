@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include "descriptor_lib.h"
+
+/*
+ * Calibration index: the shape signature seen at every `step` degrees of the
+ * servo range, persisted in NVS. The index remembers the descriptor version
+ * and camera configuration it was recorded with and is reported as stale
+ * when either differs.
+ *
+ * calib_lookup() returns ESP_ERR_NVS_NOT_FOUND when nothing was recorded yet,
+ * ESP_ERR_INVALID_CRC for a damaged index and ESP_ERR_INVALID_STATE for a
+ * stale one.
+ */
+#define CALIB_MIN_STEP 5
+#define CALIB_MAX_STEP 45
+#define CALIB_DEFAULT_STEP 10
+
+typedef struct {
+	uint8_t step;
+	uint8_t count;
+	size_t bytes;
+} calib_info_t;
+
+esp_err_t calib_begin(uint8_t step, uint32_t config_id);
+esp_err_t calib_add(int16_t angle, const shape_sig_t *sig);
+esp_err_t calib_commit(calib_info_t *info);
+void calib_abort(void);
+esp_err_t calib_lookup(uint32_t config_id, const shape_sig_t *sig,
+		float *angle, float *distance);
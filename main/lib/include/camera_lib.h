@@ -4,9 +4,23 @@
 #include <stdbool.h>
 #include <esp_camera.h>
 
+/*
+ * The shot `fetch` compares against keeps one, the pipelined sweep uses two.
+ * The driver allocates them once at init, so the third (115 KB of PSRAM at
+ * 240x240 RGB565) stays allocated in every mode: it is the price of
+ * `fetch pipe`, switching the count per mode would mean re-initialising the
+ * camera.
+ */
+#define CAMERA_FB_COUNT 3
+
 esp_err_t init_camera(void);
 esp_err_t set_flash_intensity(int intensity);
 void turn_on_flash(bool flash_on);
 camera_fb_t *take_picture();
 void free_picture(camera_fb_t **ptr_picture);
 esp_err_t set_cam_sensor(char *setting, int value);
+uint32_t get_camera_config_id(void);
+void camera_lock(void);
+void camera_unlock(void);
+camera_fb_t *take_preview(void);
+void free_preview(camera_fb_t *picture);
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+/*
+ * Commands leave the MQTT task right away and run on one of two workers:
+ *   CMD_CONTROL  queries and the settings no capture depends on, higher
+ *                priority, never waits on a job
+ *   CMD_JOB      camera and servo work (shoot, fetch, calibrate...) and the
+ *                settings it's done with (flash, sensor, save format), one at
+ *                a time in arrival order
+ * command_submit() copies the payload and returns ESP_ERR_TIMEOUT when the
+ * queue is full or ESP_ERR_INVALID_SIZE when the payload doesn't fit. Long
+ * jobs poll command_cancelled() and stop early after command_cancel() or
+ * once the limit set by command_set_timeout() has passed.
+ */
+#define CMD_PAYLOAD_LEN 256
+#define CMD_CONTROL_QUEUE_LEN 8
+#define CMD_JOB_QUEUE_LEN 4
+
+typedef enum {
+	CMD_CONTROL,
+	CMD_JOB,
+	CMD_QUEUES
+} cmd_queue_t;
+
+typedef struct {
+	uint8_t waiting;
+	char running[16];     // empty when idle
+	int64_t running_us;   // how long the running command has been running
+	uint32_t done;
+	int64_t last_wait_us; // queued before it ran
+	int64_t last_exec_us;
+	int64_t max_wait_us;
+} cmd_stats_t;
+
+// `payload` is the worker's own copy, it may be modified (strtok)
+typedef void (*cmd_exec_t)(char *payload, int64_t wait_us);
+
+esp_err_t command_init(cmd_exec_t exec);
+esp_err_t command_submit(cmd_queue_t queue, const char *payload);
+uint8_t command_flush(cmd_queue_t queue);
+void command_get_stats(cmd_queue_t queue, cmd_stats_t *stats);
+bool command_cancel(uint8_t *dropped);
+void command_set_timeout(uint32_t timeout_ms);
+bool command_cancelled(void);
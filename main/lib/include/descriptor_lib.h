@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Compact shape descriptor of the dominant object in a frame. The frame is
+ * reduced to a DESC_WORK_SIDE grayscale proxy, blurred and binarized with
+ * Otsu's threshold; everything below is derived from that binary image and
+ * fits in a few hundred bytes, so comparing two frames is cheap once both
+ * descriptors exist.
+ */
+#define DESC_WORK_SIDE 60
+#define DESC_MASK_SIDE 30
+#define DESC_CONTOUR_POINTS 48
+#define DESC_RADIAL_BINS 64
+#define DESC_HU_MOMENTS 7
+// Bump whenever the algorithm changes, stored descriptors become incomparable
+#define DESC_VERSION 1
+
+// Orientation sensitive part, also what the calibration index stores per angle
+typedef struct {
+	uint32_t mask[DESC_MASK_SIDE];  // one row per word, bit x = column x
+	uint8_t radial[DESC_RADIAL_BINS];  // boundary distance per angle, max = 255
+} shape_sig_t;
+
+typedef struct {
+	shape_sig_t sig;
+	uint8_t contour[DESC_CONTOUR_POINTS][2];  // (x, y) in work proxy pixels
+	uint8_t contour_len;
+	float hu[DESC_HU_MOMENTS];
+	uint16_t area;  // object pixels in the work proxy
+	uint8_t cx;
+	uint8_t cy;
+	uint8_t threshold;
+	bool dark_object;
+} shape_desc_t;
+
+bool desc_compute(const uint8_t *pixels, uint16_t width, uint16_t height,
+		bool rgb565, shape_desc_t *desc);
+float desc_sig_distance(const shape_sig_t *a, const shape_sig_t *b);
+float desc_distance(const shape_desc_t *a, const shape_desc_t *b);
+float desc_hu_distance(const shape_desc_t *a, const shape_desc_t *b);
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <esp_camera.h>
+
+/*
+ * Streaming image encoders. Instead of building the whole file in memory they
+ * hand it to `sink` piece by piece from a buffer of at most ENC_CHUNK_SIZE
+ * bytes (or one row, if that's larger), so the next piece is being encoded
+ * while the previous one is still on the wire.
+ */
+#define ENC_CHUNK_SIZE 4096
+
+/*
+ * BMP is what frame2bmp() makes, JPEG goes through the camera driver's
+ * encoder at the given quality (1-100) and QOI (qoiformat.org) is lossless
+ * at roughly half the BMP size for camera frames.
+ */
+typedef enum {
+	ENC_BMP,
+	ENC_JPEG,
+	ENC_QOI,
+	ENC_FORMATS
+} enc_format_t;
+
+#define ENC_DEFAULT_QUALITY 80
+
+typedef esp_err_t (*enc_sink_t)(void *ctx, const void *data, size_t len);
+
+const char *enc_format_ext(enc_format_t format);
+bool enc_format_from_name(const char *name, enc_format_t *format);
+size_t enc_bmp_size(const camera_fb_t *frame);
+esp_err_t enc_bmp_stream(const camera_fb_t *frame, enc_sink_t sink, void *ctx);
+esp_err_t enc_qoi_stream(const camera_fb_t *frame, enc_sink_t sink, void *ctx);
+esp_err_t enc_jpeg_stream(const camera_fb_t *frame, uint8_t quality,
+		enc_sink_t sink, void *ctx);
+esp_err_t enc_stream(const camera_fb_t *frame, enc_format_t format, uint8_t quality,
+		enc_sink_t sink, void *ctx);
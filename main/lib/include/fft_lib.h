@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * In-place radix-2 complex FFT on split real/imaginary float arrays. Plain C
+ * without ESP-IDF dependencies, so it builds for the ESP32 and for Linux.
+ */
+#define FFT_MAX_POINTS 256
+
+void fft_init(void);
+bool fft_radix2(float *re, float *im, uint16_t n, bool inverse);
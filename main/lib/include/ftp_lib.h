@@ -1,6 +1,34 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <esp_err.h>
 
+#define FTP_DATA_CHUNK_MIN 512
+#define FTP_DATA_CHUNK_MAX 65536
+
+typedef struct {
+	int sockfd;
+	int data_sockfd;
+	size_t sent;
+	int64_t start_us;
+	int64_t elapsed_us;  // set by ftp_upload_end()
+	bool session;  // control connection belongs to the session
+} ftp_stream_t;
+
+typedef struct {
+	size_t chunk;  // largest single send()
+	int sndbuf;    // SO_SNDBUF, 0 for the default
+	bool nodelay;  // TCP_NODELAY
+} ftp_data_opts_t;
+
 esp_err_t init_ftp_client(const char *host, const char *port, const char *user, const char *pass);
-esp_err_t ftp_upload_data(const char *data_path, const uint8_t *data, size_t size);
+esp_err_t ftp_upload_data(const char *data_path, const uint8_t *data, size_t size,
+			  ftp_stream_t *stream);
+esp_err_t ftp_session_enable(bool enable);
+void ftp_pipelining_enable(bool enable);
+esp_err_t ftp_set_data_opts(const ftp_data_opts_t *opts);
+void ftp_get_data_opts(ftp_data_opts_t *opts);
+esp_err_t ftp_upload_begin(const char *data_path, ftp_stream_t *stream);
+esp_err_t ftp_upload_write(ftp_stream_t *stream, const void *data, size_t size);
+esp_err_t ftp_upload_end(ftp_stream_t *stream, bool complete);
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Integer image kernels for the camera frames. Input RGB565 is in the byte
+ * order esp32-camera produces (big-endian), grayscale is one byte per pixel.
+ * All kernels stream rows top to bottom and keep at most a few rows of state,
+ * so they work the same on PSRAM frame buffers and on the host.
+ */
+typedef struct {
+	const char *name;
+	float cycles_per_pixel;
+} img_bench_result_t;
+
+void img_init(void);
+void img_rgb565_to_gray(const uint8_t *src, uint8_t *dst, size_t pixels);
+bool img_box_downscale(const uint8_t *src, uint16_t width, uint16_t height,
+		uint8_t factor, bool rgb565, uint8_t *dst);
+void img_downscale2_gray(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst);
+bool img_blur3x3(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst);
+void img_sobel(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst);
+void img_histogram(const uint8_t *src, size_t pixels, uint32_t hist[256]);
+size_t img_benchmark(img_bench_result_t *results, size_t max_results);
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "perf_lib.h"
+
+/*
+ * Telemetry on ESP32/shape_detector/<device>/metrics, one JSON object every period:
+ *   {"uptime_s":..,"heap":[free,min],"psram":[free,min],"cpu":{task:%,..},
+ *    "bounds_ms":[..],"cmd":{name:{"n":..,"sum_ms":..,"max_ms":..,"h":[..]}},
+ *    "phase":{name:{..}}}
+ * cpu is each task's share since the previous report (100 = one core), the
+ * histograms count since boot: "h" has one bucket per bound (latency up to
+ * it) and a last one for anything longer. Phase histograms take the time a
+ * command (or upload) spent in the phase, as perf_lib measures it.
+ *
+ * Off by default; while off, the perf_lib hooks return right away and no
+ * task runs.
+ */
+#define METRICS_MAX_PERIOD_S 3600
+
+esp_err_t metrics_start(uint16_t period_s);
+void metrics_stop(void);
+uint16_t metrics_period(void);
+void metrics_observe_command(const char *command, int64_t us);
+void metrics_observe_phase(perf_phase_t phase, int64_t us);
@@ -1,6 +1,58 @@
 #pragma once
 #include <esp_err.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-esp_err_t start_mqtt_client(const char *URI, void (*mqtt_data_handler)(char *));
+// Correlation IDs, the leading '#' included
+#define MQTT_REPLY_ID_LEN 16
+
+// Device IDs name the topics, ESP32/shape_detector/<device ID>/input...
+#define MQTT_DEVICE_ID_LEN 32
+// ESP32/shape_detector/all/input reaches every device
+#define MQTT_BROADCAST_ID "all"
+
+/*
+ * Files sent over MQTT instead of FTP: binary chunks straight from the
+ * caller's buffer on ESP32/shape_detector/<device>/image/<id>/<seq> (seq from 0),
+ * between JSON on .../begin {"path":..,"chunk":..,"qos":..} and .../end
+ * {"chunks":..,"bytes":..,"complete":..,"enqueue_retries":..,"elapsed_us":..}.
+ * Every mqtt_upload_write() is cut into chunks of at most `chunk` bytes; a
+ * chunk the client fails to queue is tried again up to MQTT_CHUNK_RETRIES
+ * times. tools/mqtt_receiver.py puts the files back together.
+ */
+#define MQTT_CHUNK_MIN 256
+#define MQTT_CHUNK_MAX 16384
+#define MQTT_CHUNK_DEFAULT 4096
+#define MQTT_CHUNK_RETRIES 3
+
+typedef struct {
+	size_t chunk;
+	uint8_t qos;  // 0 or 1
+} mqtt_upload_opts_t;
+
+typedef struct {
+	uint32_t id;
+	mqtt_upload_opts_t opts;  // taken at mqtt_upload_begin()
+	uint32_t chunks;
+	uint32_t enqueue_retries;
+	size_t sent;
+	int64_t start_us;
+	int64_t elapsed_us;  // set by mqtt_upload_end()
+} mqtt_stream_t;
+
+esp_err_t start_mqtt_client(const char *URI, const char *device_id,
+			void (*mqtt_data_handler)(char *));
+const char *mqtt_device_id(void);
 esp_err_t mqtt_publish(const char *format, ...);
+esp_err_t mqtt_publish_to(const char *subtopic, const char *format, ...);
+esp_err_t mqtt_publish_raw(const char *subtopic, const void *data, size_t len);
+esp_err_t mqtt_reply_begin(const char *id, bool collect);
+esp_err_t mqtt_reply_end(void);
+const char *mqtt_reply_id(void);
+esp_err_t mqtt_set_upload_opts(const mqtt_upload_opts_t *opts);
+void mqtt_get_upload_opts(mqtt_upload_opts_t *opts);
+esp_err_t mqtt_upload_begin(const char *path, mqtt_stream_t *stream);
+esp_err_t mqtt_upload_write(mqtt_stream_t *stream, const void *data, size_t size);
+esp_err_t mqtt_upload_end(mqtt_stream_t *stream, bool complete);
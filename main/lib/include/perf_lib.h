@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Per-command phase timing. The command workers bracket every command with
+ * perf_begin()/perf_end(), the modules mark the phases they run. When enabled
+ * (`perf on`) perf_end() publishes one JSON object per command on the perf
+ * topic, e.g. {"cmd":"save","total_us":41230,"wait_us":12,"capture_us":0,...}.
+ */
+typedef enum {
+	PERF_SERVO,
+	PERF_CAPTURE,
+	PERF_ENCODE,
+	PERF_FTP_LOGIN,
+	PERF_FTP_PASV,
+	PERF_FTP_STOR,
+	PERF_PUBLISH,
+	PERF_PHASES
+} perf_phase_t;
+
+const char *perf_phase_name(perf_phase_t phase);
+void perf_enable(bool enable);
+void perf_begin(const char *command, int64_t wait_us);
+void perf_share(TaskHandle_t task);
+void perf_start(perf_phase_t phase);
+void perf_stop(perf_phase_t phase);
+void perf_end(void);
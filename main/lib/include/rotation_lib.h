@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Rotation estimation by log-polar phase correlation. The image is resampled
+ * on ROT_RINGS logarithmically spaced circles around its centre, each ring is
+ * transformed over the angle axis and the normalized cross-power spectrum
+ * summed over all rings gives a correlation peak at the rotation offset.
+ * Plain C without ESP-IDF dependencies, like fft_lib.
+ */
+#define ROT_RINGS 24
+#define ROT_ANGLES 256
+#define ROT_BINS (ROT_ANGLES / 2)
+
+// Per-ring angular spectrum without the DC bin, which only carries brightness
+typedef struct {
+	float re[ROT_RINGS][ROT_BINS];
+	float im[ROT_RINGS][ROT_BINS];
+} rot_spectrum_t;
+
+bool rot_spectrum(const uint8_t *gray, uint16_t width, uint16_t height,
+		rot_spectrum_t *spectrum);
+float rot_estimate(const rot_spectrum_t *reference, const rot_spectrum_t *live,
+		float *confidence);
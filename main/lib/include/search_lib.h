@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_camera.h>
+#include "calib_lib.h"
+
+typedef struct {
+	float angle;  // sweeps find whole degrees, phase and index tenths
+	float score;
+	float rotation;
+	float confidence;
+	uint16_t captures;
+	int64_t elapsed_us;
+	int64_t capture_stall_us;  // pipelined sweep only
+	int64_t score_stall_us;
+} search_result_t;
+
+esp_err_t search_set_reference(const camera_fb_t *reference);
+void search_clear_reference(void);
+esp_err_t search_angle_sweep(const camera_fb_t *reference, search_result_t *result);
+esp_err_t search_angle_pipelined(const camera_fb_t *reference, search_result_t *result);
+esp_err_t search_angle_phase(const camera_fb_t *reference, search_result_t *result);
+esp_err_t search_angle_index(const camera_fb_t *reference, search_result_t *result);
+esp_err_t search_calibrate(uint8_t step, search_result_t *result, calib_info_t *info);
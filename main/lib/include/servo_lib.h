@@ -3,5 +3,37 @@
 #include <stdbool.h>
 #include <esp_err.h>
 
+/*
+ * The servo task runs the moves: set_servo_angle() only hands it the target,
+ * servo_wait() returns once the shaft is still there (acceleration-limited
+ * profile plus a settle time that grows with the distance, see
+ * servo_move_ms()). Captures wait for it instead of sleeping a worst case.
+ *
+ * Angles are kept in tenths of a degree (ddeg), about one duty step of the
+ * 14-bit timer; the whole degree calls round to and from them. The pulse
+ * widths at 0 and 180° differ per unit, servo_set_pulse_range() stores
+ * measured ones in NVS and init_servo() (after nvs_flash_init()) loads them.
+ */
+// Longer than any move
+#define SERVO_WAIT_MS 2000
+
+#define SERVO_DDEG_PER_DEG 10
+#define SERVO_MAX_DDEG (180 * SERVO_DDEG_PER_DEG)
+
+#define SERVO_DEFAULT_MIN_PULSE_US 500
+#define SERVO_DEFAULT_MAX_PULSE_US 2500
+// Accepted by servo_set_pulse_range()
+#define SERVO_PULSE_LIMIT_MIN_US 300
+#define SERVO_PULSE_LIMIT_MAX_US 2700
+#define SERVO_PULSE_MIN_SPAN_US 1000
+
 esp_err_t init_servo(void);
 esp_err_t set_servo_angle(int16_t angle, bool relative);
+esp_err_t set_servo_angle_ddeg(int16_t ddeg, bool relative);
+int16_t get_servo_angle(void);
+int16_t get_servo_angle_ddeg(void);
+esp_err_t servo_wait(uint32_t timeout_ms);
+uint32_t servo_still_in_ms(void);
+uint32_t servo_move_ms(int16_t from_ddeg, int16_t to_ddeg);
+esp_err_t servo_set_pulse_range(uint16_t min_us, uint16_t max_us);
+void servo_get_pulse_range(uint16_t *min_us, uint16_t *max_us);
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+/*
+ * Live preview over HTTP for aiming and debugging, one client at a time:
+ *   GET /     MJPEG (multipart/x-mixed-replace), opens in a browser
+ *   GET /raw  the frames as they are (RGB565 big-endian), one multipart part
+ *             each with X-Width, X-Height and X-Format headers
+ * Frames are sent from the camera's buffer as they are, only the ones
+ * encoded or scaled down are written anew and the camera's handed back
+ * before sending. The stream pauses while a command uses the camera, skips
+ * frames the client can't take yet and drops a client that can't take one
+ * within a second, so a command waits that long at most.
+ * `scale` 2 or 4 sends every 2nd or 4th pixel and row.
+ */
+#define STREAM_DEFAULT_PORT 8080
+#define STREAM_DEFAULT_FPS 10
+#define STREAM_MAX_FPS 30
+#define STREAM_JPEG_QUALITY 60
+
+typedef struct {
+	bool running;
+	bool client;
+	uint8_t fps;
+	uint8_t scale;
+	uint32_t frames;
+	uint32_t dropped;  // client busy or camera in use
+	uint64_t bytes;
+} stream_stats_t;
+
+esp_err_t stream_start(uint16_t port);
+esp_err_t stream_stop(void);
+esp_err_t stream_set_fps(uint8_t fps);
+esp_err_t stream_set_scale(uint8_t scale);
+void stream_get_stats(stream_stats_t *stats);
@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <esp_camera.h>
+#include "encode_lib.h"
+
+/*
+ * Background uploads. upload_enqueue() copies the picture, so the caller
+ * keeps its frame buffer, and returns right away; a single task sends the
+ * queued pictures in order, retrying with exponential backoff while the
+ * server is unreachable, and reports every finished upload to the callback
+ * given to upload_init(), along with the `tag` the picture was queued with
+ * (the request's correlation ID, NULL for none).
+ *
+ * Pictures go to the FTP server or, with UPLOAD_MQTT, as chunks to the
+ * broker (see mqtt_upload_begin()); the transport is picked when the
+ * picture is queued.
+ *
+ * Pictures are encoded on the way out in the format picked by the file
+ * name's extension (bmp, jpg/jpeg, qoi). Names without one get the format
+ * set by upload_set_encoding() and its extension appended. Frames the camera
+ * already delivers as JPEG are sent as they are.
+ *
+ * upload_enqueue() returns ESP_ERR_NOT_SUPPORTED for formats that can't be
+ * saved, ESP_ERR_NO_MEM when the copy doesn't fit and ESP_ERR_TIMEOUT when
+ * the queue is full. The last two are counted as drops.
+ */
+#define UPLOAD_QUEUE_LEN 4
+#define UPLOAD_MAX_ATTEMPTS 5
+#define UPLOAD_PATH_LEN 64
+#define UPLOAD_TAG_LEN 16
+
+typedef enum {
+	UPLOAD_FTP,
+	UPLOAD_MQTT,
+	UPLOAD_TRANSPORTS
+} upload_transport_t;
+
+typedef struct {
+	char path[UPLOAD_PATH_LEN];
+	char tag[UPLOAD_TAG_LEN];
+	esp_err_t err;
+	upload_transport_t transport;
+	enc_format_t format;
+	size_t bytes;        // sent over the data connection or in chunks
+	uint32_t chunks;     // MQTT only
+	uint32_t enqueue_retries;  // MQTT chunks queued again, all attempts
+	int64_t encode_us;   // spent encoding, the transfer excluded
+	int64_t wait_us;     // queue, login and retries before the transfer
+	int64_t elapsed_us;  // transfer of the last attempt
+	uint8_t attempts;
+	bool encode_failed;  // not retried
+} upload_result_t;
+
+typedef struct {
+	uint8_t depth;  // queued, the one being sent included
+	uint8_t capacity;
+	size_t bytes_pending;
+	uint32_t completed;
+	uint32_t failed;
+	uint32_t dropped;
+	uint32_t retries;
+} upload_stats_t;
+
+typedef void (*upload_done_cb_t)(const upload_result_t *result);
+
+esp_err_t upload_init(upload_done_cb_t done_cb);
+esp_err_t upload_enqueue(const camera_fb_t *picture, const char *name,
+		const char *tag, char path[UPLOAD_PATH_LEN]);
+esp_err_t upload_set_encoding(enc_format_t format, uint8_t quality);
+void upload_get_encoding(enc_format_t *format, uint8_t *quality);
+esp_err_t upload_set_transport(upload_transport_t transport);
+upload_transport_t upload_get_transport(void);
+const char *upload_transport_name(upload_transport_t transport);
+void upload_get_stats(upload_stats_t *stats);
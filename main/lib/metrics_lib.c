@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include "mqtt_lib.h"
+#include "perf_lib.h"
+#include "metrics_lib.h"
+
+#define METRICS_SUBTOPIC "metrics"
+#define METRICS_TASK_STACK 4096
+#define METRICS_TASK_PRIORITY 1
+// Distinct command names with a histogram, further ones aren't counted
+#define METRICS_COMMANDS 24
+#define METRICS_TASKS 24
+#define METRICS_JSON_LEN 4096
+
+
+static const char *TAG = "metrics_lib";
+
+static const uint32_t g_bounds_ms[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+
+#define METRICS_BUCKETS (sizeof(g_bounds_ms) / sizeof(g_bounds_ms[0]) + 1)
+
+typedef struct {
+	uint32_t n;
+	int64_t sum_us;
+	int64_t max_us;
+	uint32_t buckets[METRICS_BUCKETS];
+} histogram_t;
+
+static struct {
+	char name[16];
+	histogram_t hist;
+} g_commands[METRICS_COMMANDS];
+
+static histogram_t g_phases[PERF_PHASES];
+
+// Observations come from every task running commands
+static portMUX_TYPE g_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile uint16_t g_period_s;  // 0 while off
+static TaskHandle_t g_task;
+
+// Run-time counters at the previous report, for the CPU shares
+static struct {
+	TaskHandle_t task;
+	uint32_t run_time;
+} g_prev[METRICS_TASKS];
+static uint32_t g_prev_total;
+
+
+static void metrics_task(void *arg);
+
+
+/*
+ * Starts publishing every `period_s` seconds or changes the period
+ */
+esp_err_t metrics_start(uint16_t period_s)
+{
+	if (period_s < 1 || period_s > METRICS_MAX_PERIOD_S) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	// A stopped task that hasn't noticed yet keeps running with the new period
+	portENTER_CRITICAL(&g_lock);
+	g_period_s = period_s;
+	const bool running = g_task;
+	portEXIT_CRITICAL(&g_lock);
+
+	if (!running && xTaskCreate(metrics_task, "metrics", METRICS_TASK_STACK, NULL,
+			METRICS_TASK_PRIORITY, &g_task) != pdPASS) {
+		g_period_s = 0;
+		g_task = NULL;
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+void metrics_stop(void)
+{
+	g_period_s = 0;
+}
+
+uint16_t metrics_period(void)
+{
+	return g_period_s;
+}
+
+static void observe(histogram_t *hist, int64_t us)
+{
+	uint8_t bucket = 0;
+
+	while (bucket < METRICS_BUCKETS - 1 && us > g_bounds_ms[bucket] * 1000LL) {
+		++bucket;
+	}
+
+	++hist->n;
+	hist->sum_us += us;
+	if (us > hist->max_us) {
+		hist->max_us = us;
+	}
+	++hist->buckets[bucket];
+}
+
+void metrics_observe_command(const char *command, int64_t us)
+{
+	if (!g_period_s) {
+		return;
+	}
+
+	portENTER_CRITICAL(&g_lock);
+	for (uint8_t i = 0; i < METRICS_COMMANDS; ++i) {
+		if (!g_commands[i].name[0]) {
+			strncpy(g_commands[i].name, command, sizeof(g_commands[i].name) - 1);
+		}
+		if (!strncmp(g_commands[i].name, command, sizeof(g_commands[i].name) - 1)) {
+			observe(&g_commands[i].hist, us);
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&g_lock);
+}
+
+void metrics_observe_phase(perf_phase_t phase, int64_t us)
+{
+	if (!g_period_s) {
+		return;
+	}
+
+	portENTER_CRITICAL(&g_lock);
+	observe(&g_phases[phase], us);
+	portEXIT_CRITICAL(&g_lock);
+}
+
+static void append(char *json, int *len, const char *format, ...)
+{
+	va_list args;
+
+	if (*len >= METRICS_JSON_LEN) {
+		return;
+	}
+
+	va_start(args, format);
+	*len += vsnprintf(json + *len, METRICS_JSON_LEN - *len, format, args);
+	va_end(args);
+}
+
+static void append_histogram(char *json, int *len, const char *name,
+			const histogram_t *hist)
+{
+	append(json, len, "\"%s\":{\"n\":%lu,\"sum_ms\":%.1f,\"max_ms\":%.1f,\"h\":[",
+		name, (unsigned long)hist->n, hist->sum_us / 1000.0, hist->max_us / 1000.0);
+
+	for (uint8_t i = 0; i < METRICS_BUCKETS; ++i) {
+		append(json, len, i ? ",%lu" : "%lu", (unsigned long)hist->buckets[i]);
+	}
+
+	append(json, len, "]}");
+}
+
+static uint32_t prev_run_time(TaskHandle_t task)
+{
+	for (uint8_t i = 0; i < METRICS_TASKS; ++i) {
+		if (g_prev[i].task == task) {
+			return g_prev[i].run_time;
+		}
+	}
+
+	return 0;
+}
+
+static void append_cpu(char *json, int *len)
+{
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+	UBaseType_t count = uxTaskGetNumberOfTasks() + 2;
+	TaskStatus_t *tasks = malloc(count * sizeof(*tasks));
+	uint32_t total;
+
+	append(json, len, ",\"cpu\":{");
+
+	if (!tasks) {
+		append(json, len, "}");
+		return;
+	}
+
+	count = uxTaskGetSystemState(tasks, count, &total);
+
+	// Counters wrap, the unsigned differences don't mind
+	const uint32_t elapsed = total - g_prev_total;
+
+	for (UBaseType_t i = 0; i < count && elapsed; ++i) {
+		const uint32_t ran = tasks[i].ulRunTimeCounter - prev_run_time(tasks[i].xHandle);
+
+		append(json, len, "%s\"%s\":%.1f", i ? "," : "", tasks[i].pcTaskName,
+			100.0 * ran / elapsed);
+	}
+
+	memset(g_prev, 0, sizeof(g_prev));
+	for (UBaseType_t i = 0; i < count && i < METRICS_TASKS; ++i) {
+		g_prev[i].task = tasks[i].xHandle;
+		g_prev[i].run_time = tasks[i].ulRunTimeCounter;
+	}
+	g_prev_total = total;
+
+	free(tasks);
+
+	append(json, len, "}");
+#else
+	append(json, len, ",\"cpu\":{}");
+#endif
+}
+
+static void publish_metrics(char *json)
+{
+	histogram_t hist;
+	char name[16];
+	int len = 0;
+
+	append(json, &len, "{\"uptime_s\":%lld,\"heap\":[%zu,%zu],\"psram\":[%zu,%zu]",
+		(long long)(esp_timer_get_time() / 1000000),
+		heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+		heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+		heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+		heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+
+	append_cpu(json, &len);
+
+	append(json, &len, ",\"bounds_ms\":[");
+	for (uint8_t i = 0; i < METRICS_BUCKETS - 1; ++i) {
+		append(json, &len, i ? ",%lu" : "%lu", (unsigned long)g_bounds_ms[i]);
+	}
+
+	append(json, &len, "],\"cmd\":{");
+	for (uint8_t i = 0, listed = 0; i < METRICS_COMMANDS; ++i) {
+		// Copied out, the JSON is built outside the critical section
+		portENTER_CRITICAL(&g_lock);
+		memcpy(name, g_commands[i].name, sizeof(name));
+		hist = g_commands[i].hist;
+		portEXIT_CRITICAL(&g_lock);
+
+		if (!name[0]) {
+			break;
+		}
+		append(json, &len, listed++ ? "," : "");
+		append_histogram(json, &len, name, &hist);
+	}
+
+	append(json, &len, "},\"phase\":{");
+	for (uint8_t i = 0, listed = 0; i < PERF_PHASES; ++i) {
+		portENTER_CRITICAL(&g_lock);
+		hist = g_phases[i];
+		portEXIT_CRITICAL(&g_lock);
+
+		if (!hist.n) {
+			continue;
+		}
+		append(json, &len, listed++ ? "," : "");
+		append_histogram(json, &len, perf_phase_name(i), &hist);
+	}
+
+	append(json, &len, "}}");
+
+	if (len >= METRICS_JSON_LEN) {
+		ESP_LOGW(TAG, "Metrics exceed %d bytes, not published", METRICS_JSON_LEN);
+		return;
+	}
+
+	mqtt_publish_raw(METRICS_SUBTOPIC, json, len);
+}
+
+static void metrics_task(void *arg)
+{
+	char *json = malloc(METRICS_JSON_LEN);
+	uint16_t waited_s = 0;
+	int len = 0;
+
+	if (!json) {
+		ESP_LOGE(TAG, "No memory for the metrics");
+		metrics_stop();
+	} else {
+		// The first CPU shares count from here
+		append_cpu(json, &len);
+	}
+
+	// Wakes up every second, so a new period or `off` apply right away
+	for (;;) {
+		bool stop;
+
+		portENTER_CRITICAL(&g_lock);
+		stop = !g_period_s;
+		if (stop) {
+			g_task = NULL;
+		}
+		portEXIT_CRITICAL(&g_lock);
+
+		if (stop) {
+			break;
+		}
+
+		vTaskDelay(pdMS_TO_TICKS(1000));
+
+		if (g_period_s && ++waited_s >= g_period_s) {
+			waited_s = 0;
+			publish_metrics(json);
+		}
+	}
+
+	free(json);
+	vTaskDelete(NULL);
+}
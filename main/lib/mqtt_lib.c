@@ -4,16 +4,67 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_mac.h>
 #include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "mqtt_lib.h"
 
-#define MQTT_TOPIC_SUB "ESP32/shape_detector/input"
-#define MQTT_TOPIC_PUB "ESP32/shape_detector/output"
+/*
+ * Every device has its own topics under ESP32/shape_detector/<device ID>/,
+ * commands on the broadcast topic reach all of them (replies still go to
+ * each device's output topic)
+ */
+#define MQTT_TOPIC_ROOT "ESP32/shape_detector/"
+#define MQTT_TOPIC_BROADCAST MQTT_TOPIC_ROOT MQTT_BROADCAST_ID "/input"
+// The root, the device ID and '/'
+#define MQTT_TOPIC_BASE_LEN (sizeof(MQTT_TOPIC_ROOT) + MQTT_DEVICE_ID_LEN)
+#define MQTT_TOPIC_LEN (MQTT_TOPIC_BASE_LEN + 32)
+
+// The MQTT task, the two command workers and the upload task
+#define MQTT_REPLY_CONTEXTS 4
+#define MQTT_COLLECT_LEN 1024
+
+// QoS 1 chunks wait for the broker while this many bytes are unacknowledged
+#define MQTT_OUTBOX_LIMIT (4 * MQTT_CHUNK_MAX)
+#define MQTT_OUTBOX_TIMEOUT_MS 5000
+#define MQTT_CHUNK_RETRY_MS 100
 
 
 static const char *TAG = "mqtt_lib";
 
 static esp_mqtt_client_handle_t client;
 
+static char g_device_id[MQTT_DEVICE_ID_LEN];
+static char g_topic_base[MQTT_TOPIC_BASE_LEN];
+static char g_topic_in[MQTT_TOPIC_LEN];
+static char g_topic_out[MQTT_TOPIC_LEN];
+static uint8_t g_subscribed;  // since the last connect
+
+/*
+ * What the task answering a request adds to its replies on the output topic,
+ * see mqtt_reply_begin()
+ */
+static struct reply_ctx {
+	TaskHandle_t task;
+	char id[MQTT_REPLY_ID_LEN];
+	char *buf;  // collected replies, NULL when publishing right away
+	size_t len;
+	bool truncated;
+} g_replies[MQTT_REPLY_CONTEXTS];
+
+static portMUX_TYPE g_replies_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static mqtt_upload_opts_t g_upload_opts = {
+	.chunk = MQTT_CHUNK_DEFAULT,
+	.qos = 1
+};
+
 
 /*
  * This wrapper function is called from mqtt_event_handler() to execute
@@ -37,7 +88,9 @@ static void mqtt_event_handler(void *event_handler_arg, esp_event_base_t event_b
 	case MQTT_EVENT_CONNECTED:
 		ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
 
-		esp_mqtt_client_subscribe(client, MQTT_TOPIC_SUB, 0);
+		g_subscribed = 0;
+		esp_mqtt_client_subscribe(client, g_topic_in, 0);
+		esp_mqtt_client_subscribe(client, MQTT_TOPIC_BROADCAST, 0);
 		break;
 
 	case MQTT_EVENT_DISCONNECTED:
@@ -47,7 +100,11 @@ static void mqtt_event_handler(void *event_handler_arg, esp_event_base_t event_b
 	case MQTT_EVENT_SUBSCRIBED:
 		ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED");
 
-		esp_mqtt_client_publish(client, MQTT_TOPIC_PUB, "ESP32-CAM is"
+		// Greets once both topics are subscribed
+		if (++g_subscribed != 2) {
+			break;
+		}
+		esp_mqtt_client_publish(client, g_topic_out, "ESP32-CAM is"
 					" ready to receive input", 0, 0, 1);
 		break;
 
@@ -75,12 +132,57 @@ static void mqtt_event_handler(void *event_handler_arg, esp_event_base_t event_b
 	}
 }
 
-esp_err_t start_mqtt_client(const char *URI, void (*mqtt_data_handler)(char *))
+static bool valid_device_id(const char *id)
 {
+	return id[0] && strlen(id) < MQTT_DEVICE_ID_LEN && !strpbrk(id, "/+#") &&
+		strcmp(id, MQTT_BROADCAST_ID);
+}
+
+/*
+ * `device_id` names the device's topics, NULL or "" for its MAC address
+ * (lowercase hex, e.g. 240ac4000001)
+ */
+esp_err_t start_mqtt_client(const char *URI, const char *device_id,
+			void (*mqtt_data_handler)(char *))
+{
+	char client_id[sizeof("shape_detector_") + MQTT_DEVICE_ID_LEN];
+	uint8_t mac[6];
+
+	if (device_id && device_id[0] && !valid_device_id(device_id)) {
+		ESP_LOGW(TAG, "Invalid device ID \"%s\", using the MAC address", device_id);
+		device_id = NULL;
+	}
+
+	if (device_id && device_id[0]) {
+		strcpy(g_device_id, device_id);
+	} else {
+		ESP_ERROR_RETURN(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+		snprintf(g_device_id, sizeof(g_device_id), "%02x%02x%02x%02x%02x%02x",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	}
+
+	snprintf(g_topic_base, sizeof(g_topic_base), MQTT_TOPIC_ROOT "%s/", g_device_id);
+	snprintf(g_topic_in, sizeof(g_topic_in), "%sinput", g_topic_base);
+	snprintf(g_topic_out, sizeof(g_topic_out), "%soutput", g_topic_base);
+	// Brokers drop the older of two clients with the same ID
+	snprintf(client_id, sizeof(client_id), "shape_detector_%s", g_device_id);
+
 	esp_mqtt_client_config_t mqtt_cfg = {
-		.broker.address.uri = URI
+		.broker.address.uri = URI,
+		.credentials.client_id = client_id,
+		// Clears the retained greeting when the device drops off
+		.session.last_will = {
+			.topic = g_topic_out,
+			.msg = "",
+			.msg_len = 0,
+			.qos = 1,
+			.retain = 1
+		}
 	};
 
+	ESP_LOGI(TAG, "Device %s, commands on %s and " MQTT_TOPIC_BROADCAST,
+		g_device_id, g_topic_in);
+
 	client = esp_mqtt_client_init(&mqtt_cfg);
 
 	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
@@ -91,16 +193,336 @@ esp_err_t start_mqtt_client(const char *URI, void (*mqtt_data_handler)(char *))
 	return ESP_OK;
 }
 
-esp_err_t mqtt_publish(const char *format, ...)
+static esp_err_t publish(const char *topic, const char *id, const char *format,
+			va_list args)
 {
 	char payload[256];
+	int len = 0;
+
+	if (id && id[0]) {
+		len = snprintf(payload, sizeof(payload), "%s ", id);
+	}
+	vsnprintf(payload + len, sizeof(payload) - len, format, args);
+
+	perf_start(PERF_PUBLISH);
+	int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 0, 0);
+	perf_stop(PERF_PUBLISH);
+
+	return msg_id < 0 ? ESP_FAIL : ESP_OK;
+}
+
+static struct reply_ctx *find_reply_ctx(TaskHandle_t task)
+{
+	for (uint8_t i = 0; i < MQTT_REPLY_CONTEXTS; ++i) {
+		if (g_replies[i].task == task) {
+			return &g_replies[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Until mqtt_reply_end(), the replies the calling task publishes on the
+ * output topic start with `id` (the client's correlation ID, e.g. "#12",
+ * NULL for none). With `collect` they are also held back and sent as one
+ * message, a line each, so a batch of commands gets a single answer.
+ */
+esp_err_t mqtt_reply_begin(const char *id, bool collect)
+{
+	struct reply_ctx *ctx;
+	char *buf = NULL;
+
+	if (id && strlen(id) >= MQTT_REPLY_ID_LEN) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	if (collect) {
+		buf = malloc(MQTT_COLLECT_LEN);
+		if (!buf) {
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	portENTER_CRITICAL(&g_replies_lock);
+	ctx = find_reply_ctx(xTaskGetCurrentTaskHandle());
+	if (!ctx) {
+		ctx = find_reply_ctx(NULL);
+	}
+	if (ctx) {
+		ctx->task = xTaskGetCurrentTaskHandle();
+	}
+	portEXIT_CRITICAL(&g_replies_lock);
+
+	if (!ctx) {
+		free(buf);
+		return ESP_ERR_NO_MEM;
+	}
+
+	free(ctx->buf);
+	strcpy(ctx->id, id ? id : "");
+	ctx->buf = buf;
+	ctx->len = 0;
+	ctx->truncated = false;
+
+	return ESP_OK;
+}
+
+/*
+ * Publishes what was collected and drops the ID
+ */
+esp_err_t mqtt_reply_end(void)
+{
+	struct reply_ctx *ctx = find_reply_ctx(xTaskGetCurrentTaskHandle());
+	esp_err_t ret = ESP_OK;
+
+	if (!ctx) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (ctx->truncated) {
+		ESP_LOGW(TAG, "Collected replies exceed %d bytes, the rest is cut",
+			MQTT_COLLECT_LEN);
+	}
+
+	if (ctx->buf && ctx->len) {
+		perf_start(PERF_PUBLISH);
+		int msg_id = esp_mqtt_client_publish(client, g_topic_out,
+					ctx->buf, ctx->len, 0, 0);
+		perf_stop(PERF_PUBLISH);
+
+		ret = msg_id < 0 ? ESP_FAIL : ESP_OK;
+	}
+
+	free(ctx->buf);
+	ctx->buf = NULL;
+
+	portENTER_CRITICAL(&g_replies_lock);
+	ctx->task = NULL;
+	portEXIT_CRITICAL(&g_replies_lock);
+
+	return ret;
+}
+
+const char *mqtt_device_id(void)
+{
+	return g_device_id;
+}
+
+/*
+ * The calling task's correlation ID, NULL when it has none
+ */
+const char *mqtt_reply_id(void)
+{
+	struct reply_ctx *ctx = find_reply_ctx(xTaskGetCurrentTaskHandle());
+
+	return ctx && ctx->id[0] ? ctx->id : NULL;
+}
+
+static void collect(struct reply_ctx *ctx, const char *format, va_list args)
+{
+	size_t space = MQTT_COLLECT_LEN - ctx->len;
+	int len;
+
+	if (!ctx->len && ctx->id[0]) {
+		len = snprintf(ctx->buf, space, "%s ", ctx->id);
+	} else if (ctx->len && space > 1) {
+		ctx->buf[ctx->len] = '\n';
+		len = 1;
+	} else {
+		len = 0;
+	}
+	ctx->len += len;
+	space -= len;
+
+	len = vsnprintf(ctx->buf + ctx->len, space, format, args);
+	if (len < 0 || (size_t)len >= space) {
+		ctx->truncated = true;
+		ctx->len = MQTT_COLLECT_LEN - 1;
+	} else {
+		ctx->len += len;
+	}
+}
+
+esp_err_t mqtt_publish(const char *format, ...)
+{
+	struct reply_ctx *ctx = find_reply_ctx(xTaskGetCurrentTaskHandle());
+	esp_err_t ret = ESP_OK;
 	va_list args;
 
 	va_start(args, format);
-	vsnprintf(payload, sizeof(payload), format, args);
+	if (ctx && ctx->buf) {
+		collect(ctx, format, args);
+	} else {
+		ret = publish(g_topic_out, ctx ? ctx->id : NULL, format, args);
+	}
 	va_end(args);
 
-	ESP_ERROR_RETURN(esp_mqtt_client_publish(client, MQTT_TOPIC_PUB,
-						payload, 0, 0, 0));
+	return ret;
+}
+
+/*
+ * Publish `len` bytes as they are to ESP32/shape_detector/<device>/<subtopic>, for
+ * payloads that don't fit the formatted ones (metrics) or aren't text
+ */
+esp_err_t mqtt_publish_raw(const char *subtopic, const void *data, size_t len)
+{
+	char topic[MQTT_TOPIC_LEN];
+
+	snprintf(topic, sizeof(topic), "%s%s", g_topic_base, subtopic);
+
+	perf_start(PERF_PUBLISH);
+	int msg_id = esp_mqtt_client_publish(client, topic, data, len, 0, 0);
+	perf_stop(PERF_PUBLISH);
+
+	return msg_id < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/*
+ * Publish to ESP32/shape_detector/<device>/<subtopic>, for data that shouldn't be
+ * mixed with the replies on the output topic.
+ */
+esp_err_t mqtt_publish_to(const char *subtopic, const char *format, ...)
+{
+	char topic[MQTT_TOPIC_LEN];
+	va_list args;
+
+	snprintf(topic, sizeof(topic), "%s%s", g_topic_base, subtopic);
+
+	va_start(args, format);
+	esp_err_t ret = publish(topic, NULL, format, args);
+	va_end(args);
+
+	return ret;
+}
+
+esp_err_t mqtt_set_upload_opts(const mqtt_upload_opts_t *opts)
+{
+	if (opts->chunk < MQTT_CHUNK_MIN || opts->chunk > MQTT_CHUNK_MAX || opts->qos > 1) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	g_upload_opts = *opts;
+
+	return ESP_OK;
+}
+
+void mqtt_get_upload_opts(mqtt_upload_opts_t *opts)
+{
+	*opts = g_upload_opts;
+}
+
+/*
+ * Keeps QoS 1 chunks from piling up in the client's outbox (heap) faster
+ * than the broker acknowledges them
+ */
+static esp_err_t wait_outbox(uint8_t qos)
+{
+	int64_t deadline = esp_timer_get_time() + MQTT_OUTBOX_TIMEOUT_MS * 1000LL;
+
+	while (qos && esp_mqtt_client_get_outbox_size(client) > MQTT_OUTBOX_LIMIT) {
+		if (esp_timer_get_time() > deadline) {
+			return ESP_ERR_TIMEOUT;
+		}
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+
 	return ESP_OK;
 }
+
+static esp_err_t publish_chunk(mqtt_stream_t *stream, const char *topic,
+			const void *data, size_t len, uint8_t qos)
+{
+	for (uint8_t attempt = 0; ; ++attempt) {
+		int msg_id = -1;
+
+		perf_start(PERF_PUBLISH);
+		if (wait_outbox(qos) == ESP_OK) {
+			msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, 0);
+		}
+		perf_stop(PERF_PUBLISH);
+
+		if (msg_id >= 0) {
+			return ESP_OK;
+		}
+
+		if (attempt == MQTT_CHUNK_RETRIES) {
+			ESP_LOGE(TAG, "Failed to publish %s", topic);
+			return ESP_FAIL;
+		}
+
+		++stream->enqueue_retries;
+		vTaskDelay(pdMS_TO_TICKS(MQTT_CHUNK_RETRY_MS));
+	}
+}
+
+esp_err_t mqtt_upload_begin(const char *path, mqtt_stream_t *stream)
+{
+	char topic[MQTT_TOPIC_LEN];
+	char info[128];
+
+	stream->id = esp_random();
+	stream->opts = g_upload_opts;
+	stream->chunks = 0;
+	stream->enqueue_retries = 0;
+	stream->sent = 0;
+	stream->elapsed_us = 0;
+	stream->start_us = esp_timer_get_time();
+
+	int len = snprintf(info, sizeof(info), "{\"path\":\"%s\",\"chunk\":%zu,\"qos\":%u}",
+			path, stream->opts.chunk, stream->opts.qos);
+	if (len >= (int)sizeof(info)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	snprintf(topic, sizeof(topic), "%simage/%08lx/begin",
+		g_topic_base, (unsigned long)stream->id);
+
+	// The receiver has to see the begin and end, whatever the chunks' QoS
+	return publish_chunk(stream, topic, info, len, 1);
+}
+
+esp_err_t mqtt_upload_write(mqtt_stream_t *stream, const void *data, size_t size)
+{
+	const uint8_t *pos = data;
+	char topic[MQTT_TOPIC_LEN];
+
+	while (size) {
+		const size_t len = size < stream->opts.chunk ? size : stream->opts.chunk;
+
+		snprintf(topic, sizeof(topic), "%simage/%08lx/%lu",
+			g_topic_base, (unsigned long)stream->id,
+			(unsigned long)stream->chunks);
+
+		ESP_ERROR_RETURN(publish_chunk(stream, topic, pos, len, stream->opts.qos));
+
+		++stream->chunks;
+		stream->sent += len;
+		pos += len;
+		size -= len;
+	}
+
+	return ESP_OK;
+}
+
+/*
+ * `complete` is false when the sender gave up, the receiver drops what it has
+ */
+esp_err_t mqtt_upload_end(mqtt_stream_t *stream, bool complete)
+{
+	char topic[MQTT_TOPIC_LEN];
+	char info[160];
+
+	stream->elapsed_us = esp_timer_get_time() - stream->start_us;
+
+	int len = snprintf(info, sizeof(info), "{\"chunks\":%lu,\"bytes\":%zu,"
+			"\"complete\":%s,\"enqueue_retries\":%lu,\"elapsed_us\":%lld}",
+			(unsigned long)stream->chunks, stream->sent,
+			complete ? "true" : "false", (unsigned long)stream->enqueue_retries,
+			(long long)stream->elapsed_us);
+
+	snprintf(topic, sizeof(topic), "%simage/%08lx/end",
+		g_topic_base, (unsigned long)stream->id);
+
+	return publish_chunk(stream, topic, info, len, 1);
+}
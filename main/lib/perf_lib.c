@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "mqtt_lib.h"
+#include "perf_lib.h"
+#include "metrics_lib.h"
+
+#define PERF_SUBTOPIC "perf"
+#define PERF_RECORDS 4
+#define PERF_TASKS 3
+
+
+static const char *g_phase_names[PERF_PHASES] = {
+	[PERF_SERVO] = "servo",
+	[PERF_CAPTURE] = "capture",
+	[PERF_ENCODE] = "encode",
+	[PERF_FTP_LOGIN] = "ftp_login",
+	[PERF_FTP_PASV] = "pasv",
+	[PERF_FTP_STOR] = "stor",
+	[PERF_PUBLISH] = "publish"
+};
+
+/*
+ * One record per task running commands (the MQTT task, the two command
+ * workers and the upload task). Phases count towards the record of the task
+ * marking them: the one that began it or a helper task it was shared with
+ * (pipelined fetch). Other tasks (preview stream) aren't timed.
+ */
+static struct perf_record {
+	char command[16];
+	int64_t begin;
+	int64_t wait;
+	int64_t started[PERF_PHASES];
+	int64_t spent[PERF_PHASES];
+	TaskHandle_t tasks[PERF_TASKS];  // the owner first
+} g_records[PERF_RECORDS];
+
+static bool g_enabled;
+
+// Taken while a record changes hands
+static portMUX_TYPE g_records_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+static struct perf_record *find_record(TaskHandle_t task)
+{
+	for (uint8_t r = 0; r < PERF_RECORDS; ++r) {
+		for (uint8_t t = 0; t < PERF_TASKS; ++t) {
+			if (g_records[r].tasks[t] == task) {
+				return &g_records[r];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+const char *perf_phase_name(perf_phase_t phase)
+{
+	return g_phase_names[phase];
+}
+
+void perf_enable(bool enable)
+{
+	g_enabled = enable;
+}
+
+/*
+ * `wait_us` is how long the command was queued before it ran
+ */
+void perf_begin(const char *command, int64_t wait_us)
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	struct perf_record *record = NULL;
+
+	portENTER_CRITICAL(&g_records_lock);
+	for (uint8_t r = 0; r < PERF_RECORDS && !record; ++r) {
+		if (g_records[r].tasks[0] == task) {
+			record = &g_records[r];
+		}
+	}
+	for (uint8_t r = 0; r < PERF_RECORDS && !record; ++r) {
+		if (!g_records[r].tasks[0]) {
+			record = &g_records[r];
+			record->tasks[0] = task;
+		}
+	}
+	portEXIT_CRITICAL(&g_records_lock);
+
+	if (!record) {
+		return;
+	}
+
+	memset(record->started, 0, sizeof(record->started));
+	memset(record->spent, 0, sizeof(record->spent));
+
+	snprintf(record->command, sizeof(record->command), "%s", command);
+
+	// Goes into the JSON as is, unknown commands may contain anything
+	for (char *c = record->command; *c; ++c) {
+		if (!isalnum((unsigned char)*c)) {
+			*c = '_';
+		}
+	}
+
+	record->wait = wait_us;
+	record->begin = esp_timer_get_time();
+}
+
+/*
+ * Lets `task` mark phases of the calling task's command until perf_end()
+ */
+void perf_share(TaskHandle_t task)
+{
+	struct perf_record *record = find_record(xTaskGetCurrentTaskHandle());
+
+	for (uint8_t t = 1; record && t < PERF_TASKS; ++t) {
+		if (!record->tasks[t]) {
+			record->tasks[t] = task;
+			return;
+		}
+	}
+}
+
+void perf_start(perf_phase_t phase)
+{
+	struct perf_record *record = find_record(xTaskGetCurrentTaskHandle());
+
+	if (record) {
+		record->started[phase] = esp_timer_get_time();
+	}
+}
+
+void perf_stop(perf_phase_t phase)
+{
+	struct perf_record *record = find_record(xTaskGetCurrentTaskHandle());
+
+	if (record) {
+		record->spent[phase] += esp_timer_get_time() - record->started[phase];
+	}
+}
+
+void perf_end(void)
+{
+	struct perf_record *record = find_record(xTaskGetCurrentTaskHandle());
+	char json[288];
+	int len;
+
+	if (!record) {
+		return;
+	}
+
+	const int64_t total = esp_timer_get_time() - record->begin;
+
+	// Helpers are gone by now, their handles could be reused
+	memset(record->tasks + 1, 0, sizeof(record->tasks) - sizeof(record->tasks[0]));
+
+	metrics_observe_command(record->command, total);
+	for (uint8_t i = 0; i < PERF_PHASES; ++i) {
+		if (record->spent[i]) {
+			metrics_observe_phase(i, record->spent[i]);
+		}
+	}
+
+	if (!g_enabled) {
+		return;
+	}
+
+	len = snprintf(json, sizeof(json), "{\"cmd\":\"%s\",\"total_us\":%lld,\"wait_us\":%lld",
+		record->command, (long long)total, (long long)record->wait);
+
+	for (uint8_t i = 0; i < PERF_PHASES && len < (int)sizeof(json); ++i) {
+		len += snprintf(json + len, sizeof(json) - len, ",\"%s_us\":%lld",
+			g_phase_names[i], (long long)record->spent[i]);
+	}
+
+	if (len < (int)sizeof(json)) {
+		snprintf(json + len, sizeof(json) - len, "}");
+	}
+
+	mqtt_publish_to(PERF_SUBTOPIC, "%s", json);
+}
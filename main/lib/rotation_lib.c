@@ -0,0 +1,144 @@
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "fft_lib.h"
+#include "rotation_lib.h"
+
+// Innermost ring radius in pixels, smaller circles have too few distinct pixels
+#define MIN_RADIUS 6.0f
+
+
+static float g_cos[ROT_ANGLES];
+static float g_sin[ROT_ANGLES];
+static bool g_initialized = false;
+
+
+static void init_tables(void)
+{
+	if (g_initialized) {
+		return;
+	}
+
+	for (uint16_t i = 0; i < ROT_ANGLES; ++i) {
+		float theta = 2.0f * (float)M_PI * i / ROT_ANGLES;
+
+		g_cos[i] = cosf(theta);
+		g_sin[i] = sinf(theta);
+	}
+	fft_init();
+
+	g_initialized = true;
+}
+
+static inline float sample_bilinear(const uint8_t *gray, uint16_t width, float x, float y)
+{
+	const int x0 = (int)x, y0 = (int)y;
+	const float fx = x - x0, fy = y - y0;
+	const uint8_t *p = gray + y0 * width + x0;
+
+	const float top = p[0] + (p[1] - p[0]) * fx;
+	const float bottom = p[width] + (p[width + 1] - p[width]) * fx;
+
+	return top + (bottom - top) * fy;
+}
+
+bool rot_spectrum(const uint8_t *gray, uint16_t width, uint16_t height,
+		rot_spectrum_t *spectrum)
+{
+	float re[ROT_ANGLES], im[ROT_ANGLES];
+	const float cx = (width - 1) / 2.0f, cy = (height - 1) / 2.0f;
+	// Keep the bilinear 2x2 footprint inside the frame
+	const float max_radius = (width < height ? width : height) / 2.0f - 2.0f;
+
+	if (max_radius <= MIN_RADIUS) {
+		return false;
+	}
+
+	init_tables();
+
+	const float growth = powf(max_radius / MIN_RADIUS, 1.0f / (ROT_RINGS - 1));
+	float radius = MIN_RADIUS;
+
+	for (uint16_t ring = 0; ring < ROT_RINGS; ++ring, radius *= growth) {
+		for (uint16_t a = 0; a < ROT_ANGLES; ++a) {
+			re[a] = sample_bilinear(gray, width, cx + radius * g_cos[a],
+						cy + radius * g_sin[a]);
+			im[a] = 0.0f;
+		}
+
+		fft_radix2(re, im, ROT_ANGLES, false);
+
+		// Real input: bins above ROT_BINS are conjugates of the ones below
+		memcpy(spectrum->re[ring], re + 1, ROT_BINS * sizeof(float));
+		memcpy(spectrum->im[ring], im + 1, ROT_BINS * sizeof(float));
+	}
+
+	return true;
+}
+
+/*
+ * Returns the rotation in degrees (-180, 180] that maps the reference onto the
+ * live image, positive from +x towards +y (clockwise on screen, y down). The
+ * confidence is the height of the correlation peak, 1.0 for a perfect match
+ * and around 1/sqrt(ROT_ANGLES) for unrelated images.
+ */
+float rot_estimate(const rot_spectrum_t *reference, const rot_spectrum_t *live,
+		float *confidence)
+{
+	float re[ROT_ANGLES] = {0}, im[ROT_ANGLES] = {0};
+
+	init_tables();
+
+	for (uint16_t ring = 0; ring < ROT_RINGS; ++ring) {
+		for (uint16_t k = 0; k < ROT_BINS; ++k) {
+			const float ar = live->re[ring][k], ai = live->im[ring][k];
+			const float br = reference->re[ring][k], bi = -reference->im[ring][k];
+
+			re[k + 1] += ar * br - ai * bi;
+			im[k + 1] += ar * bi + ai * br;
+		}
+	}
+
+	for (uint16_t k = 1; k <= ROT_BINS; ++k) {
+		const float mag = sqrtf(re[k] * re[k] + im[k] * im[k]);
+
+		if (mag > 1e-9f) {
+			re[k] /= mag;
+			im[k] /= mag;
+		}
+		if (k < ROT_BINS) {
+			re[ROT_ANGLES - k] = re[k];
+			im[ROT_ANGLES - k] = -im[k];
+		}
+	}
+	// Nyquist bin of a real signal is real
+	im[ROT_BINS] = 0.0f;
+
+	fft_radix2(re, im, ROT_ANGLES, true);
+
+	uint16_t peak = 0;
+	for (uint16_t i = 1; i < ROT_ANGLES; ++i) {
+		if (re[i] > re[peak]) {
+			peak = i;
+		}
+	}
+
+	// Parabolic interpolation between the neighbouring bins
+	const float left = re[(peak + ROT_ANGLES - 1) % ROT_ANGLES];
+	const float right = re[(peak + 1) % ROT_ANGLES];
+	const float denom = left - 2.0f * re[peak] + right;
+	float offset = peak;
+
+	if (denom < 0.0f) {
+		offset += 0.5f * (left - right) / denom;
+	}
+
+	if (confidence) {
+		*confidence = re[peak] / (ROT_ANGLES - 1);
+	}
+
+	float degrees = offset * 360.0f / ROT_ANGLES;
+
+	return degrees > 180.0f ? degrees - 360.0f : degrees;
+}
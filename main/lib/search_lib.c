@@ -0,0 +1,762 @@
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <esp_camera.h>
+#include "esp_err_ext.h"
+#include "servo_lib.h"
+#include "camera_lib.h"
+#include "image_lib.h"
+#include "descriptor_lib.h"
+#include "rotation_lib.h"
+#include "calib_lib.h"
+#include "search_lib.h"
+#include "perf_lib.h"
+#include "command_lib.h"
+
+#define MIN_ANGLE 0
+#define MAX_ANGLE 180
+#define UNSCORED INFINITY
+
+/*
+ * With CAMERA_GRAB_LATEST the returned frame could have been exposed up to one
+ * frame period before the call, captures wait that long once the servo is still
+ */
+#define FRAME_PERIOD_MS 40
+
+/*
+ * Phase correlation: peaks below MIN_CONFIDENCE are treated as "no match",
+ * a residual rotation within PHASE_TOLERANCE_DEG is accepted as aligned and
+ * MAX_CORRECTIONS bounds the extra moves when the first one misses.
+ */
+#define MIN_CONFIDENCE 0.3f
+#define PHASE_TOLERANCE_DEG 1.5f
+#define MAX_CORRECTIONS 2
+
+/*
+ * Index lookup: a reference further than INDEX_MAX_DISTANCE from every entry
+ * isn't the calibrated object, a confirmation shot further than that from the
+ * reference means the index no longer matches the rig.
+ */
+#define INDEX_MAX_DISTANCE 0.35f
+
+/*
+ * Pipelined sweep: the capture task runs next to the camera driver on core 0,
+ * scoring on core 1. One frame is scored while the next one is grabbed; the
+ * reference shot holds another buffer, so the capture task takes a slot
+ * before every grab and the score task gives it back with the buffer.
+ */
+#define PIPE_CAPTURE_CORE 0
+#define PIPE_SCORE_CORE 1
+#define PIPE_FRAME_SLOTS (CAMERA_FB_COUNT - 1)
+#define PIPE_TASK_STACK 4096
+#define PIPE_TASK_PRIORITY 5
+#define PIPE_STOP INT16_MIN
+
+
+static const char *TAG = "search_lib";
+
+/*
+ * Image rotation caused by one degree of servo rotation. The sign depends on
+ * how the rig is assembled (camera or object on the servo, which way up), so
+ * it starts at 1 and is re-estimated from every correction move.
+ */
+static float g_image_deg_per_servo_deg = 1.0f;
+
+/*
+ * Coarse to fine: the first pass covers the whole range, every next pass scans
+ * the gap between the best angle so far and its already scored neighbours.
+ */
+static const uint8_t g_steps[] = {20, 5, 1};
+
+/*
+ * Everything derived from the reference picture is computed once per `shoot`.
+ * The frame buffer address and timestamp identify which picture the cache
+ * belongs to, the driver reuses buffers so the address alone isn't enough.
+ */
+static struct reference_cache {
+	bool valid;
+	const uint8_t *buf;
+	struct timeval timestamp;
+	shape_desc_t desc;
+	rot_spectrum_t *spectrum;  // only built by the first `fetch phase`
+} g_ref;
+
+
+typedef struct {
+	int16_t angle;
+	camera_fb_t *frame;  // NULL when the capture failed
+} pipe_frame_t;
+
+typedef struct {
+	int16_t angle;
+	float score;
+	esp_err_t err;
+} pipe_score_t;
+
+static struct pipeline {
+	QueueHandle_t angles;  // coordinator -> capture task
+	QueueHandle_t frames;  // capture task -> score task
+	QueueHandle_t scores;  // score task -> coordinator
+	SemaphoreHandle_t slots;  // frame buffers the pipeline may hold
+	SemaphoreHandle_t done;  // given by each task when it exits
+	int64_t capture_stall_us;  // capture waiting for a buffer and the frame
+	int64_t score_stall_us;  // scoring waiting for a frame
+} g_pipe;
+
+
+static bool is_cached(const camera_fb_t *reference)
+{
+	return g_ref.valid && g_ref.buf == reference->buf &&
+		g_ref.timestamp.tv_sec == reference->timestamp.tv_sec &&
+		g_ref.timestamp.tv_usec == reference->timestamp.tv_usec;
+}
+
+static esp_err_t frame_desc(const camera_fb_t *frame, shape_desc_t *desc)
+{
+	if (frame->format != PIXFORMAT_RGB565 && frame->format != PIXFORMAT_GRAYSCALE) {
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	if (!desc_compute(frame->buf, frame->width, frame->height,
+			frame->format == PIXFORMAT_RGB565, desc)) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+static esp_err_t frame_spectrum(const camera_fb_t *frame, rot_spectrum_t *spectrum)
+{
+	const size_t pixels = frame->width * frame->height;
+	const uint8_t *gray = frame->buf;
+	uint8_t *converted = NULL;
+
+	if (frame->format == PIXFORMAT_RGB565) {
+		converted = malloc(pixels);
+		if (!converted) {
+			return ESP_ERR_NO_MEM;
+		}
+		img_rgb565_to_gray(frame->buf, converted, pixels);
+		gray = converted;
+
+	} else if (frame->format != PIXFORMAT_GRAYSCALE) {
+		return ESP_ERR_NOT_SUPPORTED;
+
+	}
+
+	bool ok = rot_spectrum(gray, frame->width, frame->height, spectrum);
+	free(converted);
+
+	return ok ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static esp_err_t capture_spectrum(rot_spectrum_t *spectrum)
+{
+	camera_fb_t *picture = take_picture();
+	if (!picture) {
+		return ESP_FAIL;
+	}
+
+	esp_err_t ret = frame_spectrum(picture, spectrum);
+	free_picture(&picture);
+
+	return ret;
+}
+
+// In ddeg, the finest the servo moves
+static int16_t clamp_angle(float angle)
+{
+	if (angle < MIN_ANGLE) {
+		angle = MIN_ANGLE;
+	} else if (angle > MAX_ANGLE) {
+		angle = MAX_ANGLE;
+	}
+
+	return (int16_t)lroundf(angle * SERVO_DDEG_PER_DEG);
+}
+
+/*
+ * Returns once a frame grabbed now shows the servo still at `ddeg`
+ */
+static esp_err_t move_servo(int16_t ddeg)
+{
+	ESP_ERROR_RETURN(set_servo_angle_ddeg(ddeg, false));
+	ESP_ERROR_RETURN(servo_wait(SERVO_WAIT_MS));
+
+	vTaskDelay(pdMS_TO_TICKS(FRAME_PERIOD_MS));
+
+	return ESP_OK;
+}
+
+static esp_err_t capture_desc_at(int16_t ddeg, shape_desc_t *desc)
+{
+	ESP_ERROR_RETURN(move_servo(ddeg));
+
+	camera_fb_t *picture = take_picture();
+	if (!picture) {
+		return ESP_FAIL;
+	}
+
+	esp_err_t ret = frame_desc(picture, desc);
+	free_picture(&picture);
+
+	return ret;
+}
+
+static esp_err_t score_angle(int16_t angle, float *score)
+{
+	shape_desc_t live;
+
+	ESP_ERROR_RETURN(capture_desc_at(angle * SERVO_DDEG_PER_DEG, &live));
+
+	*score = desc_distance(&g_ref.desc, &live);
+
+	ESP_LOGI(TAG, "Angle %d: score %.3f", angle, *score);
+
+	return ESP_OK;
+}
+
+static void pipe_capture_task(void *arg)
+{
+	pipe_frame_t item;
+
+	while (xQueueReceive(g_pipe.angles, &item.angle, portMAX_DELAY) == pdTRUE) {
+		item.frame = NULL;
+
+		if (item.angle != PIPE_STOP && move_servo(item.angle * SERVO_DDEG_PER_DEG) == ESP_OK) {
+			const int64_t wait = esp_timer_get_time();
+
+			xSemaphoreTake(g_pipe.slots, portMAX_DELAY);
+			item.frame = take_picture();
+			if (!item.frame) {
+				xSemaphoreGive(g_pipe.slots);
+			}
+			g_pipe.capture_stall_us += esp_timer_get_time() - wait;
+		}
+
+		// Never blocks, there are as many places as slots
+		xQueueSend(g_pipe.frames, &item, portMAX_DELAY);
+
+		if (item.angle == PIPE_STOP) {
+			break;
+		}
+	}
+
+	xSemaphoreGive(g_pipe.done);
+	vTaskDelete(NULL);
+}
+
+static void pipe_score_task(void *arg)
+{
+	pipe_frame_t item;
+	pipe_score_t result;
+	shape_desc_t live;
+
+	for (;;) {
+		const int64_t wait = esp_timer_get_time();
+		xQueueReceive(g_pipe.frames, &item, portMAX_DELAY);
+
+		if (item.angle == PIPE_STOP) {
+			break;
+		}
+		g_pipe.score_stall_us += esp_timer_get_time() - wait;
+
+		result.angle = item.angle;
+		result.score = UNSCORED;
+		result.err = ESP_FAIL;
+
+		if (item.frame) {
+			result.err = frame_desc(item.frame, &live);
+			free_picture(&item.frame);
+			xSemaphoreGive(g_pipe.slots);
+		}
+
+		if (result.err == ESP_OK) {
+			result.score = desc_distance(&g_ref.desc, &live);
+			ESP_LOGI(TAG, "Angle %d: score %.3f", result.angle, result.score);
+		}
+
+		xQueueSend(g_pipe.scores, &result, portMAX_DELAY);
+	}
+
+	xSemaphoreGive(g_pipe.done);
+	vTaskDelete(NULL);
+}
+
+static void pipe_destroy(void)
+{
+	if (g_pipe.angles) {
+		vQueueDelete(g_pipe.angles);
+	}
+	if (g_pipe.frames) {
+		vQueueDelete(g_pipe.frames);
+	}
+	if (g_pipe.scores) {
+		vQueueDelete(g_pipe.scores);
+	}
+	if (g_pipe.slots) {
+		vSemaphoreDelete(g_pipe.slots);
+	}
+	if (g_pipe.done) {
+		vSemaphoreDelete(g_pipe.done);
+	}
+
+	memset(&g_pipe, 0, sizeof(g_pipe));
+}
+
+static esp_err_t pipe_create(void)
+{
+	const UBaseType_t max_angles = MAX_ANGLE - MIN_ANGLE + 1;
+	TaskHandle_t capture_task, score_task;
+
+	memset(&g_pipe, 0, sizeof(g_pipe));
+
+	g_pipe.angles = xQueueCreate(max_angles + 1, sizeof(int16_t));
+	g_pipe.frames = xQueueCreate(PIPE_FRAME_SLOTS, sizeof(pipe_frame_t));
+	g_pipe.scores = xQueueCreate(max_angles, sizeof(pipe_score_t));
+	g_pipe.slots = xSemaphoreCreateCounting(PIPE_FRAME_SLOTS, PIPE_FRAME_SLOTS);
+	g_pipe.done = xSemaphoreCreateCounting(2, 0);
+
+	if (!g_pipe.angles || !g_pipe.frames || !g_pipe.scores || !g_pipe.slots ||
+			!g_pipe.done) {
+		pipe_destroy();
+		return ESP_ERR_NO_MEM;
+	}
+
+	if (xTaskCreatePinnedToCore(pipe_capture_task, "pipe_capture",
+			PIPE_TASK_STACK, NULL, PIPE_TASK_PRIORITY, &capture_task,
+			PIPE_CAPTURE_CORE) != pdPASS) {
+		pipe_destroy();
+		return ESP_ERR_NO_MEM;
+	}
+	// Their captures count towards the command running the sweep
+	perf_share(capture_task);
+
+	if (xTaskCreatePinnedToCore(pipe_score_task, "pipe_score",
+			PIPE_TASK_STACK, NULL, PIPE_TASK_PRIORITY, &score_task,
+			PIPE_SCORE_CORE) != pdPASS) {
+		const int16_t stop = PIPE_STOP;
+		pipe_frame_t item;
+
+		// Nobody consumes the stop frame, take it out so the task can exit
+		xQueueSend(g_pipe.angles, &stop, portMAX_DELAY);
+		xQueueReceive(g_pipe.frames, &item, portMAX_DELAY);
+		xSemaphoreTake(g_pipe.done, portMAX_DELAY);
+		pipe_destroy();
+		return ESP_ERR_NO_MEM;
+	}
+	perf_share(score_task);
+
+	return ESP_OK;
+}
+
+static void pipe_stop(void)
+{
+	const int16_t stop = PIPE_STOP;
+
+	xQueueSend(g_pipe.angles, &stop, portMAX_DELAY);
+
+	xSemaphoreTake(g_pipe.done, portMAX_DELAY);
+	xSemaphoreTake(g_pipe.done, portMAX_DELAY);
+}
+
+esp_err_t search_set_reference(const camera_fb_t *reference)
+{
+	search_clear_reference();
+
+	ESP_ERROR_RETURN(frame_desc(reference, &g_ref.desc));
+
+	g_ref.buf = reference->buf;
+	g_ref.timestamp = reference->timestamp;
+	g_ref.valid = true;
+
+	ESP_LOGI(TAG, "Reference descriptor cached (%zu bytes, area %u)",
+		sizeof(g_ref.desc), g_ref.desc.area);
+
+	return ESP_OK;
+}
+
+void search_clear_reference(void)
+{
+	g_ref.valid = false;
+	g_ref.buf = NULL;
+
+	free(g_ref.spectrum);
+	g_ref.spectrum = NULL;
+}
+
+/*
+ * Scores the still unscored angles lo..hi in `step`s of one pass into
+ * `scores`, counting the captures
+ */
+typedef esp_err_t (*pass_scorer_t)(float *scores, int16_t lo, int16_t hi, uint8_t step,
+	uint16_t *captures);
+
+static esp_err_t score_pass(float *scores, int16_t lo, int16_t hi, uint8_t step,
+	uint16_t *captures)
+{
+	for (int16_t a = lo; a <= hi; a += step) {
+		if (scores[a] == UNSCORED) {
+			ESP_ERROR_RETURN(command_cancelled() ? ESP_ERR_NOT_FINISHED :
+				score_angle(a, &scores[a]));
+			++*captures;
+		}
+	}
+
+	return ESP_OK;
+}
+
+/*
+ * Every pass is queued at once: the capture task moves the servo and grabs
+ * frame N+1 while the score task is still computing the descriptor of frame N
+ */
+static esp_err_t score_pass_pipelined(float *scores, int16_t lo, int16_t hi, uint8_t step,
+	uint16_t *captures)
+{
+	esp_err_t ret = ESP_OK;
+	uint16_t queued = 0;
+
+	// A pass already queued runs to its end
+	if (command_cancelled()) {
+		return ESP_ERR_NOT_FINISHED;
+	}
+
+	for (int16_t a = lo; a <= hi; a += step) {
+		if (scores[a] == UNSCORED) {
+			xQueueSend(g_pipe.angles, &a, portMAX_DELAY);
+			++queued;
+		}
+	}
+
+	// Collect the whole pass even after an error, the tasks must drain
+	for (uint16_t i = 0; i < queued; ++i) {
+		pipe_score_t score;
+
+		xQueueReceive(g_pipe.scores, &score, portMAX_DELAY);
+		scores[score.angle] = score.score;
+		++*captures;
+
+		if (score.err != ESP_OK && ret == ESP_OK) {
+			ret = score.err;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * The passes of g_steps, each scored by `score` and narrowed around the best
+ * angle so far, then the servo is moved to the best one and left there
+ */
+static esp_err_t sweep(const camera_fb_t *reference, pass_scorer_t score,
+	search_result_t *result)
+{
+	esp_err_t ret = ESP_OK;
+
+	if (!is_cached(reference)) {
+		ESP_ERROR_RETURN(search_set_reference(reference));
+	}
+
+	float *scores = malloc((MAX_ANGLE + 1) * sizeof(float));
+	if (!scores) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (int16_t a = MIN_ANGLE; a <= MAX_ANGLE; ++a) {
+		scores[a] = UNSCORED;
+	}
+
+	int16_t best = MIN_ANGLE;
+	int16_t lo = MIN_ANGLE, hi = MAX_ANGLE;
+
+	for (size_t pass = 0; pass < sizeof(g_steps); ++pass) {
+		ret = score(scores, lo, hi, g_steps[pass], &result->captures);
+		if (ret != ESP_OK) {
+			goto cleanup;
+		}
+
+		for (int16_t a = lo; a <= hi; a += g_steps[pass]) {
+			if (scores[a] < scores[best]) {
+				best = a;
+			}
+		}
+
+		if (pass + 1 < sizeof(g_steps)) {
+			int16_t window = g_steps[pass] - g_steps[pass + 1];
+
+			lo = best - window < MIN_ANGLE ? MIN_ANGLE : best - window;
+			hi = best + window > MAX_ANGLE ? MAX_ANGLE : best + window;
+		}
+	}
+
+	// Done only once the servo is there, like `rotate rand`
+	ret = set_servo_angle(best, false);
+	if (ret == ESP_OK) {
+		ret = servo_wait(SERVO_WAIT_MS);
+	}
+
+	result->angle = best;
+	result->score = scores[best];
+
+cleanup:
+	free(scores);
+
+	return ret;
+}
+
+esp_err_t search_angle_sweep(const camera_fb_t *reference, search_result_t *result)
+{
+	const int64_t start = esp_timer_get_time();
+
+	memset(result, 0, sizeof(*result));
+
+	esp_err_t ret = sweep(reference, score_pass, result);
+
+	result->elapsed_us = esp_timer_get_time() - start;
+
+	return ret;
+}
+
+/*
+ * Same passes as search_angle_sweep(), capturing and scoring on two tasks. The
+ * pipeline's frames are why the camera has a third frame buffer, see
+ * CAMERA_FB_COUNT.
+ */
+esp_err_t search_angle_pipelined(const camera_fb_t *reference, search_result_t *result)
+{
+	const int64_t start = esp_timer_get_time();
+
+	memset(result, 0, sizeof(*result));
+
+	ESP_ERROR_RETURN(pipe_create());
+
+	esp_err_t ret = sweep(reference, score_pass_pipelined, result);
+
+	pipe_stop();
+
+	result->capture_stall_us = g_pipe.capture_stall_us;
+	result->score_stall_us = g_pipe.score_stall_us;
+
+	pipe_destroy();
+
+	result->elapsed_us = esp_timer_get_time() - start;
+
+	return ret;
+}
+
+/*
+ * Estimate the rotation between the reference and a live frame directly, move
+ * the servo once to cancel it and verify with one more capture. Only when the
+ * verification still shows a residual rotation (e.g. the servo-to-image gain
+ * was wrong) a correction move follows. ESP_ERR_INVALID_RESPONSE when the
+ * residual is still above PHASE_TOLERANCE_DEG after the corrections (or the
+ * servo is at the end of its range), ESP_ERR_NOT_FOUND when an estimate
+ * isn't confident enough; `result` has the angle and residual either way.
+ */
+esp_err_t search_angle_phase(const camera_fb_t *reference, search_result_t *result)
+{
+	const int64_t start = esp_timer_get_time();
+	esp_err_t ret = ESP_OK;
+
+	memset(result, 0, sizeof(*result));
+
+	if (!is_cached(reference)) {
+		ESP_ERROR_RETURN(search_set_reference(reference));
+	}
+
+	if (!g_ref.spectrum) {
+		g_ref.spectrum = malloc(sizeof(rot_spectrum_t));
+		if (!g_ref.spectrum) {
+			return ESP_ERR_NO_MEM;
+		}
+
+		ret = frame_spectrum(reference, g_ref.spectrum);
+		if (ret != ESP_OK) {
+			free(g_ref.spectrum);
+			g_ref.spectrum = NULL;
+			return ret;
+		}
+	}
+
+	rot_spectrum_t *live_spectrum = malloc(sizeof(rot_spectrum_t));
+	if (!live_spectrum) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	int16_t ddeg = get_servo_angle_ddeg();
+
+	// An earlier move (`rotate`) may still be running
+	ret = servo_wait(SERVO_WAIT_MS);
+	if (ret == ESP_OK) {
+		ret = capture_spectrum(live_spectrum);
+	}
+	if (ret != ESP_OK) {
+		goto cleanup;
+	}
+	++result->captures;
+
+	float rotation = rot_estimate(g_ref.spectrum, live_spectrum, &result->confidence);
+	result->rotation = rotation;
+
+	if (result->confidence < MIN_CONFIDENCE) {
+		ret = ESP_ERR_NOT_FOUND;
+		goto cleanup;
+	}
+
+	for (uint8_t i = 0; i < MAX_CORRECTIONS && result->confidence >= MIN_CONFIDENCE &&
+			fabsf(rotation) > PHASE_TOLERANCE_DEG; ++i) {
+		int16_t target = clamp_angle((float)ddeg / SERVO_DDEG_PER_DEG -
+			rotation / g_image_deg_per_servo_deg);
+		if (target == ddeg) {
+			break;
+		}
+		if (command_cancelled()) {
+			ret = ESP_ERR_NOT_FINISHED;
+			goto cleanup;
+		}
+
+		ret = move_servo(target);
+		if (ret != ESP_OK) {
+			goto cleanup;
+		}
+
+		ret = capture_spectrum(live_spectrum);
+		if (ret != ESP_OK) {
+			goto cleanup;
+		}
+		++result->captures;
+
+		float residual = rot_estimate(g_ref.spectrum, live_spectrum, &result->confidence);
+
+		// Learn the gain from what the move actually did, ignore implausible ones
+		float gain = (rotation - residual) * SERVO_DDEG_PER_DEG / (ddeg - target);
+		if (result->confidence >= MIN_CONFIDENCE &&
+				fabsf(gain) > 0.5f && fabsf(gain) < 2.0f) {
+			g_image_deg_per_servo_deg = gain;
+		}
+
+		ESP_LOGI(TAG, "Moved %.1f -> %.1f: rotation %.2f -> %.2f (gain %.2f)",
+			(float)ddeg / SERVO_DDEG_PER_DEG, (float)target / SERVO_DDEG_PER_DEG,
+			rotation, residual, g_image_deg_per_servo_deg);
+
+		ddeg = target;
+		rotation = residual;
+	}
+
+	result->angle = (float)ddeg / SERVO_DDEG_PER_DEG;
+	result->score = fabsf(rotation);
+
+	if (result->confidence < MIN_CONFIDENCE) {
+		ret = ESP_ERR_NOT_FOUND;
+	} else if (result->score > PHASE_TOLERANCE_DEG) {
+		ret = ESP_ERR_INVALID_RESPONSE;
+	}
+
+cleanup:
+	result->elapsed_us = esp_timer_get_time() - start;
+
+	free(live_spectrum);
+
+	return ret;
+}
+
+/*
+ * Record what the camera sees every `step` degrees over the whole servo range
+ * (the last position is always MAX_ANGLE) and save it as the calibration
+ * index for the current camera settings.
+ */
+esp_err_t search_calibrate(uint8_t step, search_result_t *result, calib_info_t *info)
+{
+	const int64_t start = esp_timer_get_time();
+	esp_err_t ret;
+
+	memset(result, 0, sizeof(*result));
+
+	ESP_ERROR_RETURN(calib_begin(step, get_camera_config_id()));
+
+	for (int16_t a = MIN_ANGLE; a < MAX_ANGLE + step; a += step) {
+		shape_desc_t desc;
+		int16_t angle = a > MAX_ANGLE ? MAX_ANGLE : a;
+
+		ret = command_cancelled() ? ESP_ERR_NOT_FINISHED :
+			capture_desc_at(angle * SERVO_DDEG_PER_DEG, &desc);
+		if (ret == ESP_OK) {
+			ret = calib_add(angle, &desc.sig);
+		}
+		if (ret != ESP_OK) {
+			calib_abort();
+			return ret;
+		}
+		++result->captures;
+
+		ESP_LOGI(TAG, "Calibrated angle %d (area %u)", angle, desc.area);
+	}
+
+	ret = calib_commit(info);
+	if (ret != ESP_OK) {
+		calib_abort();
+	}
+
+	result->elapsed_us = esp_timer_get_time() - start;
+
+	return ret;
+}
+
+/*
+ * The reference signature looked up in the calibration index gives the servo
+ * angle directly, a single shot there confirms it. ESP_ERR_INVALID_STATE
+ * means the index is stale: the camera settings changed since `calibrate` or
+ * the confirmation didn't match (rig or object moved).
+ */
+esp_err_t search_angle_index(const camera_fb_t *reference, search_result_t *result)
+{
+	const int64_t start = esp_timer_get_time();
+	esp_err_t ret = ESP_OK;
+	shape_desc_t live;
+	float angle;
+
+	memset(result, 0, sizeof(*result));
+
+	if (!is_cached(reference)) {
+		ret = search_set_reference(reference);
+	}
+	if (ret == ESP_OK) {
+		ret = calib_lookup(get_camera_config_id(), &g_ref.desc.sig,
+			&angle, &result->score);
+	}
+	if (ret == ESP_OK && result->score > INDEX_MAX_DISTANCE) {
+		ret = ESP_ERR_NOT_FOUND;
+	}
+	if (ret != ESP_OK) {
+		goto done;
+	}
+
+	const int16_t ddeg = clamp_angle(angle);
+	result->angle = (float)ddeg / SERVO_DDEG_PER_DEG;
+
+	ret = capture_desc_at(ddeg, &live);
+	if (ret != ESP_OK) {
+		goto done;
+	}
+	++result->captures;
+
+	result->score = desc_distance(&g_ref.desc, &live);
+
+	ESP_LOGI(TAG, "Index angle %.1f, confirmation score %.3f", angle, result->score);
+
+	if (result->score > INDEX_MAX_DISTANCE) {
+		ret = ESP_ERR_INVALID_STATE;
+	}
+
+done:
+	result->elapsed_us = esp_timer_get_time() - start;
+
+	return ret;
+}
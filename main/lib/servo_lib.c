@@ -1,33 +1,106 @@
+#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_timer.h>
+#include <nvs.h>
 #include <driver/ledc.h>
 #include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "servo_lib.h"
 
 #define PWM_GPIO GPIO_NUM_14
 #define LEDC_TIMER LEDC_TIMER_2
 #define LEDC_CHANNEL LEDC_CHANNEL_7
 #define LEDC_SPEED LEDC_LOW_SPEED_MODE
 #define FREQ 50
-#define MAX_ANGLE 180.0f
-#define MIN_WIDTH_US 500
-#define MAX_WIDTH_US 2500
 #define DUTY_RESOLUTION LEDC_TIMER_14_BIT
-#define SEC_TO_US 1000000.0f
+#define FULL_DUTY ((1 << DUTY_RESOLUTION) - 1)
+#define SEC_TO_US 1000000ULL
+
+#define NVS_NAMESPACE "servo"
+#define NVS_KEY "pulse"
+
+/*
+ * Moves follow a trapezoid: accelerate, cruise at the speed the SG90 can
+ * keep up with, brake. One setpoint per PWM period, the servo reads no
+ * faster. After the last setpoint the shaft needs a while to settle, longer
+ * the further it came.
+ */
+#define SERVO_SPEED 600.0f       // deg/s
+#define SERVO_ACCEL 10000.0f     // deg/s^2
+#define SERVO_TICK_MS (1000 / FREQ)
+#define SERVO_SETTLE_BASE_MS 20
+#define SERVO_SETTLE_US_PER_DEG 100
+
+// Above the camera and the pipeline, a late setpoint jerks the shaft
+#define SERVO_TASK_STACK 3072
+#define SERVO_TASK_PRIORITY 6
+
+#define SERVO_STILL (1 << 0)
 
 
 static const char *TAG = "servo_lib";
 
-static uint16_t g_full_duty = 0;
-static uint16_t g_cur_angle = 0;
+typedef struct {
+	uint16_t min_us;
+	uint16_t max_us;
+} pulse_range_t;
 
+static struct {
+	SemaphoreHandle_t lock;
+	SemaphoreHandle_t wake;   // a new move for the task
+	EventGroupHandle_t events;
+	int16_t target;
+	uint32_t moves;
+	int64_t still_us;         // predicted, for servo_still_in_ms()
+	pulse_range_t pulse;
+	uint16_t duty[SERVO_MAX_DDEG + 1];  // per ddeg, built from `pulse`
+} g_servo;
 
-static uint32_t angle_to_duty(uint16_t angle)
+static void servo_task(void *arg);
+
+
+static void build_duty_table(void)
 {
-	float angle_us = angle / MAX_ANGLE * (MAX_WIDTH_US - MIN_WIDTH_US) + MIN_WIDTH_US;
+	for (uint32_t ddeg = 0; ddeg <= SERVO_MAX_DDEG; ++ddeg) {
+		// Pulse width times SERVO_MAX_DDEG, integer up to the rounding
+		const uint64_t width = (uint64_t)g_servo.pulse.min_us * SERVO_MAX_DDEG +
+			(uint64_t)(g_servo.pulse.max_us - g_servo.pulse.min_us) * ddeg;
 
-	return (uint32_t)(g_full_duty * angle_us * FREQ / SEC_TO_US);
+		g_servo.duty[ddeg] = (width * FULL_DUTY * FREQ + SERVO_MAX_DDEG * SEC_TO_US / 2) /
+			(SERVO_MAX_DDEG * SEC_TO_US);
+	}
+}
+
+static bool pulse_range_valid(const pulse_range_t *pulse)
+{
+	return pulse->min_us >= SERVO_PULSE_LIMIT_MIN_US &&
+		pulse->max_us <= SERVO_PULSE_LIMIT_MAX_US &&
+		pulse->min_us + SERVO_PULSE_MIN_SPAN_US <= pulse->max_us;
+}
+
+static esp_err_t load_pulse_range(pulse_range_t *pulse)
+{
+	nvs_handle_t handle;
+
+	ESP_ERROR_RETURN(nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle));
+
+	size_t size = sizeof(*pulse);
+	esp_err_t ret = nvs_get_blob(handle, NVS_KEY, pulse, &size);
+	nvs_close(handle);
+
+	if (ret == ESP_OK && (size != sizeof(*pulse) || !pulse_range_valid(pulse))) {
+		ret = ESP_ERR_INVALID_SIZE;
+	}
+
+	return ret;
 }
 
 esp_err_t init_servo(void)
@@ -42,43 +115,304 @@ esp_err_t init_servo(void)
 
 	ESP_ERROR_CHECK(ledc_timer_config(&timer_conf));
 
+	esp_err_t ret = load_pulse_range(&g_servo.pulse);
+	if (ret != ESP_OK) {
+		if (ret != ESP_ERR_NVS_NOT_FOUND) {
+			ESP_LOGW(TAG, "Stored pulse range unusable (%s), using the default",
+				esp_err_to_name(ret));
+		}
+		g_servo.pulse.min_us = SERVO_DEFAULT_MIN_PULSE_US;
+		g_servo.pulse.max_us = SERVO_DEFAULT_MAX_PULSE_US;
+	}
+	build_duty_table();
+
 	ledc_channel_config_t channel_conf = {
 		.intr_type = LEDC_INTR_DISABLE,
 		.timer_sel = LEDC_TIMER,
 		.channel = LEDC_CHANNEL,
 		.speed_mode = LEDC_SPEED,
 		.gpio_num = PWM_GPIO,
-		.duty = angle_to_duty(g_cur_angle),
+		.duty = g_servo.duty[g_servo.target],
 		.hpoint = 0
 	};
 
 	ESP_ERROR_CHECK(ledc_channel_config(&channel_conf));
 
-	g_full_duty = (1 << DUTY_RESOLUTION) - 1;
+	// From wherever the shaft was at power-on, the task waits the worst case
+	g_servo.moves = 1;
+	g_servo.still_us = esp_timer_get_time() + servo_move_ms(0, SERVO_MAX_DDEG) * 1000LL;
+
+	g_servo.lock = xSemaphoreCreateMutex();
+	g_servo.wake = xSemaphoreCreateBinary();
+	g_servo.events = xEventGroupCreate();
+	if (!g_servo.lock || !g_servo.wake || !g_servo.events) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	if (xTaskCreate(servo_task, "servo", SERVO_TASK_STACK, NULL,
+			SERVO_TASK_PRIORITY, NULL) != pdPASS) {
+		return ESP_ERR_NO_MEM;
+	}
 
-	ESP_LOGI(TAG, "Servo motor is initiated");
+	ESP_LOGI(TAG, "Servo motor is initiated (pulse %u-%u us)",
+		g_servo.pulse.min_us, g_servo.pulse.max_us);
 
 	return ESP_OK;
 }
 
-esp_err_t set_servo_angle(int16_t angle, bool relative)
+/*
+ * Predicted time from the start of a move (from rest) until the shaft is
+ * still on the target
+ */
+uint32_t servo_move_ms(int16_t from_ddeg, int16_t to_ddeg)
 {
-	if (relative) {
-		angle += g_cur_angle;
+	const float distance = abs(to_ddeg - from_ddeg) / (float)SERVO_DDEG_PER_DEG;
+	float profile_ms;
+
+	// Too short to reach full speed: accelerates half way, brakes the rest
+	if (distance < SERVO_SPEED * SERVO_SPEED / SERVO_ACCEL) {
+		profile_ms = 2000.0f * sqrtf(distance / SERVO_ACCEL);
+	} else {
+		profile_ms = 1000.0f * (distance / SERVO_SPEED + SERVO_SPEED / SERVO_ACCEL);
 	}
 
-	if (angle < 0 || angle > MAX_ANGLE) {
+	// The profile ends on a step
+	return (uint32_t)ceilf(profile_ms / SERVO_TICK_MS) * SERVO_TICK_MS +
+		SERVO_SETTLE_BASE_MS + distance * SERVO_SETTLE_US_PER_DEG / 1000;
+}
+
+/*
+ * Starts moving to `ddeg` and returns right away, servo_wait() blocks until
+ * the shaft is still. A move asked for during another one takes over from
+ * where the setpoint is, without stopping first.
+ */
+esp_err_t set_servo_angle_ddeg(int16_t ddeg, bool relative)
+{
+	xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+
+	// In int, a relative move can't wrap
+	const int angle = relative ? g_servo.target + ddeg : ddeg;
+
+	if (angle < 0 || angle > SERVO_MAX_DDEG) {
+		xSemaphoreGive(g_servo.lock);
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	uint32_t duty = angle_to_duty((uint16_t)angle);
+	const int64_t now = esp_timer_get_time();
+	const uint32_t move_ms = servo_move_ms(g_servo.target, angle);
 
-	ESP_ERROR_RETURN(ledc_set_duty(LEDC_SPEED, LEDC_CHANNEL, duty));
-	ESP_ERROR_RETURN(ledc_update_duty(LEDC_SPEED, LEDC_CHANNEL));
+	xEventGroupClearBits(g_servo.events, SERVO_STILL);
+	g_servo.still_us = (g_servo.still_us > now ? g_servo.still_us : now) +
+		move_ms * 1000LL;
+	g_servo.target = angle;
+	++g_servo.moves;
 
-	g_cur_angle = (uint16_t)angle;
+	xSemaphoreGive(g_servo.lock);
 
-	ESP_LOGI(TAG, "Servo angle changed: %u", g_cur_angle);
+	xSemaphoreGive(g_servo.wake);
+
+	ESP_LOGI(TAG, "Servo moving to %d.%d, still in ~%lu ms", angle / SERVO_DDEG_PER_DEG,
+		angle % SERVO_DDEG_PER_DEG, (unsigned long)move_ms);
 
 	return ESP_OK;
 }
+
+esp_err_t set_servo_angle(int16_t angle, bool relative)
+{
+	if (angle < -SERVO_MAX_DDEG / SERVO_DDEG_PER_DEG ||
+			angle > SERVO_MAX_DDEG / SERVO_DDEG_PER_DEG) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	return set_servo_angle_ddeg(angle * SERVO_DDEG_PER_DEG, relative);
+}
+
+int16_t get_servo_angle_ddeg(void)
+{
+	return g_servo.target;
+}
+
+int16_t get_servo_angle(void)
+{
+	return (g_servo.target + SERVO_DDEG_PER_DEG / 2) / SERVO_DDEG_PER_DEG;
+}
+
+/*
+ * Stores the pulse widths this unit needs for 0 and 180° and moves the shaft
+ * to where the current angle is under them
+ */
+esp_err_t servo_set_pulse_range(uint16_t min_us, uint16_t max_us)
+{
+	const pulse_range_t pulse = {min_us, max_us};
+	nvs_handle_t handle;
+
+	if (!pulse_range_valid(&pulse)) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	ESP_ERROR_RETURN(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle));
+
+	esp_err_t ret = nvs_set_blob(handle, NVS_KEY, &pulse, sizeof(pulse));
+	if (ret == ESP_OK) {
+		ret = nvs_commit(handle);
+	}
+	nvs_close(handle);
+	ESP_ERROR_RETURN(ret);
+
+	xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+	g_servo.pulse = pulse;
+	build_duty_table();
+	xSemaphoreGive(g_servo.lock);
+
+	ESP_LOGI(TAG, "Pulse range set to %u-%u us", min_us, max_us);
+
+	// A move of 0 puts out the new duty and waits for the shaft to settle
+	return set_servo_angle_ddeg(0, true);
+}
+
+void servo_get_pulse_range(uint16_t *min_us, uint16_t *max_us)
+{
+	xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+	*min_us = g_servo.pulse.min_us;
+	*max_us = g_servo.pulse.max_us;
+	xSemaphoreGive(g_servo.lock);
+}
+
+/*
+ * Blocks until the last move has finished and the shaft has settled,
+ * ESP_ERR_TIMEOUT if that takes longer than `timeout_ms`
+ */
+esp_err_t servo_wait(uint32_t timeout_ms)
+{
+	perf_start(PERF_SERVO);
+	const EventBits_t bits = xEventGroupWaitBits(g_servo.events, SERVO_STILL,
+				pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+	perf_stop(PERF_SERVO);
+
+	return bits & SERVO_STILL ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/*
+ * The predicted time left until the shaft is still, 0 when it is
+ */
+uint32_t servo_still_in_ms(void)
+{
+	if (xEventGroupGetBits(g_servo.events) & SERVO_STILL) {
+		return 0;
+	}
+
+	xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+	const int64_t left = g_servo.still_us - esp_timer_get_time();
+	xSemaphoreGive(g_servo.lock);
+
+	// Late on the prediction, at least one more step
+	return left > 0 ? left / 1000 : SERVO_TICK_MS;
+}
+
+static void set_duty(float angle)
+{
+	const long ddeg = lroundf(angle * SERVO_DDEG_PER_DEG);
+
+	xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+	const uint32_t duty = g_servo.duty[ddeg < 0 ? 0 : ddeg > SERVO_MAX_DDEG ? SERVO_MAX_DDEG : ddeg];
+	xSemaphoreGive(g_servo.lock);
+
+	esp_err_t ret = ledc_set_duty(LEDC_SPEED, LEDC_CHANNEL, duty);
+
+	if (ret == ESP_OK) {
+		ret = ledc_update_duty(LEDC_SPEED, LEDC_CHANNEL);
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Setting the duty failed: %s", esp_err_to_name(ret));
+	}
+}
+
+/*
+ * Advances the setpoint one step towards `goal`, returns false once it's there
+ */
+static bool profile_step(float *pos, float *vel, float goal)
+{
+	const float dt = SERVO_TICK_MS / 1000.0f;
+	const float remaining = fabsf(goal - *pos);
+	const float dir = goal < *pos ? -1.0f : 1.0f;
+	float speed = *vel * dir;  // negative while moving away from the goal
+
+	// Brakes once stopping takes all the way left, creeping the last bit
+	if (speed > 0 && speed * speed / (2 * SERVO_ACCEL) >= remaining) {
+		speed = fmaxf(speed - SERVO_ACCEL * dt, SERVO_ACCEL * dt);
+	} else {
+		speed = fminf(speed + SERVO_ACCEL * dt, SERVO_SPEED);
+	}
+
+	if (speed > 0 && speed * dt >= remaining) {
+		*pos = goal;
+		*vel = 0;
+		return false;
+	}
+
+	*pos += dir * speed * dt;
+	*vel = dir * speed;
+
+	return true;
+}
+
+static void servo_task(void *arg)
+{
+	TickType_t wake = xTaskGetTickCount();
+	float pos = 0, vel = 0, goal = 0;
+	int64_t settled_us = 0;
+	uint32_t settle_us = 0;
+	uint32_t seen = 0;    // moves taken over
+	bool known = false;   // where the shaft is, not before the power-on move
+	bool moving = false;
+
+	for (;;) {
+		const int64_t now = esp_timer_get_time();
+
+		xSemaphoreTake(g_servo.lock, portMAX_DELAY);
+		const float target = g_servo.target / (float)SERVO_DDEG_PER_DEG;
+		const uint32_t moves = g_servo.moves;
+		const bool still = moves == seen && !moving && now >= settled_us;
+		if (still) {
+			xEventGroupSetBits(g_servo.events, SERVO_STILL);
+		}
+		xSemaphoreGive(g_servo.lock);
+
+		if (still) {
+			xSemaphoreTake(g_servo.wake, portMAX_DELAY);
+			wake = xTaskGetTickCount();
+			continue;
+		}
+
+		if (moves != seen && !known) {
+			// Since power-on the shaft could be anywhere: jumps, the worst case settle
+			pos = goal = target;
+			set_duty(pos);
+			settled_us = now + servo_move_ms(0, SERVO_MAX_DDEG) * 1000LL;
+			seen = moves;
+			known = true;
+			continue;
+		}
+
+		if (moves != seen) {
+			settle_us = SERVO_SETTLE_BASE_MS * 1000 +
+				fabsf(target - pos) * SERVO_SETTLE_US_PER_DEG;
+			goal = target;
+			seen = moves;
+			moving = true;
+		}
+
+		if (moving) {
+			moving = profile_step(&pos, &vel, goal);
+			set_duty(pos);
+			if (!moving) {
+				settled_us = esp_timer_get_time() + settle_us;
+			}
+			vTaskDelayUntil(&wake, pdMS_TO_TICKS(SERVO_TICK_MS));
+		} else {
+			// Settling, a new move cuts it short
+			xSemaphoreTake(g_servo.wake, pdMS_TO_TICKS((settled_us - now) / 1000) + 1);
+			wake = xTaskGetTickCount();
+		}
+	}
+}
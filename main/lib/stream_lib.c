@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_camera.h>
+#include "esp_err_ext.h"
+#include "camera_lib.h"
+#include "encode_lib.h"
+#include "stream_lib.h"
+
+#define STREAM_TASK_STACK 6144
+#define STREAM_TASK_PRIORITY 1
+// How often the idle server checks for stream_stop()
+#define STREAM_POLL_MS 200
+#define STREAM_IO_TIMEOUT_MS 2000
+#define STREAM_REQUEST_LEN 256
+/*
+ * A part still not on the wire after STREAM_FRAME_DEADLINE_MS drops the
+ * client (cutting it short would break the multipart stream) and with it
+ * the frame, so that's the longest a command waits for the camera. Encoded
+ * frames larger than STREAM_MAX_JPEG_LEN are dropped.
+ */
+#define STREAM_FRAME_DEADLINE_MS 1000
+#define STREAM_MAX_JPEG_LEN (256 * 1024)
+#define STREAM_PART_HEADER_LEN 128
+
+#define BOUNDARY "frame"
+
+
+static const char *TAG = "stream_lib";
+
+static struct stream_state {
+	volatile bool running;
+	int listen_sockfd;
+	SemaphoreHandle_t done;
+	stream_stats_t stats;
+} g_stream = {
+	.listen_sockfd = -1,
+	.stats = {.fps = STREAM_DEFAULT_FPS, .scale = 1}
+};
+
+typedef enum {
+	STREAM_MJPEG,
+	STREAM_RAW
+} stream_mode_t;
+
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	size_t size;  // the largest frame so far
+} stream_jpeg_t;
+
+
+static void stream_task(void *arg);
+
+
+esp_err_t stream_start(uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+	int reuse = 1;
+
+	if (g_stream.running) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sockfd < 0) {
+		return ESP_FAIL;
+	}
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(sockfd, 1)) {
+		ESP_LOGE(TAG, "Can't listen on port %u: %s", port, strerror(errno));
+		close(sockfd);
+		return ESP_FAIL;
+	}
+
+	if (!g_stream.done) {
+		g_stream.done = xSemaphoreCreateBinary();
+		if (!g_stream.done) {
+			close(sockfd);
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	g_stream.listen_sockfd = sockfd;
+	g_stream.running = true;
+
+	if (xTaskCreate(stream_task, "stream", STREAM_TASK_STACK, NULL,
+			STREAM_TASK_PRIORITY, NULL) != pdPASS) {
+		g_stream.running = false;
+		close(sockfd);
+		return ESP_ERR_NO_MEM;
+	}
+
+	g_stream.stats.running = true;
+	ESP_LOGI(TAG, "Preview stream on port %u", port);
+
+	return ESP_OK;
+}
+
+/*
+ * Returns once the client is disconnected and the port closed
+ */
+esp_err_t stream_stop(void)
+{
+	if (!g_stream.running) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	g_stream.running = false;
+	xSemaphoreTake(g_stream.done, portMAX_DELAY);
+	g_stream.stats.running = false;
+
+	return ESP_OK;
+}
+
+esp_err_t stream_set_fps(uint8_t fps)
+{
+	if (fps < 1 || fps > STREAM_MAX_FPS) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	g_stream.stats.fps = fps;
+
+	return ESP_OK;
+}
+
+esp_err_t stream_set_scale(uint8_t scale)
+{
+	if (scale != 1 && scale != 2 && scale != 4) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	g_stream.stats.scale = scale;
+
+	return ESP_OK;
+}
+
+void stream_get_stats(stream_stats_t *stats)
+{
+	*stats = g_stream.stats;
+}
+
+/*
+ * Never blocks past `deadline_us`, ESP_ERR_TIMEOUT when the client took too long
+ */
+static esp_err_t send_all(int sockfd, const void *data, size_t len, int64_t deadline_us)
+{
+	const uint8_t *pos = data;
+
+	while (len) {
+		ssize_t sent = send(sockfd, pos, len, MSG_DONTWAIT);
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			const int64_t left_us = deadline_us - esp_timer_get_time();
+			struct timeval timeout = {left_us / 1000000, left_us % 1000000};
+			fd_set writefds;
+
+			if (left_us <= 0) {
+				return ESP_ERR_TIMEOUT;
+			}
+
+			FD_ZERO(&writefds);
+			FD_SET(sockfd, &writefds);
+			select(sockfd + 1, NULL, &writefds, NULL, &timeout);
+			continue;
+		}
+
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ESP_FAIL;
+		}
+
+		pos += sent;
+		len -= sent;
+		g_stream.stats.bytes += sent;
+	}
+
+	return ESP_OK;
+}
+
+static esp_err_t jpeg_reserve(stream_jpeg_t *jpeg, size_t size)
+{
+	if (size > STREAM_MAX_JPEG_LEN) {
+		size = STREAM_MAX_JPEG_LEN;
+	}
+
+	if (jpeg->size < size) {
+		heap_caps_free(jpeg->buf);
+		jpeg->buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+		if (!jpeg->buf) {
+			jpeg->buf = malloc(size);
+		}
+		jpeg->size = jpeg->buf ? size : 0;
+	}
+
+	return jpeg->buf ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t jpeg_sink(void *ctx, const void *data, size_t len)
+{
+	stream_jpeg_t *jpeg = ctx;
+
+	if (jpeg->len + len > jpeg->size) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	memcpy(jpeg->buf + jpeg->len, data, len);
+	jpeg->len += len;
+
+	return ESP_OK;
+}
+
+/*
+ * An encoding larger than the raw frame doesn't fit and is dropped
+ */
+static esp_err_t encode_jpeg(stream_jpeg_t *jpeg, const camera_fb_t *frame)
+{
+	ESP_ERROR_RETURN(jpeg_reserve(jpeg, frame->len));
+	jpeg->len = 0;
+
+	return enc_jpeg_stream(frame, STREAM_JPEG_QUALITY, jpeg_sink, jpeg);
+}
+
+/*
+ * Every `scale`th pixel of every `scale`th row into `dst`
+ */
+static void downscale(const camera_fb_t *src, uint8_t scale, camera_fb_t *dst)
+{
+	const uint8_t bpp = src->format == PIXFORMAT_GRAYSCALE ? 1 : 2;
+	uint8_t *out = dst->buf;
+
+	*dst = *src;
+	dst->buf = out;
+	dst->width = src->width / scale;
+	dst->height = src->height / scale;
+	dst->len = dst->width * dst->height * bpp;
+
+	for (size_t y = 0; y < dst->height; ++y) {
+		const uint8_t *row = src->buf + y * scale * src->width * bpp;
+
+		for (size_t x = 0; x < dst->width; ++x, out += bpp) {
+			memcpy(out, row + x * scale * bpp, bpp);
+		}
+	}
+}
+
+static bool client_writable(int sockfd)
+{
+	struct timeval timeout = {0, 0};
+	fd_set writefds;
+
+	FD_ZERO(&writefds);
+	FD_SET(sockfd, &writefds);
+
+	return select(sockfd + 1, NULL, &writefds, NULL, &timeout) > 0;
+}
+
+/*
+ * Anything the client sends after the request, EOF included, ends the stream
+ */
+static bool client_left(int sockfd)
+{
+	struct timeval timeout = {0, 0};
+	fd_set readfds;
+
+	FD_ZERO(&readfds);
+	FD_SET(sockfd, &readfds);
+
+	return select(sockfd + 1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+static int part_header(char *header, stream_mode_t mode, const camera_fb_t *frame,
+		size_t len)
+{
+	if (mode == STREAM_MJPEG) {
+		return snprintf(header, STREAM_PART_HEADER_LEN, "--" BOUNDARY "\r\n"
+			"Content-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", len);
+	}
+
+	return snprintf(header, STREAM_PART_HEADER_LEN, "--" BOUNDARY "\r\n"
+		"Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n"
+		"X-Width: %zu\r\nX-Height: %zu\r\nX-Format: %s\r\n\r\n",
+		len, frame->width, frame->height,
+		frame->format == PIXFORMAT_GRAYSCALE ? "gray" :
+		frame->format == PIXFORMAT_JPEG ? "jpeg" : "rgb565");
+}
+
+static esp_err_t send_part(int sockfd, const char *header, int header_len,
+		const uint8_t *data, size_t len)
+{
+	const int64_t deadline_us = esp_timer_get_time() + STREAM_FRAME_DEADLINE_MS * 1000LL;
+
+	ESP_ERROR_RETURN(send_all(sockfd, header, header_len, deadline_us));
+	ESP_ERROR_RETURN(send_all(sockfd, data, len, deadline_us));
+
+	return send_all(sockfd, "\r\n", 2, deadline_us);
+}
+
+static void stream_frames(int sockfd, stream_mode_t mode)
+{
+	const char *response = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n"
+		"Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+	camera_fb_t small = {0};
+	stream_jpeg_t jpeg = {0};
+	int64_t next_us = esp_timer_get_time();
+
+	if (send_all(sockfd, response, strlen(response),
+			next_us + STREAM_IO_TIMEOUT_MS * 1000LL) != ESP_OK) {
+		return;
+	}
+
+	while (g_stream.running && !client_left(sockfd)) {
+		const int64_t period_us = 1000000 / g_stream.stats.fps;
+		int64_t now = esp_timer_get_time();
+
+		if (now < next_us) {
+			vTaskDelay(pdMS_TO_TICKS((next_us - now) / 1000) + 1);
+			continue;
+		}
+		next_us = (next_us + period_us > now) ? next_us + period_us : now + period_us;
+
+		// A frame the client can't take now would only be late later
+		if (!client_writable(sockfd)) {
+			++g_stream.stats.dropped;
+			continue;
+		}
+
+		camera_fb_t *picture = take_preview();
+		if (!picture) {
+			++g_stream.stats.dropped;
+			continue;
+		}
+
+		const uint8_t scale = g_stream.stats.scale;
+		const camera_fb_t *frame = picture;
+		char header[STREAM_PART_HEADER_LEN];
+		esp_err_t ret = ESP_OK;
+
+		if (scale > 1 && picture->format != PIXFORMAT_JPEG) {
+			size_t size = picture->len / scale / scale;
+
+			if (small.len < size) {
+				free(small.buf);
+				small.buf = malloc(size);
+				small.len = small.buf ? size : 0;
+			}
+
+			if (small.buf) {
+				downscale(picture, scale, &small);
+				frame = &small;
+				free_preview(picture);
+				picture = NULL;
+			}
+		}
+
+		const uint8_t *data = frame->buf;
+		size_t len = frame->len;
+
+		// Only the encoding makes new bytes, the others go out from where they are
+		if (mode == STREAM_MJPEG && frame->format != PIXFORMAT_JPEG) {
+			ret = encode_jpeg(&jpeg, frame);
+			data = jpeg.buf;
+			len = jpeg.len;
+		}
+
+		const int header_len = part_header(header, mode, frame, len);
+
+		if (picture && data != picture->buf) {
+			free_preview(picture);
+			picture = NULL;
+		}
+
+		if (ret != ESP_OK) {
+			++g_stream.stats.dropped;
+			continue;
+		}
+
+		// Straight from the camera's buffer the lock is held until it's sent,
+		// STREAM_FRAME_DEADLINE_MS at most
+		ret = send_part(sockfd, header, header_len, data, len);
+
+		if (picture) {
+			free_preview(picture);
+		}
+
+		if (ret == ESP_ERR_TIMEOUT) {
+			ESP_LOGW(TAG, "Preview client too slow, dropped");
+		}
+		if (ret != ESP_OK) {
+			break;
+		}
+		++g_stream.stats.frames;
+	}
+
+	free(small.buf);
+	heap_caps_free(jpeg.buf);
+}
+
+static void serve_client(int sockfd)
+{
+	const struct timeval timeout = {
+		.tv_sec = STREAM_IO_TIMEOUT_MS / 1000,
+		.tv_usec = STREAM_IO_TIMEOUT_MS % 1000 * 1000
+	};
+	char request[STREAM_REQUEST_LEN];
+	size_t len = 0;
+	int nodelay = 1;
+
+	// Sends don't block, see send_all()
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	// The request line is all that matters, the headers are read and ignored
+	while (len < sizeof(request) - 1) {
+		ssize_t received = recv(sockfd, request + len, sizeof(request) - 1 - len, 0);
+		if (received <= 0) {
+			return;
+		}
+		len += received;
+		request[len] = '\0';
+
+		if (strstr(request, "\r\n\r\n")) {
+			break;
+		}
+	}
+
+	if (!strncmp(request, "GET / ", 6)) {
+		stream_frames(sockfd, STREAM_MJPEG);
+	} else if (!strncmp(request, "GET /raw ", 9)) {
+		stream_frames(sockfd, STREAM_RAW);
+	} else {
+		const char *response = "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n";
+		send_all(sockfd, response, strlen(response),
+			esp_timer_get_time() + STREAM_IO_TIMEOUT_MS * 1000LL);
+	}
+}
+
+static void stream_task(void *arg)
+{
+	while (g_stream.running) {
+		struct timeval timeout = {0, STREAM_POLL_MS * 1000};
+		fd_set readfds;
+
+		FD_ZERO(&readfds);
+		FD_SET(g_stream.listen_sockfd, &readfds);
+
+		if (select(g_stream.listen_sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+			continue;
+		}
+
+		int sockfd = accept(g_stream.listen_sockfd, NULL, NULL);
+		if (sockfd < 0) {
+			continue;
+		}
+
+		ESP_LOGI(TAG, "Preview client connected");
+		g_stream.stats.client = true;
+
+		serve_client(sockfd);
+
+		g_stream.stats.client = false;
+		close(sockfd);
+		ESP_LOGI(TAG, "Preview client left");
+	}
+
+	close(g_stream.listen_sockfd);
+	g_stream.listen_sockfd = -1;
+
+	xSemaphoreGive(g_stream.done);
+	vTaskDelete(NULL);
+}
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include "esp_err_ext.h"
+#include "perf_lib.h"
+#include "ftp_lib.h"
+#include "mqtt_lib.h"
+#include "encode_lib.h"
+#include "upload_lib.h"
+
+#define UPLOAD_TASK_STACK 4096
+#define UPLOAD_TASK_PRIORITY 2
+#define UPLOAD_BACKOFF_MS 1000
+#define UPLOAD_BACKOFF_MAX_MS 16000
+
+
+static const char *TAG = "upload_lib";
+
+typedef struct {
+	camera_fb_t picture;  // buf is owned by the job
+	char path[UPLOAD_PATH_LEN];
+	char tag[UPLOAD_TAG_LEN];
+	upload_transport_t transport;
+	enc_format_t format;
+	uint8_t quality;
+	int64_t queued_us;
+} upload_job_t;
+
+// One attempt's transfer
+typedef union {
+	ftp_stream_t ftp;
+	mqtt_stream_t mqtt;
+} transfer_t;
+
+// Times the sink, what's left of the encoder's run time is encoding
+typedef struct {
+	enc_sink_t write;
+	transfer_t *transfer;
+	int64_t sink_us;
+	esp_err_t ret;
+} timed_sink_t;
+
+static QueueHandle_t g_queue;
+static upload_done_cb_t g_done_cb;
+
+// Written from the job worker (`save` enqueues) and the upload task (drains)
+static portMUX_TYPE g_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static upload_stats_t g_stats = {.capacity = UPLOAD_QUEUE_LEN};
+
+static struct encoding {
+	enc_format_t format;
+	uint8_t quality;
+} g_encoding = {ENC_BMP, ENC_DEFAULT_QUALITY};
+
+static upload_transport_t g_transport = UPLOAD_FTP;
+
+
+static void upload_task(void *arg);
+static esp_err_t upload_picture(const upload_job_t *job, transfer_t *transfer,
+		int64_t *encode_us, bool *retry);
+static esp_err_t timed_sink(void *ctx, const void *data, size_t len);
+static esp_err_t ftp_sink(void *ctx, const void *data, size_t len);
+static esp_err_t mqtt_sink(void *ctx, const void *data, size_t len);
+
+
+esp_err_t upload_init(upload_done_cb_t done_cb)
+{
+	g_done_cb = done_cb;
+
+	g_queue = xQueueCreate(UPLOAD_QUEUE_LEN, sizeof(upload_job_t *));
+	if (!g_queue) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	if (xTaskCreate(upload_task, "upload", UPLOAD_TASK_STACK, NULL,
+			UPLOAD_TASK_PRIORITY, NULL) != pdPASS) {
+		vQueueDelete(g_queue);
+		g_queue = NULL;
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t upload_set_encoding(enc_format_t format, uint8_t quality)
+{
+	if (format >= ENC_FORMATS || quality < 1 || quality > 100) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	g_encoding.format = format;
+	g_encoding.quality = quality;
+
+	return ESP_OK;
+}
+
+void upload_get_encoding(enc_format_t *format, uint8_t *quality)
+{
+	*format = g_encoding.format;
+	*quality = g_encoding.quality;
+}
+
+/*
+ * Applies to pictures queued from now on
+ */
+esp_err_t upload_set_transport(upload_transport_t transport)
+{
+	if (transport >= UPLOAD_TRANSPORTS) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	g_transport = transport;
+
+	return ESP_OK;
+}
+
+upload_transport_t upload_get_transport(void)
+{
+	return g_transport;
+}
+
+const char *upload_transport_name(upload_transport_t transport)
+{
+	return transport == UPLOAD_MQTT ? "MQTT" : "FTP";
+}
+
+/*
+ * `path` receives the name the picture is stored under
+ */
+esp_err_t upload_enqueue(const camera_fb_t *picture, const char *name,
+		const char *tag, char path[UPLOAD_PATH_LEN])
+{
+	enc_format_t format = g_encoding.format;
+	const char *base = strrchr(name, '/');
+	bool full;
+	int len;
+
+	switch (picture->format) {
+	case PIXFORMAT_RGB565:
+	case PIXFORMAT_GRAYSCALE:
+	case PIXFORMAT_JPEG:
+		break;
+	default:
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	base = base ? base + 1 : name;
+
+	if (picture->format == PIXFORMAT_JPEG) {
+		format = ENC_JPEG;
+		len = snprintf(path, UPLOAD_PATH_LEN, "%s", name);
+	} else if (strchr(base, '.')) {
+		// An unknown extension keeps the name and the selected format
+		enc_format_from_name(base, &format);
+		len = snprintf(path, UPLOAD_PATH_LEN, "%s", name);
+	} else {
+		len = snprintf(path, UPLOAD_PATH_LEN, "%s.%s", name, enc_format_ext(format));
+	}
+
+	if (len >= UPLOAD_PATH_LEN || (tag && strlen(tag) >= UPLOAD_TAG_LEN)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	// The slot is taken before copying, so the queue never holds more copies
+	portENTER_CRITICAL(&g_stats_lock);
+	full = g_stats.depth >= UPLOAD_QUEUE_LEN;
+	if (full) {
+		++g_stats.dropped;
+	} else {
+		++g_stats.depth;
+		g_stats.bytes_pending += picture->len;
+	}
+	portEXIT_CRITICAL(&g_stats_lock);
+
+	if (full) {
+		ESP_LOGW(TAG, "Upload queue is full, %s dropped", path);
+		return ESP_ERR_TIMEOUT;
+	}
+
+	upload_job_t *job = malloc(sizeof(*job));
+	uint8_t *copy = heap_caps_malloc(picture->len, MALLOC_CAP_SPIRAM);
+	if (!copy) {
+		copy = malloc(picture->len);
+	}
+
+	if (!job || !copy) {
+		free(job);
+		heap_caps_free(copy);
+
+		portENTER_CRITICAL(&g_stats_lock);
+		--g_stats.depth;
+		g_stats.bytes_pending -= picture->len;
+		++g_stats.dropped;
+		portEXIT_CRITICAL(&g_stats_lock);
+
+		ESP_LOGE(TAG, "No memory for a copy of %zu bytes", picture->len);
+		return ESP_ERR_NO_MEM;
+	}
+
+	memcpy(copy, picture->buf, picture->len);
+	job->picture = *picture;
+	job->picture.buf = copy;
+	strcpy(job->path, path);
+	strcpy(job->tag, tag ? tag : "");
+	job->transport = g_transport;
+	job->format = format;
+	job->quality = g_encoding.quality;
+	job->queued_us = esp_timer_get_time();
+
+	// Can't block, a slot was reserved above
+	xQueueSend(g_queue, &job, 0);
+
+	return ESP_OK;
+}
+
+void upload_get_stats(upload_stats_t *stats)
+{
+	portENTER_CRITICAL(&g_stats_lock);
+	*stats = g_stats;
+	portEXIT_CRITICAL(&g_stats_lock);
+}
+
+static void upload_task(void *arg)
+{
+	upload_job_t *job;
+
+	for (;;) {
+		xQueueReceive(g_queue, &job, portMAX_DELAY);
+
+		// Times the FTP phases of the upload on its own, not as part of `save`
+		perf_begin("upload", esp_timer_get_time() - job->queued_us);
+
+		upload_result_t result = {0};
+		transfer_t transfer = {0};
+		uint32_t backoff_ms = UPLOAD_BACKOFF_MS;
+		bool retry = true;
+
+		strcpy(result.path, job->path);
+		strcpy(result.tag, job->tag);
+		result.transport = job->transport;
+		result.format = job->format;
+
+		while (++result.attempts <= UPLOAD_MAX_ATTEMPTS) {
+			result.err = upload_picture(job, &transfer, &result.encode_us, &retry);
+			if (job->transport == UPLOAD_MQTT) {
+				result.enqueue_retries += transfer.mqtt.enqueue_retries;
+			}
+			if (result.err == ESP_OK || !retry || result.attempts == UPLOAD_MAX_ATTEMPTS) {
+				break;
+			}
+
+			ESP_LOGW(TAG, "Uploading %s failed (%s), retrying in %lu ms", job->path,
+				esp_err_to_name(result.err), (unsigned long)backoff_ms);
+
+			portENTER_CRITICAL(&g_stats_lock);
+			++g_stats.retries;
+			portEXIT_CRITICAL(&g_stats_lock);
+
+			vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+			if (backoff_ms < UPLOAD_BACKOFF_MAX_MS) {
+				backoff_ms *= 2;
+			}
+		}
+
+		result.encode_failed = !retry;
+		if (job->transport == UPLOAD_MQTT) {
+			result.bytes = transfer.mqtt.sent;
+			result.chunks = transfer.mqtt.chunks;
+			result.elapsed_us = transfer.mqtt.elapsed_us;
+		} else {
+			result.bytes = transfer.ftp.sent;
+			result.elapsed_us = transfer.ftp.elapsed_us;
+		}
+		result.wait_us = esp_timer_get_time() - job->queued_us - result.elapsed_us;
+
+		portENTER_CRITICAL(&g_stats_lock);
+		--g_stats.depth;
+		g_stats.bytes_pending -= job->picture.len;
+		if (result.err == ESP_OK) {
+			++g_stats.completed;
+		} else {
+			++g_stats.failed;
+		}
+		portEXIT_CRITICAL(&g_stats_lock);
+
+		heap_caps_free(job->picture.buf);
+		free(job);
+
+		perf_end();
+
+		if (g_done_cb) {
+			g_done_cb(&result);
+		}
+	}
+}
+
+/*
+ * `retry` is cleared when the encoder itself failed, another attempt wouldn't
+ * do any better.
+ */
+static esp_err_t upload_picture(const upload_job_t *job, transfer_t *transfer,
+		int64_t *encode_us, bool *retry)
+{
+	const camera_fb_t *picture = &job->picture;
+	const bool mqtt = job->transport == UPLOAD_MQTT;
+	timed_sink_t sink = {mqtt ? mqtt_sink : ftp_sink, transfer, 0, ESP_OK};
+	esp_err_t ret;
+
+	*encode_us = 0;
+	*retry = true;
+
+	if (mqtt) {
+		ESP_ERROR_RETURN(mqtt_upload_begin(job->path, &transfer->mqtt));
+	} else {
+		ESP_ERROR_RETURN(ftp_upload_begin(job->path, &transfer->ftp));
+	}
+
+	if (picture->format == PIXFORMAT_JPEG) {
+		// Sent straight from the job's copy of the frame
+		ret = sink.write(transfer, picture->buf, picture->len);
+	} else {
+		// Encoded into a small buffer while being sent
+		int64_t start = esp_timer_get_time();
+		ret = enc_stream(picture, job->format, job->quality, timed_sink, &sink);
+		*encode_us = esp_timer_get_time() - start - sink.sink_us;
+		*retry = ret == ESP_OK || sink.ret != ESP_OK;
+	}
+
+	esp_err_t end_ret = mqtt ? mqtt_upload_end(&transfer->mqtt, ret == ESP_OK) :
+		ftp_upload_end(&transfer->ftp, ret == ESP_OK);
+
+	return ret == ESP_OK ? end_ret : ret;
+}
+
+static esp_err_t timed_sink(void *ctx, const void *data, size_t len)
+{
+	timed_sink_t *sink = ctx;
+	int64_t start = esp_timer_get_time();
+
+	sink->ret = sink->write(sink->transfer, data, len);
+	sink->sink_us += esp_timer_get_time() - start;
+
+	return sink->ret;
+}
+
+static esp_err_t ftp_sink(void *ctx, const void *data, size_t len)
+{
+	return ftp_upload_write(&((transfer_t *)ctx)->ftp, data, len);
+}
+
+static esp_err_t mqtt_sink(void *ctx, const void *data, size_t len)
+{
+	return mqtt_upload_write(&((transfer_t *)ctx)->mqtt, data, len);
+}
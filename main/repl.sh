@@ -1,11 +1,31 @@
 #!/bin/bash
 
-DEPENDENCIES='timeout awk mosquitto_sub mosquitto_pub'
+DEPENDENCIES='awk sort mosquitto_sub mosquitto_pub'
 HOST='localhost'
-RETAINED_MSG='ESP32-CAM is ready to receive input'
 TIMEOUT=5
+TOPIC_BASE='ESP32/shape_detector/'
+BROADCAST_ID='all'
+
+# The devices talked to, and how: '' for one device, `each` publishes to
+# every device's input, `broadcast` once to the broadcast topic
+DEVICES=()
+FANOUT=''
+declare -A SELECTED GREETING REPLY_TEXT REPLY_MS
+
+# The session: the mosquitto_sub coprocess all replies come from, the
+# publishers' file descriptors and the requests sent (ID -> time sent).
+# PENDING has the ones still waiting for replies (ID -> deadline) with
+# their batch, how many devices answered and which.
+SYNC_TOPIC="ESP32/repl/${HOSTNAME}-$$"
+SESSION_UP=''
+PUBLISHERS=()
+declare -A SENT PENDING COMMAND ANSWERS ANSWERED
+REQUESTS=0
+RTT_COUNT=0 RTT_SUM=0 RTT_MIN=0 RTT_MAX=0
+SCRIPT=''
 
 HISTCONTROL='ignoredups:ignorespace'
+REQUEST_ID=0
 
 for dep in ${DEPENDENCIES}; do
     type -f ${dep} &>/dev/null
@@ -15,13 +35,33 @@ for dep in ${DEPENDENCIES}; do
     fi
 done
 
+usage() {
+    printf 'Usage: %s [-b broker] [-d device]... [-a] [-f script]\n' "${0##*/}"
+    printf '  -b  MQTT broker (default %s)\n' "${HOST}"
+    printf '  -d  device ID to talk to; repeated, commands go to all of them\n'
+    printf '  -a  commands go to every device on the broker, on the broadcast topic\n'
+    printf '  -f  run the commands in <script>, one line at a time, and sum up the\n'
+    printf '      round trips (lines starting with # are skipped)\n'
+    printf 'Without -d or -a, the only device on the broker is picked.\n'
+}
+
+while getopts 'b:d:af:' opt; do
+    case "${opt}" in
+        b) HOST="${OPTARG}" ;;
+        d) DEVICES+=( "${OPTARG}" ) ;;
+        a) FANOUT=broadcast ;;
+        f) SCRIPT="${OPTARG}" ;;
+        *) usage >&2; exit 2 ;;
+    esac
+done
+
 autocomplete_print_info() {
     printf '\033[1;35m%*s\033[m\n' $(( (COLUMNS + ${#1}) / 2 )) "${1}"
 }
 
 autocomplete() {
     local IFS=$'|\n'
-    local comps="$(list_commands | awk '/ - / {printf "%s|", $1}')"
+    local comps="$(list_commands | awk '$1 == "-" {printf "%s|", prev} $1 != "-" && / - / {printf "%s|", $1} {prev = $1}')"
     local col_len=0 indent=2
     local line_len=${indent}
     local comp nospace common_substring
@@ -38,7 +78,7 @@ autocomplete() {
     second_last_token="${second_last_token##*[[:space:]]}"
 
     case "${second_last_token}" in
-        flash)
+        flash|ftpsession|ftppipeline|ftpnodelay|perf)
             comps='on|off'
             nospace=yes
             ;;
@@ -58,6 +98,50 @@ autocomplete() {
             autocomplete_print_info 'INFO: `rand`, absolute or relative angle'
             return 0
             ;;
+        format)
+            comps='bmp|jpg|qoi'
+            nospace=yes
+            ;;
+        stream)
+            comps='on|off|stats'
+            nospace=yes
+            ;;
+        streamscale)
+            comps='1|2|4'
+            nospace=yes
+            ;;
+        transport)
+            comps='ftp|mqtt'
+            nospace=yes
+            ;;
+        mqttqos)
+            comps='0|1'
+            nospace=yes
+            ;;
+        streamfps)
+            autocomplete_print_info 'INFO: provide value between 1 and 30'
+            return 0
+            ;;
+        quality)
+            autocomplete_print_info 'INFO: provide value between 1 and 100'
+            return 0
+            ;;
+        fetch)
+            comps='sweep|pipe|phase|index'
+            nospace=yes
+            ;;
+        calibrate)
+            autocomplete_print_info 'INFO: step in degrees, 5 to 45 (default 10)'
+            return 0
+            ;;
+        ftpchunk|ftpsndbuf|mqttchunk)
+            autocomplete_print_info 'INFO: size in bytes'
+            return 0
+            ;;
+        metrics)
+            autocomplete_print_info 'INFO: period in seconds, 1 to 3600, or off'
+            return 0
+            ;;
     esac
 
     comps=( $(compgen -W "${comps}" -- "${last_token,,}") )
@@ -104,47 +188,396 @@ autocomplete() {
     fi
 }
 
-esp32_output() {
-    local topic_out='ESP32/shape_detector/output'
+# Reads the next message of the session into MSG_RETAINED, MSG_TOPIC,
+# MSG_TIME (when it was received, in microseconds) and MSG_TEXT, waiting up
+# to $1 seconds. Fails with more than 128 on a timeout.
+session_read() {
+    # Bash drops SESSION once the coprocess has exited
+    (( ${#SESSION[@]} )) || return 1
+
+    IFS= read -r -d '' -t "${1}" -u ${SESSION[0]} MSG_RETAINED &&
+        IFS= read -r -d '' -u ${SESSION[0]} MSG_TOPIC &&
+        IFS= read -r -d '' -u ${SESSION[0]} MSG_TIME &&
+        IFS= read -r -d '' -u ${SESSION[0]} MSG_TEXT || return
+
+    # Seconds with nanoseconds
+    MSG_TIME="${MSG_TIME/./}"
+    MSG_TIME="${MSG_TIME::-3}"
+}
+
+session_stop() {
+    local fd
+
+    for fd in "${PUBLISHERS[@]}"; do
+        exec {fd}>&-
+    done
+    PUBLISHERS=()
+
+    if [[ -n "${SESSION_UP}" ]]; then
+        kill ${SESSION_PID} 2>/dev/null
+        wait ${SESSION_PID} 2>/dev/null
+    fi
+    SESSION_UP=''
+    PENDING=() COMMAND=() ANSWERS=() ANSWERED=()
+}
+
+# One mosquitto_sub for the whole session, on the output topics of all the
+# devices and on a topic of this REPL's own: what's published there comes
+# back once the subscriptions are in place, replies published earlier would
+# be lost. The retained greetings come first, they tell which devices are on.
+session_start() {
+    local deadline=$(( ${EPOCHREALTIME/[.,]/} + TIMEOUT * 1000000 ))
+    local status
 
-    timeout --foreground ${TIMEOUT} mosquitto_sub ${@} -h "${HOST}" -t "${topic_out}" 2>&1
-    if (( $? != 0 )); then
-        printf '\033[31mResource temporarily unavailable\033[39m\n'
+    GREETING=()
+
+    coproc SESSION {
+        exec mosquitto_sub -h "${HOST}" -F '%r\0%t\0%U\0%p\0' \
+            -t "${TOPIC_BASE}+/output" -t "${SYNC_TOPIC}" 2>/dev/null
+    }
+    SESSION_UP=yes
+
+    while (( ${EPOCHREALTIME/[.,]/} < deadline )); do
+        mosquitto_pub -h "${HOST}" -t "${SYNC_TOPIC}" -m "$$" 2>/dev/null
+
+        while session_read 0.2 || { status=$?; false; }; do
+            if [[ "${MSG_TOPIC}" == "${SYNC_TOPIC}" ]]; then
+                return 0
+            fi
+            route_message
+        done
+
+        # mosquitto_sub gave up (no broker)
+        (( status > 128 )) || break
+    done
+
+    session_stop
+    printf '\033[31mCannot subscribe on %s. Is the broker running?\033[39m\n' "${HOST}"
+    return 1
+}
+
+# mosquitto_pub -l publishes every line it reads, one for every input topic
+# keeps publishing free of process startups and broker connects
+publishers_start() {
+    local topics=() topic device fd
+
+    if [[ "${FANOUT}" == broadcast ]]; then
+        topics=( "${TOPIC_BASE}${BROADCAST_ID}/input" )
+    else
+        for device in "${DEVICES[@]}"; do
+            topics+=( "${TOPIC_BASE}${device}/input" )
+        done
     fi
+
+    for topic in "${topics[@]}"; do
+        exec {fd}> >(exec mosquitto_pub -h "${HOST}" -t "${topic}" -l 2>/dev/null)
+        PUBLISHERS+=( ${fd} )
+    done
 }
 
+select_devices() {
+    local device found
+
+    session_start || exit 92
+    found=( $(printf '%s\n' "${!GREETING[@]}" | sort) )
+
+    if [[ -n "${FANOUT}" ]]; then
+        DEVICES=( "${found[@]}" )
+    elif (( ${#DEVICES[@]} > 1 )); then
+        FANOUT=each
+    elif (( ${#DEVICES[@]} == 0 && ${#found[@]} > 1 )); then
+        printf 'Devices on %s: %s\n' "${HOST}" "${found[*]}"
+        printf 'Pick them with -d, or all of them with -a\n'
+        exit 2
+    elif (( ${#DEVICES[@]} == 0 )); then
+        DEVICES=( "${found[@]}" )
+    fi
+
+    if (( ${#DEVICES[@]} == 0 )); then
+        printf '\033[31mNo ESP32 found on %s. Is it on and connected?\033[39m\n' "${HOST}"
+        exit 92
+    fi
+
+    for device in "${DEVICES[@]}"; do
+        SELECTED[${device}]=yes
+    done
+
+    publishers_start
+}
+
+# Publishes to every device at once, see FANOUT
 esp32_input() {
-    local topic_in='ESP32/shape_detector/input'
+    local fd
+
+    for fd in "${PUBLISHERS[@]}"; do
+        printf '%s\n' "${1}" >&${fd} 2>/dev/null || return 1
+    done
+}
+
+# Microseconds in $2 as milliseconds with one decimal, into variable $1
+format_ms() {
+    printf -v "${1}" '%d.%d' $(( ${2} / 1000 )) $(( ${2} / 100 % 10 ))
+}
+
+# Takes the message session_read() left to the request with ID $1 waiting
+# for it, or records (greetings) or shows it. The first reply of a device
+# to another request in flight is shown with its ID as it comes, later ones
+# (finished uploads, requests that timed out) dimmed with their round trip.
+route_message() {
+    local device="${MSG_TOPIC#"${TOPIC_BASE}"}"
+    local prefix msg_id text elapsed ms
+
+    device="${device%/output}"
+    [[ -n "${FANOUT}" ]] && prefix="${device}: "
+
+    if [[ "${MSG_TOPIC}" == "${SYNC_TOPIC}" ]]; then
+        return
+    elif [[ -z "${MSG_TEXT}" ]]; then
+        # The last will of a device that dropped off
+        unset "GREETING[${device}]"
+        if [[ -v SELECTED[${device}] ]]; then
+            printf '\033[31m%s went offline\033[39m\n' "${device}"
+        fi
+        return
+    elif [[ "${MSG_RETAINED}" == 1 ]]; then
+        GREETING[${device}]="${MSG_TEXT}"
+        return
+    elif [[ ! -v SELECTED[${device}] ]]; then
+        return
+    fi
+
+    if [[ "${MSG_TEXT}" =~ ^(#[0-9]+)( |$) ]]; then
+        msg_id="${BASH_REMATCH[1]}"
+        text="${MSG_TEXT#"${msg_id}"}"
+        text="${text# }"
+    fi
+
+    if [[ -z "${msg_id}" || ! -v SENT[${msg_id}] ]]; then
+        printf '\033[2m%s%s\033[22m\n' "${prefix}" "${MSG_TEXT}"
+        return
+    fi
+
+    elapsed=$(( MSG_TIME - ${SENT[${msg_id}]} ))
+    format_ms ms ${elapsed}
+
+    if [[ ! -v PENDING[${msg_id}] || -v ANSWERED[${msg_id}/${device}] ]]; then
+        printf '\033[2m%s%s after %s ms: %s\033[22m\n' "${prefix}" "${msg_id}" "${ms}" "${text}"
+        return
+    fi
+
+    ANSWERED[${msg_id}/${device}]=yes
+    (( ++RTT_COUNT, RTT_SUM += elapsed ))
+    (( RTT_MIN == 0 || elapsed < RTT_MIN )) && (( RTT_MIN = elapsed ))
+    (( elapsed > RTT_MAX )) && (( RTT_MAX = elapsed ))
+
+    if [[ "${msg_id}" == "${1}" ]]; then
+        REPLY_TEXT[${device}]="${text}"
+        REPLY_MS[${device}]="${ms}"
+    else
+        printf '%s%s %s \033[2m(%s ms)\033[22m\n' "${prefix}" "${msg_id}" "${text}" "${ms}"
+    fi
+
+    if (( ++ANSWERS[${msg_id}] == ${#DEVICES[@]} )); then
+        request_done "${msg_id}"
+    fi
+}
+
+# Forgets the request with ID $1, its replies are late from now on
+request_done() {
+    local device
+
+    for device in "${DEVICES[@]}"; do
+        unset "ANSWERED[${1}/${device}]"
+    done
+    unset "PENDING[${1}]" "COMMAND[${1}]" "ANSWERS[${1}]"
+}
+
+# Gives up on the requests in flight whose time is up, except $1
+requests_expire() {
+    local now=${EPOCHREALTIME/[.,]/}
+    local id device
+
+    for id in "${!PENDING[@]}"; do
+        [[ "${id}" != "${1}" ]] && (( ${PENDING[${id}]} <= now )) || continue
+
+        for device in "${DEVICES[@]}"; do
+            [[ -v ANSWERED[${id}/${device}] ]] && continue
+            [[ -n "${FANOUT}" ]] && printf '%s: ' "${device}"
+            printf '\033[31m%s %s: no reply\033[39m\n' "${id}" "${COMMAND[${id}]}"
+        done
+        request_done "${id}"
+    done
+}
+
+# Routes the messages of the session until the request with ID $1, or
+# without one every request in flight, has all its replies or its time is up
+requests_wait() {
+    local now deadline timeout status id
+
+    while requests_expire "${1}"; do
+        if [[ -n "${1}" ]]; then
+            [[ -v PENDING[${1}] ]] || break
+            deadline=${PENDING[${1}]}
+        else
+            (( ${#PENDING[@]} )) || break
+            deadline=''
+            for id in "${!PENDING[@]}"; do
+                (( ${#deadline} && deadline < ${PENDING[${id}]} )) ||
+                    deadline=${PENDING[${id}]}
+            done
+        fi
+
+        now=${EPOCHREALTIME/[.,]/}
+        if (( now >= deadline )); then
+            [[ -n "${1}" ]] && break
+            continue
+        fi
+        printf -v timeout '%d.%06d' $(( (deadline - now) / 1000000 )) \
+            $(( (deadline - now) % 1000000 ))
+
+        session_read ${timeout}
+        status=$?
+        if (( status > 128 )); then
+            continue
+        elif (( status != 0 )); then
+            printf '\033[31mLost the connection to %s\033[39m\n' "${HOST}"
+            session_stop
+            break
+        fi
+
+        route_message "${1}"
+    done
+}
+
+# Shows what came in since the last request without waiting for more
+requests_poll() {
+    while (( ${#SESSION[@]} )) && read -t 0 -u ${SESSION[0]}; do
+        session_read 1 || break
+        route_message
+    done
+
+    requests_expire
+}
+
+# Publishes $1 tagged with a new correlation ID, left in REQUEST, without
+# waiting: it's in flight (PENDING) for TIMEOUT seconds and its replies are
+# told from the others' by the ID, in whatever order they come
+request_send() {
+    REQUEST="#$(( ++REQUEST_ID ))"
+    (( ++REQUESTS ))
+
+    if [[ -z "${SESSION_UP}" ]]; then
+        session_start || return 1
+        publishers_start
+    fi
+
+    SENT[${REQUEST}]=${EPOCHREALTIME/[.,]/}
+    PENDING[${REQUEST}]=$(( ${SENT[${REQUEST}]} + TIMEOUT * 1000000 ))
+    COMMAND[${REQUEST}]="${1}"
+
+    if ! esp32_input "${REQUEST} ${1}"; then
+        printf '\033[31mLost the connection to %s\033[39m\n' "${HOST}"
+        session_stop
+        return 1
+    fi
+}
+
+# Publishes $1 and waits for its replies, leaving them without the ID in
+# REPLY_TEXT and the round trip in REPLY_MS, by device. Replies to the other
+# requests in flight are shown meanwhile.
+request() {
+    REPLY_TEXT=()
+    REPLY_MS=()
+
+    request_send "${1}" || return 1
+    requests_wait "${REQUEST}"
+    request_done "${REQUEST}"
 
-    mosquitto_pub -h "${HOST}" -t "${topic_in}" -m "${1}"
+    (( ${#REPLY_TEXT[@]} == ${#DEVICES[@]} ))
+}
+
+# Sends the commands collected from the line as one batch and prints its
+# (single) reply and round trip, TIMEOUT being the sum of the commands'
+# timeouts. With several devices, every reply comes under its device. A
+# line ending with & doesn't wait, its replies are shown as they come.
+send_batch() {
+    local device
+
+    if [[ -n "${batch}" && -n "${background}" ]]; then
+        request_send "${batch}" &&
+            printf '\033[2m%s sent\033[22m\n' "${REQUEST}"
+    elif [[ -n "${batch}" && -z "${FANOUT}" ]]; then
+        if request "${batch}"; then
+            printf '%s \033[2m(%s ms)\033[22m\n' "${REPLY_TEXT[${DEVICES[0]}]}" \
+                "${REPLY_MS[${DEVICES[0]}]}"
+        else
+            printf '\033[31mResource temporarily unavailable\033[39m\n'
+        fi
+    elif [[ -n "${batch}" ]]; then
+        request "${batch}"
+
+        for device in "${DEVICES[@]}"; do
+            if [[ -v REPLY_TEXT[${device}] ]]; then
+                printf '\033[1m%s\033[22m \033[2m(%s ms)\033[22m\n%s\n' \
+                    "${device}" "${REPLY_MS[${device}]}" "${REPLY_TEXT[${device}]}"
+            else
+                printf '\033[1m%s\033[22m \033[31mno reply\033[39m\n' "${device}"
+            fi
+        done
+    fi
+
+    batch=''
+    TIMEOUT=0
 }
 
 get_ack() {
-    local ACK ENQ pid
+    local ACK ENQ TIMEOUT=5 device answered=0
     ENQ=$'\005'
     ACK=$'\006'
 
-    if [[ "$(esp32_output -C 1 -R)" =~ "${ACK}"|"${RETAINED_MSG}" ]]; then
-        esp32_output -C 1 --retained-only
-    else
+    request "${ENQ}"
+
+    for device in "${DEVICES[@]}"; do
+        if [[ "${REPLY_TEXT[${device}]}" =~ "${ACK}" ]]; then
+            (( ++answered ))
+            if [[ -n "${FANOUT}" ]]; then
+                printf '\033[1m%s\033[22m ' "${device}"
+            fi
+            printf '%s \033[2m(%s ms)\033[22m\n' "${GREETING[${device}]:-Ready}" \
+                "${REPLY_MS[${device}]}"
+        elif [[ -n "${FANOUT}" ]]; then
+            printf '\033[1m%s\033[22m \033[31mnot available\033[39m\n' "${device}"
+        fi
+    done
+
+    if (( answered == 0 )); then
         printf '\033[31mNot available. Is ESP32 on and connected?\033[39m\n'
         exit 92
-    fi &
+    fi
+}
 
-    pid=$!
+# Round trips of the replies taken, for -f
+print_summary() {
+    local min avg max
 
-    esp32_input "${ENQ}"
+    format_ms min ${RTT_MIN}
+    format_ms avg $(( RTT_COUNT ? RTT_SUM / RTT_COUNT : 0 ))
+    format_ms max ${RTT_MAX}
 
-    wait ${pid}
-    if (( $? != 0 )); then
-        exit 92
-    fi
+    printf '%d requests, %d replies, round trip min/avg/max %s/%s/%s ms\n' \
+        ${REQUESTS} ${RTT_COUNT} "${min}" "${avg}" "${max}"
 }
 
 list_commands() {
 	cat <<-'EOF'
-		NOTE: Multiple commands in a line are allowed.
+		NOTE: Multiple commands in a line are allowed, they are sent as one
+		message and answered together.
 		Example: flash on shoot saveas test.bmp
+		Every reply ends with its round trip.
+		A line ending with & is sent without waiting for its reply, which
+		comes later with the request's #ID, e.g. `fetch &` then `status`.
+		Started with several -d or with -a, every command goes to all the
+		devices at once and each reply shows its device and round trip.
 
 		ping                - ping ESP32
 		shoot               - take a new picture to be used as a reference
@@ -153,32 +586,114 @@ list_commands() {
 		brightness <value>  - set image brightness, value between -2 and 2
 		contrast <value>    - set image contrast, value between -2 and 2
 		saturation <value>  - set image saturation, value between -2 and 2
-		save                - save the "shot" picture locally over FTP
-		saveas <NAME>       - save the "shot" picture locally as <NAME>
+		save                - queue the "shot" picture for saving locally over
+		                        FTP, completion is reported when done
+		saveas <NAME>       - same as save, as <NAME>; a .bmp, .jpg or .qoi
+		                        extension picks the format
+		format <bmp|jpg|qoi>
+		                    - format of saved pictures (default bmp), the
+		                        extension is added to names without one
+		quality <1-100>     - JPEG quality of saved pictures (default 80)
+		stream <on|off|stats>
+		                    - live preview over HTTP on port 8080, MJPEG at
+		                        / and raw frames at /raw
+		streamfps <1-30>    - frame rate cap of the preview (default 10)
+		streamscale <1|2|4> - preview frame size, 1/scale of the camera's
+		                        frame (default 1)
+		uploads             - show the upload queue and its counters
 		rotate [angle|rand] - rotate servo by absolute or relative (increment and
 		                        decrement) angle, or `rand` for random rotation
-		fetch               - try to find an appropriate angle based on the
-		                        "shot" picture
+		fetch [sweep|pipe|phase|index]
+		                    - try to find an appropriate angle based on the
+		                        "shot" picture, by servo sweep (default),
+		                        sweep with capture and scoring overlapped, by
+		                        estimating the rotation from one capture or
+		                        from the calibration index
+		calibrate [step]    - record the calibration index every <step>
+		                        degrees (default 10), kept across reboots
+		ftpsession <on|off> - keep the FTP connection logged in between saves
+		ftppipeline <on|off>
+		                    - send the FTP login commands without waiting
+		                        for each reply (falls back if the server
+		                        can't keep up)
+		ftpchunk <bytes>    - largest single send() on the FTP data connection
+		ftpsndbuf <bytes>   - FTP data socket send buffer, 0 for the default
+		ftpnodelay <on|off> - disable Nagle on the FTP data connection
+		transport <ftp|mqtt>
+		                    - save pictures to the FTP server or publish
+		                        them in chunks on ESP32/shape_detector/
+		                        <device>/image,
+		                        see tools/mqtt_receiver.py (MQTT is picked
+		                        at boot when FTP is unreachable)
+		mqttchunk <bytes>   - largest chunk of a picture sent over MQTT
+		mqttqos <0|1>       - QoS of the chunks
+		status              - show the command queues and what's running;
+		                        camera and servo jobs, and the settings
+		                        they use, run one at a time in order,
+		                        other commands don't wait for them
+		cancel              - stop the running job (fetch, calibrate) and
+		                        drop the queued ones
+		wait                - wait for the replies to the requests sent
+		                        with &
+		perf <on|off>       - publish phase timings of every command on the
+		                        ESP32/shape_detector/<device>/perf topic
+		metrics <seconds|off>
+		                    - publish heap, PSRAM, CPU per task and latency
+		                        histograms every <seconds> on the
+		                        ESP32/shape_detector/<device>/metrics topic
+		bench               - measure image kernels in CPU cycles per pixel
 		reboot              - reboot ESP32
 		help|?              - show this utterly useful text
 		quit|exit           - guess what
 	EOF
 }
 
+# The next line of the script, or what's typed at the prompt. What came in
+# for the requests in flight is shown first.
+read_line() {
+    requests_poll
+
+    if [[ -n "${SCRIPT}" ]]; then
+        IFS=' ' read -r -a line_arr <&${script_fd} || return 1
+        [[ "${line_arr[0]}" == \#* ]] && line_arr=()
+        (( ${#line_arr[@]} )) && printf '\033[1;33m$\033[m %s\n' "${line_arr[*]}"
+        return 0
+    fi
+
+    IFS=' ' read -erp $'\001\e[1;33m\002$\001\e[m\002 ' -a line_arr || return 1
+    history -s "${line_arr[@]}"
+}
+
 trap 'exit 130' SIGINT
+trap 'session_stop' EXIT
+# A publisher that exited fails the write instead of killing the REPL
+trap '' SIGPIPE
+
+if [[ -n "${SCRIPT}" ]]; then
+    exec {script_fd}< "${SCRIPT}" || exit 1
+fi
 
 set -f -o emacs
 bind -x '"\C-i":"autocomplete"'
 
+select_devices
 get_ack
 
-while IFS=' ' read -erp $'\001\e[1;33m\002$\001\e[m\002 ' -a line_arr; do
-    history -s "${line_arr[@]}"
+while read_line; do
 
     line_arr=( ${line_arr[@],,} )
+    batch=''
+    background=''
+    TIMEOUT=0
+
+    if (( ${#line_arr[@]} )) && [[ "${line_arr[-1]}" == *\& ]]; then
+        background=yes
+        line_arr[-1]="${line_arr[-1]%&}"
+        [[ -n "${line_arr[-1]}" ]] || unset 'line_arr[-1]'
+    fi
 
     for ((i = 0; i < ${#line_arr[@]}; ++i)); do
-        TIMEOUT=5
+        command_timeout=5
 
         if [[ $(list_commands) =~ "${line_arr[i]}"(\|[^ ]+)?[[:space:]]+- ]]; then
             command="${line_arr[i]}"
@@ -188,30 +703,43 @@ while IFS=' ' read -erp $'\001\e[1;33m\002$\001\e[m\002 ' -a line_arr; do
 
         case "${command}" in
             ping)
+                send_batch
                 get_ack
                 continue
                 ;;
-            rotate\ *rand)
-                TIMEOUT=10
+            wait)
+                send_batch
+                requests_wait
+                continue
+                ;;
+            rotate\ *)
+                command_timeout=10
                 ;;
-            save|saveas\ *|fetch|reboot)
-                TIMEOUT=120
+            fetch|fetch\ *|calibrate|calibrate\ *|bench|reboot)
+                command_timeout=120
                 ;;
             help|\?)
                 list_commands
                 continue
                 ;;
             quit|exit)
-                exit 0
+                break 2
                 ;;
             '')
-                history -d -1
+                [[ -z "${SCRIPT}" ]] && history -d -1
                 continue
                 ;;
         esac
 
-        esp32_input "${command}"
-        esp32_output -C 1 -R
+        batch+="${batch:+;}${command}"
+        (( TIMEOUT += command_timeout ))
     done
+
+    send_batch
 done
 
+if [[ -n "${SCRIPT}" ]]; then
+    requests_wait
+    print_summary
+fi
+
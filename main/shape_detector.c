@@ -1,7 +1,9 @@
 #include <esp_log.h>
 #include <esp_system.h>
 #include <esp_err.h>
+#include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 #include <esp_camera.h>
 #include "servo_lib.h"
 #include "camera_lib.h"
@@ -9,88 +11,396 @@
 #include "ftp_lib.h"
 #include "mqtt_lib.h"
 #include "UI_commands.h"
+#include "perf_lib.h"
+#include "command_lib.h"
 
+// Connection settings, can be overridden from the build (e.g. the host build)
+#ifndef SSID
 #define SSID "WiFi SSID"
+#endif
+#ifndef PASSWORD
 #define PASSWORD "WiFi PASS"
+#endif
 
+#ifndef MQTT_URI
 #define MQTT_URI "mqtt://"
+#endif
+// Names the MQTT topics, ESP32/shape_detector/<DEVICE_ID>/..., the MAC if empty
+#ifndef DEVICE_ID
+#define DEVICE_ID ""
+#endif
 #define ENQ 5
 #define ACK 6
 
+#ifndef FTP_SERVER
 #define FTP_SERVER "IP address"
+#endif
+#ifndef FTP_PORT
 #define FTP_PORT "21"
+#endif
+#ifndef FTP_USER
 #define FTP_USER "ESP32-CAM"
+#endif
+#ifndef FTP_PASS
 #define FTP_PASS "ESP32-CAM-PASS"
-#define FTP_PICTURE_PATH "~/original.bmp"
+#endif
+#ifndef FTP_PICTURE_PATH
+#define FTP_PICTURE_PATH "~/original"
+#endif
 
 
 static const char *TAG = "shape_detector";
 
 
 static void mqtt_data_handler(char *payload);
+static void execute_command(char *payload, int64_t wait_us);
 
 
 void app_main(void)
 {
-	ESP_ERROR_CHECK(init_servo());
-
 	ESP_ERROR_CHECK(init_camera());
 
 	ESP_ERROR_CHECK(connect_to_wifi(SSID, PASSWORD));
 
-	ESP_ERROR_CHECK(init_ftp_client(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS));
+	// After connect_to_wifi(), which initializes the NVS with the pulse range
+	ESP_ERROR_CHECK(init_servo());
+
+	// Not fatal, pictures can go over MQTT and FTP is tried again on `save`
+	if (init_ftp_client(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS) != ESP_OK) {
+		ESP_LOGW(TAG, "FTP server unreachable, pictures are saved over MQTT");
+		upload_set_transport(UPLOAD_MQTT);
+	}
+
+	ESP_ERROR_CHECK(upload_init(upload_done));
+
+	ESP_ERROR_CHECK(command_init(execute_command));
 
-	ESP_ERROR_CHECK(start_mqtt_client(MQTT_URI, mqtt_data_handler));
+	ESP_ERROR_CHECK(start_mqtt_client(MQTT_URI, DEVICE_ID, mqtt_data_handler));
 
 	ESP_LOGI(TAG, "Free memory: %.2f MiB",
 		esp_get_free_heap_size() / 1024.0 / 1024);
 }
 
 
-static void mqtt_data_handler(char *payload)
+/*
+ * A message holds one command or a batch of them separated by ';', e.g.
+ * "flash on;shoot;saveas test.bmp". A batch runs in order on one worker
+ * (the job worker if any of its commands is a job) and is answered with a
+ * single message, the replies a line each.
+ */
+#define BATCH_SEPARATOR ";"
+#define BATCH_MAX 8
+
+typedef enum {
+	ARGS_NONE,
+	ARGS_OPTIONAL,
+	ARGS_ONE
+} arity_t;
+
+typedef struct {
+	const char *name;
+	// One of the two, run_named() serves several commands
+	void (*run)(char *arg);
+	void (*run_named)(char *name, char *arg);
+	arity_t arity;
+	const char *usage;    // the argument, for the error replies
+	bool job;             // uses or sets up the camera, the servo or saving
+	bool now;             // answered from the MQTT task when sent alone
+	uint16_t timeout_s;   // jobs are cancelled at their next check after it
+} command_t;
+
+typedef struct {
+	const command_t *command;
+	char *name;
+	char *arg;
+} step_t;
+
+// Only touched by jobs, so only by the job worker
+static camera_fb_t *original_picture = NULL;
+
+
+static void run_ping(char *arg)
 {
-	static camera_fb_t *original_picture = NULL;
+	char ack[2] = {ACK, 0};
+	mqtt_publish(ack);
+}
 
-	char *command = strtok(payload, " ");
-	if (!command) {
-		return;
+static void run_shoot(char *arg)
+{
+	shoot(&original_picture);
+}
+
+static void run_save(char *arg)
+{
+	save(original_picture, arg ? arg : FTP_PICTURE_PATH);
+}
+
+static void run_fetch(char *arg)
+{
+	fetch(original_picture, arg);
+}
+
+static void run_uploads(char *arg)
+{
+	uploads();
+}
+
+static void run_status(char *arg)
+{
+	status();
+}
+
+static void run_cancel(char *arg)
+{
+	cancel();
+}
+
+static void run_bench(char *arg)
+{
+	benchmark();
+}
+
+static void run_reboot(char *arg)
+{
+	esp_restart();
+}
+
+static const command_t g_commands[] = {
+	{"\x05", run_ping, NULL, ARGS_NONE, NULL, false, true, 5},
+	{"status", run_status, NULL, ARGS_NONE, NULL, false, true, 5},
+	{"cancel", run_cancel, NULL, ARGS_NONE, NULL, false, true, 5},
+	{"shoot", run_shoot, NULL, ARGS_NONE, NULL, true, false, 5},
+	{"save", run_save, NULL, ARGS_NONE, NULL, true, false, 5},
+	{"saveas", run_save, NULL, ARGS_ONE, "file name", true, false, 5},
+	{"rotate", rotate, NULL, ARGS_ONE, "degrees (0.1 steps) or rand", true, false, 10},
+	{"servopulse", servo_pulse, NULL, ARGS_OPTIONAL, "min-max us or default", true, false, 10},
+	{"fetch", run_fetch, NULL, ARGS_OPTIONAL, "sweep/pipe/phase/index", true, false, 120},
+	{"calibrate", calibrate, NULL, ARGS_OPTIONAL, "step", true, false, 120},
+	{"bench", run_bench, NULL, ARGS_NONE, NULL, true, false, 120},
+	{"flash", flash, NULL, ARGS_ONE, "on/off", true, false, 5},
+	{"intensity", flash_intensity, NULL, ARGS_ONE, "0-255", true, false, 5},
+	{"brightness", NULL, adjust_img_properties, ARGS_ONE, "-2 to 2", true, false, 5},
+	{"contrast", NULL, adjust_img_properties, ARGS_ONE, "-2 to 2", true, false, 5},
+	{"saturation", NULL, adjust_img_properties, ARGS_ONE, "-2 to 2", true, false, 5},
+	{"uploads", run_uploads, NULL, ARGS_NONE, NULL, false, false, 5},
+	{"format", format, NULL, ARGS_ONE, "bmp/jpg/qoi", true, false, 5},
+	{"quality", jpeg_quality, NULL, ARGS_ONE, "1-100", true, false, 5},
+	{"stream", stream, NULL, ARGS_ONE, "on/off/stats", false, false, 5},
+	{"streamfps", stream_fps, NULL, ARGS_ONE, "1-30", false, false, 5},
+	{"streamscale", stream_scale, NULL, ARGS_ONE, "1/2/4", false, false, 5},
+	{"ftpsession", ftp_session, NULL, ARGS_ONE, "on/off", false, false, 5},
+	{"ftppipeline", ftp_pipeline, NULL, ARGS_ONE, "on/off", false, false, 5},
+	{"ftpchunk", NULL, ftp_data, ARGS_ONE, "bytes", false, false, 5},
+	{"ftpsndbuf", NULL, ftp_data, ARGS_ONE, "bytes", false, false, 5},
+	{"ftpnodelay", NULL, ftp_data, ARGS_ONE, "on/off", false, false, 5},
+	{"transport", transport, NULL, ARGS_ONE, "ftp/mqtt", false, false, 5},
+	{"mqttchunk", NULL, mqtt_upload, ARGS_ONE, "bytes", false, false, 5},
+	{"mqttqos", NULL, mqtt_upload, ARGS_ONE, "0/1", false, false, 5},
+	{"perf", perf, NULL, ARGS_ONE, "on/off", false, false, 5},
+	{"metrics", metrics, NULL, ARGS_ONE, "seconds/off", false, false, 5},
+	{"reboot", run_reboot, NULL, ARGS_NONE, NULL, false, false, 5}
+};
+
+static const command_t *find_command(const char *name)
+{
+	for (size_t i = 0; i < sizeof(g_commands) / sizeof(g_commands[0]); ++i) {
+		if (!strcmp(g_commands[i].name, name)) {
+			return &g_commands[i];
+		}
 	}
 
-	if (!strcmp(command, "shoot")) {
-		shoot(&original_picture);
+	return NULL;
+}
+
+/*
+ * Splits `payload` in place into its commands and checks their arguments.
+ * Returns how many there are, or 0 with the offending one in steps[0] and
+ * the reply to it published.
+ */
+static size_t parse_batch(char *payload, step_t steps[BATCH_MAX])
+{
+	char *next_command, *next_arg;
+	char reason[64];
+	size_t count = 0;
+
+	for (char *part = strtok_r(payload, BATCH_SEPARATOR, &next_command); part;
+			part = strtok_r(NULL, BATCH_SEPARATOR, &next_command)) {
+		step_t *step = &steps[count];
+
+		step->name = strtok_r(part, " ", &next_arg);
+		if (!step->name) {
+			continue;
+		}
 
-	} else if (!strcmp(command, "flash")) {
-		flash(strtok(NULL, " "));
+		if (count == BATCH_MAX) {
+			snprintf(reason, sizeof(reason), "is one command too many (max %d "
+				"per message)", BATCH_MAX);
+			rejected(step->name, reason);
+			return 0;
+		}
 
-	} else if (!strcmp(command, "intensity")) {
-		flash_intensity(strtok(NULL, " "));
+		step->arg = strtok_r(NULL, " ", &next_arg);
+		step->command = find_command(step->name);
 
-	} else if (!strcmp(command, "save")) {
-		save(original_picture, FTP_PICTURE_PATH);
+		if (!step->command) {
+			rejected(step->name, "is an unknown command");
+			return 0;
 
-	} else if (!strcmp(command, "saveas")) {
-		save(original_picture, strtok(NULL, " "));
+		} else if (step->arg && step->command->arity == ARGS_NONE) {
+			rejected(step->name, "takes no argument");
+			return 0;
 
-	} else if (!strcmp(command, "rotate")) {
-		rotate(strtok(NULL, " "));
+		} else if (!step->arg && step->command->arity == ARGS_ONE) {
+			snprintf(reason, sizeof(reason), "requires argument (%s)",
+				step->command->usage);
+			rejected(step->name, reason);
+			return 0;
 
-	} else if (!strcmp(command, "fetch")) {
-		fetch(original_picture);
+		} else if (strtok_r(NULL, " ", &next_arg)) {
+			rejected(step->name, "takes a single argument");
+			return 0;
 
-	} else if (!strcmp(command, "brightness") ||
-		!strcmp(command, "contrast") ||
-		!strcmp(command, "saturation")) {
-		adjust_img_properties(command, strtok(NULL, " "));
+		}
 
-	} else if (!strcmp(command, "reboot")) {
-		esp_restart();
+		++count;
+	}
 
-	} else if (command[0] == ENQ && command[1] == '\0') {
-		char ack[2] = {ACK, 0};
-		mqtt_publish(ack);
+	return count;
+}
 
+static void run_step(const step_t *step, int64_t wait_us)
+{
+	const command_t *command = step->command;
+
+	perf_begin(command->name[0] == ENQ ? "ping" : command->name, wait_us);
+	// The preview stream pauses while a job runs
+	if (command->job) {
+		camera_lock();
+		command_set_timeout(command->timeout_s * 1000);
+	}
+
+	if (command->run) {
+		command->run(step->arg);
 	} else {
-		mqtt_publish("Unknown command, %s", payload);
+		command->run_named(step->name, step->arg);
+	}
 
+	if (command->job) {
+		command_set_timeout(0);
+		camera_unlock();
 	}
+	perf_end();
+}
+
+/*
+ * A message may start with a correlation ID, "#<anything>", which every reply
+ * to it then starts with too, e.g. "#7 fetch" is answered with "#7 Angle...".
+ * Returns the commands after it.
+ */
+static char *split_reply_id(char *payload, char **id)
+{
+	payload += strspn(payload, " ");
+	*id = NULL;
+
+	if (payload[0] == '#') {
+		*id = payload;
+		payload += strcspn(payload, " ");
+		if (*payload) {
+			*payload++ = '\0';
+		}
+	}
+
+	return payload;
+}
+
+static void queue_commands(char *commands, const char *payload)
+{
+	step_t steps[BATCH_MAX];
+	bool job = false;
+
+	size_t count = parse_batch(commands, steps);
+	if (!count) {
+		return;
+	}
+
+	if (count == 1 && steps[0].command->now) {
+		run_step(&steps[0], 0);
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		job |= steps[i].command->job;
+	}
+
+	if (command_submit(job ? CMD_JOB : CMD_CONTROL, payload) != ESP_OK) {
+		rejected(steps[0].name, "dropped, busy (`status` shows the queues)");
+	}
+}
+
+/*
+ * Runs in the MQTT task: pings and the queue commands are answered right
+ * away, everything else is queued for a worker.
+ */
+static void mqtt_data_handler(char *payload)
+{
+	char copy[CMD_PAYLOAD_LEN] = {0};
+	char *id;
+
+	// Even a message that's too long gets its error under its correlation ID
+	const bool too_long = strlen(payload) >= sizeof(copy);
+	strncpy(copy, payload, sizeof(copy) - 1);
+
+	char *commands = split_reply_id(copy, &id);
+
+	if (mqtt_reply_begin(id, false) != ESP_OK) {
+		rejected(id, "is too long for a correlation ID");
+		return;
+	}
+
+	if (too_long) {
+		char reason[64];
+
+		snprintf(reason, sizeof(reason), "is in a message longer than %d "
+			"characters", CMD_PAYLOAD_LEN - 1);
+		char *name = strtok(commands, " " BATCH_SEPARATOR);
+
+		// Only separators leave no command name to quote
+		rejected(name ? name : "?", reason);
+	} else {
+		queue_commands(commands, payload);
+	}
+
+	mqtt_reply_end();
+}
+
+/*
+ * Runs on a command worker, `payload` passed parse_batch() in the MQTT task
+ */
+static void execute_command(char *payload, int64_t wait_us)
+{
+	step_t steps[BATCH_MAX];
+	char *id;
+	bool job = false;
+
+	char *commands = split_reply_id(payload, &id);
+	size_t count = parse_batch(commands, steps);
+
+	// A batch is answered with one message
+	mqtt_reply_begin(id, count > 1);
+
+	for (size_t i = 0; i < count; ++i) {
+		job |= steps[i].command->job;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		// `cancel` or a timeout drops the rest of the batch too
+		if (i && job && command_cancelled()) {
+			rejected(steps[i].name, "skipped, the batch was cancelled");
+			break;
+		}
+
+		run_step(&steps[i], i ? 0 : wait_us);
+	}
+
+	mqtt_reply_end();
 }
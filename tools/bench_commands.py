@@ -0,0 +1,311 @@
+#!/usr/bin/env python3
+"""End-to-end latency benchmark for the shape detector MQTT commands.
+
+Every command is timed from its publish on ESP32/shape_detector/<device>/input
+to the first reply on ESP32/shape_detector/<device>/output. The firmware's
+`perf on` mode adds a JSON record per command on .../<device>/perf, which
+breaks the time down into phases (servo, capture, encode, ftp_login, pasv,
+stor, publish).
+
+Drive a device or the host build through a broker:
+
+  tools/bench_commands.py --broker mqtt://localhost:1883 --device 240ac4000001
+
+Without --device the commands go to the broadcast topic and the first device
+to answer is timed, which only makes sense with a single device on the broker.
+
+or run the host build directly, talking to it over stdin/stdout:
+
+  tools/bench_commands.py --spawn build-host/shape_detector_host
+
+`save` needs an FTP server at the address the firmware was built with, e.g.
+tools/ftp_standin.py. The result is one JSON document (stdout or --output)
+with p50/p95/p99 in milliseconds per command and per phase.
+"""
+import argparse
+import json
+import os
+import queue
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+import urllib.parse
+
+TOPIC_BASE = 'ESP32/shape_detector/'
+TOPIC_BROADCAST = TOPIC_BASE + 'all/input'
+# Topics below the device's, the links hand messages over by these
+TOPIC_OUT = 'output'
+TOPIC_PERF = 'perf'
+
+ENQ = '\x05'
+ACK = '\x06'
+
+DEFAULT_SCRIPT = [ENQ, 'shoot', 'save', 'rotate 90', 'rotate 30', 'fetch']
+
+
+def device_subtopic(topic):
+    """'output' for ESP32/shape_detector/<device>/output and so on."""
+    return topic[len(TOPIC_BASE):].partition('/')[2]
+
+
+class MqttLink:
+    """Just enough MQTT 3.1.1 (QoS 0, no keepalive) for the benchmark."""
+
+    def __init__(self, uri, device=None):
+        url = urllib.parse.urlparse(uri)
+        self.sock = socket.create_connection((url.hostname or 'localhost', url.port or 1883))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.messages = queue.Queue()
+
+        client_id = ('bench-%d' % os.getpid()).encode()
+        self._send(0x10, self._str(b'MQTT') + bytes([4, 0x02, 0, 0]) + self._str(client_id))
+        if self._read_packet()[0] >> 4 != 2:
+            raise RuntimeError('broker refused the connection')
+
+        base = TOPIC_BASE + (device or '+') + '/'
+        self.topic_in = base + 'input' if device else TOPIC_BROADCAST
+        topics = b''.join(self._str((base + name).encode()) + b'\x00'
+                          for name in (TOPIC_OUT, TOPIC_PERF))
+        self._send(0x82, struct.pack('>H', 1) + topics)
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    @staticmethod
+    def _str(data):
+        return struct.pack('>H', len(data)) + data
+
+    def _send(self, header, body):
+        length, encoded = len(body), b''
+        while True:
+            byte, length = length % 128, length // 128
+            encoded += bytes([byte | (0x80 if length else 0)])
+            if not length:
+                break
+        self.sock.sendall(bytes([header]) + encoded + body)
+
+    def _recv_exact(self, size):
+        data = b''
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                raise ConnectionError('broker closed the connection')
+            data += chunk
+        return data
+
+    def _read_packet(self):
+        header = self._recv_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self._recv_exact(1)[0]
+            length |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        return header, self._recv_exact(length)
+
+    def _reader(self):
+        try:
+            while True:
+                header, body = self._read_packet()
+                if header >> 4 != 3:
+                    continue
+                topic_len = struct.unpack('>H', body[:2])[0]
+                topic = body[2:2 + topic_len].decode()
+                offset = 2 + topic_len + (2 if header & 0x06 else 0)
+                self.messages.put((time.monotonic(), device_subtopic(topic),
+                                   body[offset:].decode(errors='replace')))
+        except (ConnectionError, OSError):
+            self.messages.put(None)
+
+    def publish(self, payload):
+        self._send(0x30, self._str(self.topic_in.encode()) + payload.encode())
+
+
+class SpawnLink:
+    """Host build in stdin/stdout line mode: lines are '<topic> <payload>'."""
+
+    def __init__(self, command):
+        self.proc = subprocess.Popen(command, shell=True, stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                     text=True, bufsize=1)
+        self.messages = queue.Queue()
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    def _reader(self):
+        for line in self.proc.stdout:
+            topic, _, payload = line.rstrip('\n').partition(' ')
+            if topic.startswith(TOPIC_BASE):
+                self.messages.put((time.monotonic(), device_subtopic(topic), payload))
+        self.messages.put(None)
+
+    def publish(self, payload):
+        self.proc.stdin.write(payload + '\n')
+        self.proc.stdin.flush()
+
+    def close(self):
+        self.proc.stdin.close()
+        self.proc.terminate()
+
+
+def percentile(values, p):
+    """Nearest-rank percentile."""
+    ordered = sorted(values)
+    rank = max(1, -(-len(ordered) * p // 100))
+    return ordered[int(rank) - 1]
+
+
+def summarize(values):
+    return {
+        'n': len(values),
+        'p50_ms': round(percentile(values, 50), 3),
+        'p95_ms': round(percentile(values, 95), 3),
+        'p99_ms': round(percentile(values, 99), 3),
+        'max_ms': round(max(values), 3),
+    }
+
+
+def drain(link):
+    while True:
+        try:
+            link.messages.get_nowait()
+        except queue.Empty:
+            return
+
+
+def perf_name(command):
+    """The name the firmware files the command's perf record under."""
+    name = command.split(' ', 1)[0].split(';', 1)[0]
+    return 'ping' if name == ENQ else name
+
+
+def run_command(link, command, timeout):
+    """Returns (latency in ms, reply, perf record or None, completion in ms or None).
+
+    `save` and `saveas` are answered once the picture is queued, the upload
+    reports later; completion is the time until that second message. The
+    command carries a correlation ID, replies without it (late answers to
+    earlier commands) are ignored.
+    """
+    run_command.requests += 1
+    tag = '#b%d' % run_command.requests
+
+    drain(link)
+    sent = time.monotonic()
+    link.publish('%s %s' % (tag, command))
+
+    latency, reply, perf, done = None, None, None, None
+    queued = False
+    deadline = sent + timeout
+    while latency is None or perf is None or (queued and done is None):
+        try:
+            message = link.messages.get(timeout=max(0.0, deadline - time.monotonic()))
+        except queue.Empty:
+            break
+        if message is None:
+            raise ConnectionError('firmware went away')
+        stamp, topic, payload = message
+        if topic == TOPIC_OUT:
+            if payload != tag and not payload.startswith(tag + ' '):
+                continue
+            payload = payload[len(tag) + 1:]
+        if topic == TOPIC_OUT and latency is None:
+            latency, reply = (stamp - sent) * 1000.0, payload
+            queued = 'queued for upload' in payload
+            # The perf record follows the reply right away, if perf is on at all
+            if not queued:
+                deadline = min(deadline, time.monotonic() + 1.0)
+        elif topic == TOPIC_OUT and queued and done is None:
+            done = (stamp - sent) * 1000.0
+            if '\033[31m' in payload:
+                reply = payload
+        elif topic == TOPIC_PERF and perf is None:
+            # Uploads of earlier saves have their own records
+            record = json.loads(payload)
+            if record.get('cmd') == perf_name(command):
+                perf = record
+
+    return latency, reply, perf, done
+
+
+run_command.requests = 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('--broker', help='mqtt://host[:port] the firmware is connected to')
+    target.add_argument('--spawn', help='host build command line to run in line mode')
+    parser.add_argument('--device', help='device ID to drive through the broker '
+                        '(default: broadcast, for a single device)')
+    parser.add_argument('--script', help='file with one command per line (default: %s)'
+                        % ', '.join('ping' if c == ENQ else c for c in DEFAULT_SCRIPT))
+    parser.add_argument('--iterations', type=int, default=20)
+    parser.add_argument('--timeout', type=float, default=120.0, help='per command, seconds')
+    parser.add_argument('--label', default='', help='stored in the output, e.g. firmware build')
+    parser.add_argument('--output', help='write the JSON here instead of stdout')
+    args = parser.parse_args()
+
+    script = DEFAULT_SCRIPT
+    if args.script:
+        with open(args.script) as f:
+            script = [line.strip() for line in f if line.strip() and not line.startswith('#')]
+        script = [ENQ if c == 'ping' else c for c in script]
+
+    link = MqttLink(args.broker, args.device) if args.broker else SpawnLink(args.spawn)
+
+    # The first reply also tells that the firmware is up and subscribed
+    if run_command(link, ENQ, args.timeout)[0] is None:
+        sys.exit('no answer to ping')
+    run_command(link, 'perf on', args.timeout)
+
+    latencies, phases, failures = {}, {}, {}
+    for i in range(args.iterations):
+        for command in script:
+            name = 'ping' if command == ENQ else command
+            latency, reply, perf, done = run_command(link, command, args.timeout)
+            if latency is None:
+                failures[name] = failures.get(name, 0) + 1
+                print('%s: timeout' % name, file=sys.stderr)
+                continue
+            if '\033[31m' in reply:
+                failures[name] = failures.get(name, 0) + 1
+            latencies.setdefault(name, []).append(latency)
+            if done is not None:
+                latencies.setdefault(name + ' (stored)', []).append(done)
+            for key, value in (perf or {}).items():
+                if key.endswith('_us'):
+                    phases.setdefault(name, {}).setdefault(key[:-3], []).append(value / 1000.0)
+        print('iteration %d/%d done' % (i + 1, args.iterations), file=sys.stderr)
+
+    run_command(link, 'perf off', args.timeout)
+    if args.spawn:
+        link.close()
+
+    result = {
+        'label': args.label,
+        'timestamp': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        'iterations': args.iterations,
+        'commands': {},
+    }
+    for name, values in latencies.items():
+        entry = summarize(values)
+        entry['failures'] = failures.get(name, 0)
+        # Phases that never ran for this command are left out
+        entry['phases'] = {phase: summarize(samples)
+                           for phase, samples in phases.get(name, {}).items()
+                           if any(samples)}
+        result['commands'][name] = entry
+
+    text = json.dumps(result, indent=2)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+
+
+if __name__ == '__main__':
+    main()
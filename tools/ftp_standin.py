@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Minimal FTP server stand-in for exercising ftp_lib.c on a LAN or the host build.
+
+Only what the firmware uses is implemented: USER, PASS, TYPE, PASV, STOR, NOOP
+and QUIT (plus a few harmless extras). Uploaded files land in --dir.
+
+  --rtt MS          answer every command MS milliseconds after it arrived,
+                    emulating link RTT (pipelined commands overlap)
+  --no-pipelining   drop commands that arrive before the previous reply, like
+                    some embedded servers do
+  --idle-timeout S  drop control connections idle for S seconds (421)
+"""
+import argparse
+import collections
+import os
+import socket
+import threading
+import time
+
+
+class Session(threading.Thread):
+    def __init__(self, conn, args):
+        super().__init__(daemon=True)
+        self.conn = conn
+        # Replies to pipelined commands are small back-to-back writes
+        self.conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.args = args
+        self.pasv = None
+        self.buf = b''
+        self.lines = collections.deque()
+        # Arrival time of the command being answered
+        self.stamp = time.monotonic()
+
+    def reply(self, text, stamp=None):
+        if self.args.rtt:
+            due = (stamp or self.stamp) + self.args.rtt / 1000.0
+            time.sleep(max(0.0, due - time.monotonic()))
+        self.conn.sendall(text.encode() + b'\r\n')
+
+    def readline(self):
+        while not self.lines:
+            chunk = self.conn.recv(4096)
+            if not chunk:
+                return None
+            stamp = time.monotonic()
+            self.buf += chunk
+            while b'\r\n' in self.buf:
+                line, self.buf = self.buf.split(b'\r\n', 1)
+                self.lines.append((line, stamp))
+        line, self.stamp = self.lines.popleft()
+        if self.args.no_pipelining and self.lines:
+            print('dropping %d pipelined command(s)' % len(self.lines), flush=True)
+            self.lines.clear()
+        return line.decode(errors='replace')
+
+    def open_pasv(self):
+        if self.pasv:
+            self.pasv.close()
+        self.pasv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.pasv.bind((self.args.bind, 0))
+        self.pasv.listen(1)
+        host, port = self.pasv.getsockname()
+        h = host.replace('.', ',')
+        return '227 Entering Passive Mode (%s,%d,%d).' % (h, port >> 8, port & 0xff)
+
+    def store(self, name):
+        if not self.pasv:
+            self.reply('425 Use PASV first.')
+            return
+        self.reply('150 Ok to send data.')
+        data_conn, _ = self.pasv.accept()
+        path = os.path.join(self.args.dir, os.path.basename(name.replace('~/', '')))
+        size = 0
+        start = time.monotonic()
+        with open(path, 'wb') as out:
+            while True:
+                chunk = data_conn.recv(65536)
+                if not chunk:
+                    break
+                out.write(chunk)
+                size += len(chunk)
+        data_conn.close()
+        self.pasv.close()
+        self.pasv = None
+        elapsed = time.monotonic() - start
+        print('STOR %s: %d bytes in %.1f ms' % (path, size, elapsed * 1000), flush=True)
+        self.reply('226 Transfer complete.', time.monotonic())
+
+    def run(self):
+        if self.args.idle_timeout:
+            self.conn.settimeout(self.args.idle_timeout)
+        self.reply('220 ftp_standin ready.')
+        try:
+            while True:
+                line = self.readline()
+                if line is None:
+                    break
+                cmd, _, arg = line.partition(' ')
+                cmd = cmd.upper()
+                if cmd == 'USER':
+                    self.reply('331 Please specify the password.')
+                elif cmd == 'PASS':
+                    self.reply('230 Login successful.')
+                elif cmd == 'TYPE':
+                    self.reply('200 Switching to Binary mode.')
+                elif cmd == 'PASV':
+                    self.reply(self.open_pasv())
+                elif cmd == 'STOR':
+                    self.store(arg)
+                elif cmd == 'NOOP':
+                    self.reply('200 NOOP ok.')
+                elif cmd == 'SYST':
+                    self.reply('215 UNIX Type: L8')
+                elif cmd == 'FEAT':
+                    self.reply('211-Features:\r\n PASV\r\n211 End')
+                elif cmd == 'QUIT':
+                    self.reply('221 Goodbye.')
+                    break
+                else:
+                    self.reply('502 Command not implemented.')
+        except socket.timeout:
+            self.conn.sendall(b'421 Timeout.\r\n')
+        except OSError:
+            pass
+        finally:
+            self.conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--bind', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=2121)
+    parser.add_argument('--dir', default='.')
+    parser.add_argument('--rtt', type=float, default=0.0)
+    parser.add_argument('--idle-timeout', type=float, default=0.0)
+    parser.add_argument('--no-pipelining', action='store_true')
+    args = parser.parse_args()
+
+    os.makedirs(args.dir, exist_ok=True)
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind((args.bind, args.port))
+    server.listen(8)
+    print('Listening on %s:%d, storing into %s' % (args.bind, args.port, args.dir), flush=True)
+
+    while True:
+        conn, _ = server.accept()
+        Session(conn, args).start()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Receiver for pictures the firmware saves over MQTT (`transport mqtt`).
+
+Subscribes to the image topics of every device (or just --device) and puts
+the chunks of every transfer back together:
+
+  ESP32/shape_detector/<device>/image/<id>/begin  {"path": .., "chunk": .., "qos": ..}
+  ESP32/shape_detector/<device>/image/<id>/<seq>  raw bytes, seq from 0
+  ESP32/shape_detector/<device>/image/<id>/end    {"chunks": .., "bytes": ..,
+                                                   "complete": .., "enqueue_retries": ..,
+                                                   "elapsed_us": ..}
+
+A complete transfer is written to --dir/<device>/ under the base name of its
+path, and one line reports its size, chunk count, throughput and the chunks
+the firmware had to queue again. Transfers with chunks missing (QoS 0 drops)
+are reported and not written.
+
+  tools/mqtt_receiver.py --broker mqtt://localhost:1883 --dir pictures
+"""
+import argparse
+import json
+import os
+import socket
+import struct
+import sys
+import time
+import urllib.parse
+
+TOPIC_BASE = 'ESP32/shape_detector/'
+# Chunks may still be on their way when the end arrives
+LATE_CHUNKS_S = 2.0
+
+
+class Transfer:
+    def __init__(self):
+        self.info = {}
+        self.end = None
+        self.chunks = {}
+        self.ended = None
+
+
+class MqttReceiver:
+    """Just enough MQTT 3.1.1 to subscribe with QoS 1."""
+
+    def __init__(self, uri, device=None):
+        url = urllib.parse.urlparse(uri)
+        self.sock = socket.create_connection((url.hostname or 'localhost', url.port or 1883))
+
+        client_id = ('receiver-%d' % os.getpid()).encode()
+        self._send(0x10, self._str(b'MQTT') + bytes([4, 0x02, 0, 0]) + self._str(client_id))
+        if self._read_packet()[0] >> 4 != 2:
+            raise RuntimeError('broker refused the connection')
+
+        topic = (TOPIC_BASE + (device or '+') + '/image/#').encode()
+        self._send(0x82, struct.pack('>H', 1) + self._str(topic) + b'\x01')
+
+    @staticmethod
+    def _str(data):
+        return struct.pack('>H', len(data)) + data
+
+    def _send(self, header, body):
+        length, encoded = len(body), b''
+        while True:
+            byte, length = length % 128, length // 128
+            encoded += bytes([byte | (0x80 if length else 0)])
+            if not length:
+                break
+        self.sock.sendall(bytes([header]) + encoded + body)
+
+    def _recv_exact(self, size):
+        data = b''
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                raise ConnectionError('broker closed the connection')
+            data += chunk
+        return data
+
+    def _read_packet(self):
+        header = self._recv_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self._recv_exact(1)[0]
+            length |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        return header, self._recv_exact(length)
+
+    def receive(self, timeout):
+        """Returns (topic, payload bytes), or None when nothing came in time."""
+        self.sock.settimeout(timeout)
+        while True:
+            try:
+                header, body = self._read_packet()
+            except socket.timeout:
+                return None
+            if header >> 4 != 3:
+                continue
+            topic_len = struct.unpack('>H', body[:2])[0]
+            topic = body[2:2 + topic_len].decode()
+            offset = 2 + topic_len
+            if header & 0x06:
+                self._send(0x40, body[offset:offset + 2])
+                offset += 2
+            return topic, body[offset:]
+
+
+def finish(device, xfer_id, transfer, directory):
+    end = transfer.end
+    name = os.path.basename(transfer.info.get('path', xfer_id)) or xfer_id
+    path = os.path.join(directory, device, name)
+    name = '%s/%s' % (device, name)
+    missing = [seq for seq in range(end['chunks']) if seq not in transfer.chunks]
+    data = b''.join(transfer.chunks[seq] for seq in range(end['chunks']) if seq in transfer.chunks)
+    elapsed_ms = end.get('elapsed_us', 0) / 1000.0
+    rate = len(data) / 1.024 / elapsed_ms if elapsed_ms > 0 else 0.0
+
+    if not end.get('complete'):
+        print('%s: the firmware gave up after %d chunks' % (name, end['chunks']), flush=True)
+        return False
+    if missing or len(data) != end['bytes']:
+        print('%s: %d of %d chunks missing (%s), not written'
+              % (name, len(missing), end['chunks'], ' '.join(map(str, missing[:16]))), flush=True)
+        return False
+
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as picture:
+        picture.write(data)
+
+    print('%s: %d bytes in %d chunks of %s B (QoS %s), %.1f ms on the device (%.1f KiB/s), '
+          '%d enqueue retries' % (name, len(data), end['chunks'],
+                                  transfer.info.get('chunk', '?'), transfer.info.get('qos', '?'),
+                                  elapsed_ms, rate, end.get('enqueue_retries', 0)), flush=True)
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--broker', default='mqtt://localhost:1883')
+    parser.add_argument('--device', help='only the pictures of this device ID')
+    parser.add_argument('--dir', default='.')
+    parser.add_argument('--count', type=int, default=0,
+                        help='exit after this many transfers (0 runs until interrupted)')
+    args = parser.parse_args()
+
+    os.makedirs(args.dir, exist_ok=True)
+    link = MqttReceiver(args.broker, args.device)
+    transfers = {}
+    finished = 0
+
+    while not args.count or finished < args.count:
+        message = link.receive(0.5)
+        if message:
+            topic, payload = message
+            parts = topic[len(TOPIC_BASE):].split('/')
+            if len(parts) != 4 or parts[1] != 'image':
+                continue
+            device, _, xfer_id, part = parts
+            transfer = transfers.setdefault((device, xfer_id), Transfer())
+            if part == 'begin':
+                transfer.info = json.loads(payload)
+            elif part == 'end':
+                transfer.end = json.loads(payload)
+                transfer.ended = time.monotonic()
+            elif part.isdigit():
+                transfer.chunks[int(part)] = payload
+
+        now = time.monotonic()
+        for (device, xfer_id), transfer in list(transfers.items()):
+            if transfer.end is None:
+                continue
+            complete = len(transfer.chunks) >= transfer.end['chunks']
+            if complete or now - transfer.ended > LATE_CHUNKS_S:
+                finish(device, xfer_id, transfer, args.dir)
+                del transfers[device, xfer_id]
+                finished += 1
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(130)